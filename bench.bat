@@ -0,0 +1,10 @@
+@echo off
+
+if not exist build/bench/ mkdir build\bench
+
+set options=-nologo -W4 -WX
+set options=%options% -O2 -Zi
+set options=%options% -Febuild/bench.exe -Fobuild/bench/ -Fdbuild/bench/ -Isrc/
+set options=%options% bench/*.c src/internal.c src/platform.c src/frontend/*.c src/backend/*.c
+
+cl %options%
\ No newline at end of file
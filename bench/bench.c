@@ -0,0 +1,215 @@
+// Compiler throughput benchmark: compiles generated programs of increasing size
+// and reports the cost of each phase per token, HIR node and SB node.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frontend/frontend.h"
+#include "backend/sb_internal.h"
+#include "platform.h"
+
+#include "generate.h"
+
+static ScratchLibrary global_scratch_library;
+
+Scratch get_global_scratch(int conflict_count, Arena** conflicts) {
+    return scratch_get(&global_scratch_library, conflict_count, conflicts);
+}
+
+typedef enum {
+    PHASE_PARSE,
+    PHASE_LOWER,
+    PHASE_MEM2REG,
+    PHASE_SCCP,
+    PHASE_OPT,
+    PHASE_COMPACT,
+    PHASE_GCM,
+    NUM_PHASES
+} Phase;
+
+static const char* phase_name[NUM_PHASES] = {
+    "parse",
+    "hir_lower",
+    "sb_mem2reg",
+    "sb_sccp",
+    "sb_opt",
+    "sb_compact",
+    "gcm"
+};
+
+typedef struct {
+    int token_count;
+    int hir_node_count;
+    int sb_node_count;
+    int sb_optimized_node_count;
+    uint64_t phase_ns[NUM_PHASES];
+} Measurement;
+
+static bool measure(Arena* arena, GeneratedSource* source, Measurement* measurement) {
+    uint64_t begin = timer_ns();
+    HIR_Proc* hir_proc = parse(arena, "<generated>", source->data);
+    measurement->phase_ns[PHASE_PARSE] = timer_ns() - begin;
+
+    if (!hir_proc) {
+        return false;
+    }
+
+    SB_Context* context = sb_init();
+
+    begin = timer_ns();
+    SB_Proc* proc = hir_lower(context, hir_proc);
+    measurement->phase_ns[PHASE_LOWER] = timer_ns() - begin;
+
+    int sb_node_count_in = sb_node_count(context, proc);
+
+    begin = timer_ns();
+    sb_mem2reg(context, proc);
+    measurement->phase_ns[PHASE_MEM2REG] = timer_ns() - begin;
+
+    begin = timer_ns();
+    sb_sccp(context, proc);
+    measurement->phase_ns[PHASE_SCCP] = timer_ns() - begin;
+
+    begin = timer_ns();
+    sb_opt(context, proc);
+    measurement->phase_ns[PHASE_OPT] = timer_ns() - begin;
+
+    int sb_node_count_out = sb_node_count(context, proc);
+
+    begin = timer_ns();
+    sb_compact(context, proc);
+    measurement->phase_ns[PHASE_COMPACT] = timer_ns() - begin;
+
+    Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
+
+    begin = timer_ns();
+    global_code_motion(scratch.arena, context, proc);
+    measurement->phase_ns[PHASE_GCM] = timer_ns() - begin;
+
+    scratch_release(&scratch);
+
+    measurement->token_count = hir_proc->token_count;
+    measurement->hir_node_count = hir_node_count(hir_proc);
+    measurement->sb_node_count = sb_node_count_in;
+    measurement->sb_optimized_node_count = sb_node_count_out;
+
+    sb_free(context);
+    arena_reset(arena);
+
+    return true;
+}
+
+static int repeat_count(int line_count) {
+    if (line_count <= 10000) {
+        return 5;
+    }
+
+    if (line_count <= 100000) {
+        return 3;
+    }
+
+    return 1;
+}
+
+static void print_row(Shape shape, int line_count, Measurement* m, Phase phase) {
+    // sb_compact and gcm consume the optimized graph, every other phase is normalised by the lowered graph
+    int sb_nodes = phase >= PHASE_COMPACT ? m->sb_optimized_node_count : m->sb_node_count;
+    double ns = (double)m->phase_ns[phase];
+
+    printf("%-12s %8d %9d %9d %9d  %-10s %10.3f %9.2f %9.2f %9.2f\n",
+        shape_name[shape],
+        line_count,
+        m->token_count,
+        m->hir_node_count,
+        sb_nodes,
+        phase_name[phase],
+        ns / 1e6,
+        ns / m->token_count,
+        ns / m->hir_node_count,
+        ns / sb_nodes
+    );
+}
+
+static int sizes[] = {
+    1000,
+    3000,
+    10000,
+    30000,
+    100000,
+    300000,
+    1000000
+};
+
+int main(int argc, char** argv) {
+    int max_lines = sizes[LENGTH(sizes) - 1];
+    int only_shape = -1;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--max-lines") == 0 && i + 1 < argc) {
+            max_lines = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--shape") == 0 && i + 1 < argc) {
+            char* name = argv[++i];
+
+            for (int shape = 0; shape < NUM_SHAPES; ++shape) {
+                if (strcmp(shape_name[shape], name) == 0) {
+                    only_shape = shape;
+                }
+            }
+
+            if (only_shape == -1) {
+                printf("Unknown shape '%s'\n", name);
+                return 1;
+            }
+        }
+        else {
+            printf("usage: %s [--max-lines N] [--shape nested_if|while_chain|vars|expression|store_chain|block_chain|fan_out]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Arena arena = init_arena(ARENA_RESERVE_SIZE);
+    init_scratch_library(&global_scratch_library, ARENA_RESERVE_SIZE);
+
+    printf("%-12s %8s %9s %9s %9s  %-10s %10s %9s %9s %9s\n",
+        "shape", "lines", "tokens", "hir", "sb", "phase", "ms", "ns/token", "ns/hir", "ns/sb");
+
+    for (int shape = 0; shape < NUM_SHAPES; ++shape) {
+        if (only_shape != -1 && shape != only_shape) {
+            continue;
+        }
+
+        for (int i = 0; i < (int)LENGTH(sizes) && sizes[i] <= max_lines; ++i) {
+            GeneratedSource source = generate_source(shape, sizes[i]);
+
+            Measurement best = {0};
+
+            for (int j = 0; j < repeat_count(sizes[i]); ++j) {
+                Measurement m = {0};
+
+                if (!measure(&arena, &source, &m)) {
+                    printf("Failed to compile generated '%s' source\n", shape_name[shape]);
+                    return 1;
+                }
+
+                for (int phase = 0; phase < NUM_PHASES; ++phase) {
+                    if (j > 0 && best.phase_ns[phase] < m.phase_ns[phase]) {
+                        m.phase_ns[phase] = best.phase_ns[phase];
+                    }
+                }
+
+                best = m;
+            }
+
+            for (int phase = 0; phase < NUM_PHASES; ++phase) {
+                print_row(shape, source.line_count, &best, phase);
+            }
+
+            fflush(stdout);
+            free_generated_source(&source);
+        }
+    }
+
+    return 0;
+}
\ No newline at end of file
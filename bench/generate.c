@@ -0,0 +1,195 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#include "generate.h"
+
+#define NESTING_DEPTH 32
+#define EXPRESSION_LINES 64
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    int line_count;
+    int indent;
+} Builder;
+
+static void emit(Builder* b, char* format, ...) {
+    va_list arguments;
+
+    va_start(arguments, format);
+    int length = vsnprintf(0, 0, format, arguments);
+    va_end(arguments);
+
+    size_t required = b->length + b->indent * 4 + length + 2;
+
+    if (required > b->capacity) {
+        while (required > b->capacity) {
+            b->capacity = b->capacity ? b->capacity * 2 : 4096;
+        }
+
+        b->data = realloc(b->data, b->capacity);
+    }
+
+    memset(b->data + b->length, ' ', b->indent * 4);
+    b->length += b->indent * 4;
+
+    va_start(arguments, format);
+    vsnprintf(b->data + b->length, length + 1, format, arguments);
+    va_end(arguments);
+
+    b->length += length;
+    b->data[b->length++] = '\n';
+    b->data[b->length] = '\0';
+    b->line_count++;
+}
+
+static void emit_nested_if(Builder* b, int depth) {
+    emit(b, "if x {");
+    b->indent++;
+    emit(b, "x = x + %d;", depth);
+
+    if (depth > 1) {
+        emit_nested_if(b, depth - 1);
+    }
+
+    b->indent--;
+    emit(b, "} else {");
+    b->indent++;
+    emit(b, "x = x - %d;", depth);
+    b->indent--;
+    emit(b, "}");
+}
+
+static void emit_while(Builder* b, int index) {
+    emit(b, "var i%d;", index);
+    emit(b, "i%d = %d;", index, index % 10 + 1);
+    emit(b, "while i%d {", index);
+    b->indent++;
+    emit(b, "x = x + i%d * 2;", index);
+    emit(b, "i%d = i%d - 1;", index, index);
+    b->indent--;
+    emit(b, "}");
+}
+
+// Each variable also feeds x, or the chain would be dead by the return
+static void emit_var(Builder* b, int index) {
+    if (index == 0) {
+        emit(b, "var v0; v0 = x;");
+    }
+    else {
+        emit(b, "var v%d; v%d = v%d * 3 + %d; x = x + v%d;", index, index, index - 1, index, index);
+    }
+}
+
+// Leaves x unknown to constant propagation, so sb_sccp can't fold a shape
+// away and every phase after it still has the whole shape to work on
+static void emit_opaque_x(Builder* b) {
+    emit(b, "var n; n = 3;");
+    emit(b, "while n { x = x * 2; n = n - 1; }");
+}
+
+// One store per line, a single chain as long as the function. There are no
+// constants, so no node gathers a user per line and only depth is measured.
+static void emit_store_chain(Builder* b) {
+    emit(b, "x = x + x;");
+}
+
+// A diamond every three lines, in a sequence of blocks as long as the function
+static void emit_block_chain(Builder* b) {
+    emit(b, "if x {");
+    b->indent++;
+    emit(b, "x = x + x;");
+    b->indent--;
+    emit(b, "}");
+}
+
+// Every line adds the same zero, so the constant gathers a user per line
+// and sb_opt deletes all of them again
+static void emit_fan_out(Builder* b) {
+    emit(b, "x = x + 0;");
+}
+
+static void emit_expression(Builder* b, int index) {
+    static char* terms[] = {
+        "+ x * 3",
+        "- x / 7",
+        "+ 11",
+        "* 5 - x",
+    };
+
+    emit(b, "x = x");
+    b->indent++;
+
+    for (int i = 0; i < EXPRESSION_LINES - 2; ++i) {
+        emit(b, "%s", terms[(index + i) % (sizeof(terms) / sizeof(terms[0]))]);
+    }
+
+    emit(b, "+ %d;", index);
+    b->indent--;
+}
+
+GeneratedSource generate_source(Shape shape, int line_count) {
+    Builder b = {0};
+
+    emit(&b, "{");
+    b.indent++;
+    emit(&b, "var x;");
+    emit(&b, "x = 1;");
+    emit_opaque_x(&b);
+
+    for (int index = 0; b.line_count < line_count - 2; ++index) {
+        switch (shape) {
+            default:
+                assert("unknown shape" && false);
+                break;
+
+            case SHAPE_NESTED_IF:
+                emit_nested_if(&b, NESTING_DEPTH);
+                break;
+
+            case SHAPE_WHILE_CHAIN:
+                emit_while(&b, index);
+                break;
+
+            case SHAPE_VARS:
+                emit_var(&b, index);
+                break;
+
+            case SHAPE_EXPRESSION:
+                emit_expression(&b, index);
+                break;
+
+            case SHAPE_STORE_CHAIN:
+                emit_store_chain(&b);
+                break;
+
+            case SHAPE_BLOCK_CHAIN:
+                emit_block_chain(&b);
+                break;
+
+            case SHAPE_FAN_OUT:
+                emit_fan_out(&b);
+                break;
+        }
+    }
+
+    emit(&b, "return x;");
+    b.indent--;
+    emit(&b, "}");
+
+    return (GeneratedSource) {
+        .data = b.data,
+        .length = b.length,
+        .line_count = b.line_count
+    };
+}
+
+void free_generated_source(GeneratedSource* source) {
+    free(source->data);
+    memset(source, 0, sizeof(*source));
+}
\ No newline at end of file
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+#define X(name, ...) SHAPE_##name,
+typedef enum {
+    #include "shapes.inc"
+    NUM_SHAPES
+} Shape;
+#undef X
+
+#define X(name, id) id,
+static const char* shape_name[NUM_SHAPES] = {
+    #include "shapes.inc"
+};
+#undef X
+
+typedef struct {
+    char* data;
+    size_t length;
+    int line_count;
+} GeneratedSource;
+
+// Builds a single procedure of roughly `line_count` lines in the given shape.
+GeneratedSource generate_source(Shape shape, int line_count);
+void free_generated_source(GeneratedSource* source);
\ No newline at end of file
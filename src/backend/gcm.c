@@ -6,12 +6,23 @@ static GCM_Block* make_block(Arena* arena) {
     return arena_type(arena, GCM_Block);
 }
 
-static GCM_Block* build_control_flow_graph(Arena* arena, Bitset* visited, SB_Node* node, GCM_Block** head, GCM_Block* current, GCM_Block** assignment) {
-    if (bitset_get(visited, node->id)) {
-        return assignment[node->id];
-    }
+typedef struct {
+    SB_Node* node;
+    int user;
+    GCM_Block* block;
+    bool new_block;
+} CFGFrame;
+
+typedef struct {
+    Arena* arena;
+    int count;
+    int capacity;
+    CFGFrame* data;
+} CFGStack;
 
-    bitset_set(visited, node->id);
+// Assigns `node` to a block, opening a new one if it starts one, and queues its control users
+static void cfg_enter(CFGStack* stack, NodeSet* visited, NodeMap* assignment, Arena* arena, SB_Node* node, GCM_Block* current) {
+    node_set_add(visited, node);
 
     bool new_block = false;
 
@@ -20,27 +31,73 @@ static GCM_Block* build_control_flow_graph(Arena* arena, Bitset* visited, SB_Nod
         new_block = true;
     }
 
-    assignment[node->id] = current;
+    node_map_set(assignment, node, current);
 
-    for (SB_User* user = node->users; user; user = user->next) {
-        if (!(user->node->flags & SB_NODE_FLAG_PRODUCES_CONTROL)) {
-            continue;
+    if (stack->count == stack->capacity) {
+        int new_capacity = stack->capacity ? stack->capacity * 2 : 64;
+        CFGFrame* new_data = arena_array(stack->arena, CFGFrame, new_capacity);
+        memcpy(new_data, stack->data, stack->count * sizeof(CFGFrame));
+
+        stack->capacity = new_capacity;
+        stack->data = new_data;
+    }
+
+    stack->data[stack->count++] = (CFGFrame) {
+        .node = node,
+        .block = current,
+        .new_block = new_block
+    };
+}
+
+static void cfg_link(GCM_Block* block, GCM_Block* successor) {
+    if (successor != block) {
+        block->successors[block->successor_count++] = successor;
+        successor->predecessor_count++;
+    }
+}
+
+// Walks control users depth first from START. A block is pushed onto the
+// list once everything after it is done, so the list comes out in the
+// same order as a recursive walk would leave it.
+static void build_control_flow_graph(Arena* arena, Arena* scratch, NodeSet* visited, SB_Node* start, GCM_Block** head, NodeMap* assignment) {
+    CFGStack stack = { .arena = scratch };
+    cfg_enter(&stack, visited, assignment, arena, start, 0);
+
+    while (stack.count) {
+        CFGFrame* frame = &stack.data[stack.count - 1];
+        SB_Node* node = frame->node;
+
+        while (frame->user < node->user_count && !(node->users[frame->user].node->flags & SB_NODE_FLAG_PRODUCES_CONTROL)) {
+            frame->user++;
         }
 
-        GCM_Block* result = build_control_flow_graph(arena, visited, user->node, head, current, assignment);
+        if (frame->user == node->user_count) {
+            CFGFrame done = stack.data[--stack.count];
+
+            if (done.new_block) {
+                done.block->next = *head;
+                *head = done.block;
+            }
+
+            if (stack.count) {
+                CFGFrame* parent = &stack.data[stack.count - 1];
+                cfg_link(parent->block, done.block);
+                parent->user++;
+            }
 
-        if (result != current) {
-            current->successors[current->successor_count++] = result;
-            result->predecessor_count++;
+            continue;
         }
-    }
 
-    if (new_block) {
-        current->next = *head;
-        *head = current;
-    }
+        SB_Node* user = node->users[frame->user].node;
 
-    return current;
+        if (node_set_has(visited, user)) {
+            cfg_link(frame->block, node_map_get(assignment, user));
+            frame->user++;
+        }
+        else {
+            cfg_enter(&stack, visited, assignment, arena, user, frame->block);
+        }
+    }
 }
 
 static int assign_tids(GCM_Block* control_flow_head) {
@@ -51,99 +108,882 @@ static int assign_tids(GCM_Block* control_flow_head) {
     return count;
 }
 
-static GCM_Block* intersect(GCM_Block* a, GCM_Block* b) {
-    GCM_Block* finger1 = a;
-    GCM_Block* finger2 = b;
+static void get_predecessors(Arena* arena, GCM_Block* control_flow_head) {
+    for (GCM_Block* block = control_flow_head; block; block = block->next) {
+        block->predecessors = arena_array(arena, GCM_Block*, block->predecessor_count);
+        block->predecessor_count = 0;
+    }
+
+    for (GCM_Block* block = control_flow_head; block; block = block->next) {
+        for (int i = 0; i < block->successor_count; ++i) {
+            GCM_Block* successor = block->successors[i];
+            successor->predecessors[successor->predecessor_count++] = block;
+        }
+    }
+}
+
+typedef struct {
+    int count;
+    GCM_Block** preorder;
+    int* parent; // Preorder number of each block's spanning tree parent, by preorder number
+    int* number; // Preorder number by tid
+} DepthFirstTree;
+
+// One depth-first walk over the successors gives both the spanning tree the
+// dominator builder needs and a reverse postorder. Blocks are relinked and
+// renumbered in that order, so a block always comes after its dominators.
+static DepthFirstTree order_blocks(Arena* arena, GCM_Block** control_flow_head, int block_count) {
+    DepthFirstTree tree = {
+        .preorder = arena_array(arena, GCM_Block*, block_count),
+        .parent = arena_array(arena, int, block_count),
+        .number = arena_array(arena, int, block_count)
+    };
+
+    GCM_Block** postorder = arena_array(arena, GCM_Block*, block_count);
+    GCM_Block** stack = arena_array(arena, GCM_Block*, block_count);
+    int* next_successor = arena_array(arena, int, block_count);
+    Bitset* visited = make_bitset(arena, block_count);
+
+    int postorder_count = 0;
+    int stack_count = 0;
+
+    GCM_Block* entry = *control_flow_head;
+    bitset_set(visited, entry->tid);
+    tree.number[entry->tid] = tree.count;
+    tree.parent[tree.count] = -1;
+    tree.preorder[tree.count++] = entry;
+    stack[stack_count++] = entry;
+
+    while (stack_count) {
+        GCM_Block* block = stack[stack_count - 1];
+
+        if (next_successor[block->tid] < block->successor_count) {
+            GCM_Block* successor = block->successors[next_successor[block->tid]++];
+
+            if (!bitset_get(visited, successor->tid)) {
+                bitset_set(visited, successor->tid);
+                tree.number[successor->tid] = tree.count;
+                tree.parent[tree.count] = tree.number[block->tid];
+                tree.preorder[tree.count++] = successor;
+                stack[stack_count++] = successor;
+            }
+
+            continue;
+        }
+
+        postorder[postorder_count++] = block;
+        stack_count--;
+    }
+
+    assert("block is unreachable from the entry" && postorder_count == block_count);
+
+    // Preorder numbers stay valid across the renumbering, they're indexed by the new tids
+    int* number = arena_array(arena, int, block_count);
+    *control_flow_head = 0;
+
+    for (int i = 0; i < postorder_count; ++i) {
+        GCM_Block* block = postorder[i];
+        int tid = postorder_count - 1 - i;
+
+        number[tid] = tree.number[block->tid];
+        block->tid = tid;
+        block->next = *control_flow_head;
+        *control_flow_head = block;
+    }
+
+    tree.number = number;
+
+    return tree;
+}
+
+// Semi-NCA: semidominators come from path-compressed evaluation over the
+// spanning tree, and each immediate dominator is then the nearest common
+// ancestor of the block's tree parent and its semidominator. Near-linear, and
+// no fixpoint to iterate on large graphs.
+static int eval(int* ancestor, int* label, int* semi, int* stack, int v) {
+    if (ancestor[v] < 0) {
+        return v;
+    }
+
+    int stack_count = 0;
+
+    for (int u = v; ancestor[ancestor[u]] >= 0; u = ancestor[u]) {
+        stack[stack_count++] = u;
+    }
+
+    while (stack_count) {
+        int u = stack[--stack_count];
+        int a = ancestor[u];
+
+        if (semi[label[a]] < semi[label[u]]) {
+            label[u] = label[a];
+        }
+
+        ancestor[u] = ancestor[a];
+    }
+
+    return label[v];
+}
+
+static void build_dominator_tree(Arena* arena, DepthFirstTree* tree) {
+    int count = tree->count;
+
+    int* semi = arena_array(arena, int, count);
+    int* label = arena_array(arena, int, count);
+    int* ancestor = arena_array(arena, int, count);
+    int* idom = arena_array(arena, int, count);
+    int* stack = arena_array(arena, int, count);
+
+    for (int v = 0; v < count; ++v) {
+        semi[v] = v;
+        label[v] = v;
+        ancestor[v] = -1;
+        idom[v] = tree->parent[v];
+    }
+
+    for (int w = count - 1; w > 0; --w) {
+        GCM_Block* block = tree->preorder[w];
 
-    while (finger1 != finger2) {
-        while (finger1->tid > finger2->tid) {
-            finger1 = finger1->immediate_dominator;
+        for (int i = 0; i < block->predecessor_count; ++i) {
+            int u = eval(ancestor, label, semi, stack, tree->number[block->predecessors[i]->tid]);
+
+            if (semi[u] < semi[w]) {
+                semi[w] = semi[u];
+            }
         }
 
-        while (finger2->tid > finger1->tid) {
-            finger2 = finger2->immediate_dominator;
+        ancestor[w] = tree->parent[w];
+    }
+
+    for (int w = 1; w < count; ++w) {
+        while (idom[w] > semi[w]) {
+            idom[w] = idom[idom[w]];
         }
     }
 
-    return finger1;
+    tree->preorder[0]->immediate_dominator = 0;
+
+    for (int w = 1; w < count; ++w) {
+        tree->preorder[w]->immediate_dominator = tree->preorder[idom[w]];
+    }
 }
 
-static void build_dominator_tree(GCM_Block* control_flow_head) {
-    control_flow_head->immediate_dominator = control_flow_head;
+// Depths plus pre/post numbers of the dominator tree, which make dominance
+// queries O(1). Blocks are in reverse postorder, so a block's immediate
+// dominator is always seen before it.
+static void number_dominator_tree(Arena* arena, GCM_Block* control_flow_head, int block_count) {
+    GCM_Block** first_child = arena_array(arena, GCM_Block*, block_count);
+    GCM_Block** next_sibling = arena_array(arena, GCM_Block*, block_count);
 
-    while (true) {
-        bool changed = false;
+    for (GCM_Block* block = control_flow_head; block; block = block->next) {
+        GCM_Block* idom = block->immediate_dominator;
+
+        if (idom) {
+            block->dom_depth = idom->dom_depth + 1;
+            next_sibling[block->tid] = first_child[idom->tid];
+            first_child[idom->tid] = block;
+        }
+        else {
+            block->dom_depth = 0;
+        }
+    }
+
+    GCM_Block** stack = arena_array(arena, GCM_Block*, block_count);
+    GCM_Block** cursor = arena_array(arena, GCM_Block*, block_count);
+    int stack_count = 0;
+    int counter = 0;
 
-        for (GCM_Block* block = control_flow_head->next; block; block = block->next) {
-            int first_predecessor = -1;
+    stack[stack_count++] = control_flow_head;
+    control_flow_head->dom_pre = counter++;
+    cursor[control_flow_head->tid] = first_child[control_flow_head->tid];
+
+    while (stack_count) {
+        GCM_Block* block = stack[stack_count - 1];
+        GCM_Block* child = cursor[block->tid];
+
+        if (child) {
+            cursor[block->tid] = next_sibling[child->tid];
+            child->dom_pre = counter++;
+            cursor[child->tid] = first_child[child->tid];
+            stack[stack_count++] = child;
+        }
+        else {
+            block->dom_post = counter++;
+            stack_count--;
+        }
+    }
+}
+
+static bool dominates(GCM_Block* a, GCM_Block* b) {
+    return a->dom_pre <= b->dom_pre && b->dom_post <= a->dom_post;
+}
+
+static GCM_Block* dominator_lca(GCM_Block* a, GCM_Block* b) {
+    while (!dominates(a, b)) {
+        a = a->immediate_dominator;
+    }
+
+    return a;
+}
+
+static GCM_Loop* outermost_loop(GCM_Loop* loop) {
+    while (loop->parent) {
+        loop = loop->parent;
+    }
+
+    return loop;
+}
+
+// Builds the loop nesting forest from back edges, which are edges into a
+// block that dominates their source. Headers are visited in reverse RPO, so
+// loops nested inside a header's body already exist when it's flooded and
+// whichever of them has no parent yet becomes its child.
+static void build_loop_forest(Arena* arena, Arena* scratch, GCM_Block* control_flow_head, int block_count) {
+    GCM_Block** blocks = arena_array(scratch, GCM_Block*, block_count);
+    Bitset* in_loop = make_bitset(scratch, block_count);
+    GCM_Block** stack = arena_array(scratch, GCM_Block*, block_count);
+
+    for (GCM_Block* block = control_flow_head; block; block = block->next) {
+        blocks[block->tid] = block;
+    }
+
+    for (int tid = block_count - 1; tid >= 0; --tid) {
+        GCM_Block* header = blocks[tid];
+        int stack_count = 0;
+
+        for (int i = 0; i < header->predecessor_count; ++i) {
+            GCM_Block* tail = header->predecessors[i];
+
+            if (dominates(header, tail) && !bitset_get(in_loop, tail->tid)) {
+                bitset_set(in_loop, tail->tid);
+                stack[stack_count++] = tail;
+            }
+        }
+
+        if (!stack_count) {
+            continue;
+        }
+
+        GCM_Loop* loop = arena_type(arena, GCM_Loop);
+        loop->header = header;
+
+        bitset_set(in_loop, header->tid);
+        header->loop = loop;
+
+        while (stack_count) {
+            GCM_Block* block = stack[--stack_count];
+
+            if (block == header) {
+                continue;
+            }
+
+            if (!block->loop) {
+                block->loop = loop;
+            }
+            else {
+                GCM_Loop* inner = outermost_loop(block->loop);
+
+                if (inner != loop) {
+                    inner->parent = loop;
+                }
+            }
 
             for (int i = 0; i < block->predecessor_count; ++i) {
-                if (block->predecessors[i]->immediate_dominator) {
-                    first_predecessor = i;
-                    break;
+                GCM_Block* predecessor = block->predecessors[i];
+
+                if (!bitset_get(in_loop, predecessor->tid)) {
+                    bitset_set(in_loop, predecessor->tid);
+                    stack[stack_count++] = predecessor;
                 }
             }
+        }
 
-            assert(first_predecessor != -1);
-            GCM_Block* new_idom = block->predecessors[first_predecessor];
+        bitset_clear(in_loop);
+    }
 
-            for (int i = 0; i < block->predecessor_count; ++i) {
-                if (i == first_predecessor || !block->predecessors[i]->immediate_dominator) {
+    // A loop's header comes before everything in it, including nested headers
+    for (GCM_Block* block = control_flow_head; block; block = block->next) {
+        GCM_Loop* loop = block->loop;
+
+        if (loop && loop->header == block) {
+            loop->depth = loop->parent ? loop->parent->depth + 1 : 1;
+        }
+
+        block->loop_depth = loop ? loop->depth : 0;
+    }
+}
+
+static bool is_pinned(SB_Node* node) {
+    return node->flags & SB_NODE_FLAG_IS_PINNED;
+}
+
+// Loads float between their inputs and their control input. A load never
+// moves below its control input, which keeps it ahead of the stores that
+// follow it, but it can leave a loop whose body doesn't write its memory
+// state. Loads only read stack slots and can't fault, so running one when
+// the loop doesn't is fine. Division can trap, so its control input is an
+// ordinary input instead: a division is never scheduled above it, and one
+// guarded inside a loop stays in the loop.
+static bool is_anchored(SB_Node* node) {
+    return node->op == SB_OP_LOAD;
+}
+
+static void collect_live_nodes(NodeSet* live, NodeList* list, SB_Proc* proc) {
+    NodeList stack = { .arena = list->arena };
+
+    node_set_add(live, proc->end);
+    node_list_push(&stack, proc->end);
+
+    while (stack.count) {
+        SB_Node* node = stack.data[--stack.count];
+        node_list_push(list, node);
+
+        for (int i = 0; i < node->in_count; ++i) {
+            SB_Node* input = node->_ins[i];
+
+            if (input && node_set_add(live, input)) {
+                node_list_push(&stack, input);
+            }
+        }
+    }
+}
+
+static void schedule_pinned(NodeMap* placement, NodeMap* assignment, NodeList* nodes) {
+    for (int i = 0; i < nodes->count; ++i) {
+        SB_Node* node = nodes->data[i];
+
+        if (!is_pinned(node)) {
+            continue;
+        }
+
+        // Control nodes were placed while building the CFG, everything else hangs off a control input
+        SB_Node* control = (node->flags & SB_NODE_FLAG_PRODUCES_CONTROL) ? node : node->_ins[0];
+        GCM_Block* block = node_map_get(assignment, control);
+
+        assert("pinned node is not in the control flow graph" && block);
+        node_map_set(placement, node, block);
+    }
+}
+
+typedef struct {
+    SB_Node* node;
+    int input;
+    int user;
+    SB_Node* reader;
+    bool started_readers;
+} ScheduleFrame;
+
+typedef struct {
+    Arena* arena;
+    int count;
+    int capacity;
+    ScheduleFrame* data;
+} ScheduleStack;
+
+static void schedule_push(ScheduleStack* stack, SB_Node* node) {
+    if (stack->count == stack->capacity) {
+        int new_capacity = stack->capacity ? stack->capacity * 2 : 64;
+        ScheduleFrame* new_data = arena_array(stack->arena, ScheduleFrame, new_capacity);
+        memcpy(new_data, stack->data, stack->count * sizeof(ScheduleFrame));
+
+        stack->capacity = new_capacity;
+        stack->data = new_data;
+    }
+
+    stack->data[stack->count++] = (ScheduleFrame) {
+        .node = node
+    };
+}
+
+// Floating nodes only depend on each other acyclically (every cycle passes
+// through a phi), so a depth-first walk that stops at pinned nodes always
+// finishes a node's inputs before the node itself.
+static void schedule_early(Arena* arena, NodeMap* placement, NodeList* nodes, GCM_Block* root) {
+    ScheduleStack stack = { .arena = arena };
+
+    for (int i = 0; i < nodes->count; ++i) {
+        SB_Node* node = nodes->data[i];
+
+        if (node_map_get(placement, node)) {
+            continue;
+        }
+
+        schedule_push(&stack, node);
+
+        while (stack.count) {
+            ScheduleFrame* frame = &stack.data[stack.count - 1];
+
+            if (frame->input < frame->node->in_count) {
+                SB_Node* input = frame->node->_ins[frame->input++];
+
+                if (input && !node_map_get(placement, input)) {
+                    schedule_push(&stack, input);
+                }
+
+                continue;
+            }
+
+            SB_Node* current = frame->node;
+            stack.count--;
+
+            if (node_map_get(placement, current)) {
+                continue;
+            }
+
+            GCM_Block* early = root;
+
+            for (int j = 0; j < current->in_count; ++j) {
+                if (!current->_ins[j]) {
+                    continue;
+                }
+
+                if (is_anchored(current) && j == LOAD_CONTROL) {
                     continue;
                 }
 
-                GCM_Block* p = block->predecessors[i];
-                new_idom = intersect(p, new_idom);
+                GCM_Block* block = node_map_get(placement, current->_ins[j]);
+
+                if (block->dom_depth > early->dom_depth) {
+                    early = block;
+                }
             }
 
-            if (new_idom != block->immediate_dominator) {
-                block->immediate_dominator = new_idom;
-                changed = true;
+            node_map_set(placement, current, early);
+        }
+    }
+}
+
+// A phi uses its inputs at the end of the matching predecessor, not in its own block
+static GCM_Block* use_block(NodeMap* placement, SB_User* user) {
+    if (user->node->op == SB_OP_PHI && user->index > 0) {
+        SB_Node* region = user->node->_ins[0];
+        SB_Node* control = region->_ins[user->index - 1];
+        return control ? node_map_get(placement, control) : 0;
+    }
+
+    return node_map_get(placement, user->node);
+}
+
+static void place_late(NodeMap* placement, NodeSet* live, SB_Node* node) {
+    GCM_Block* early = node_map_get(placement, node);
+    GCM_Block* lca = 0;
+
+    // A load's own block is the latest it can go, whatever its uses say
+    if (is_anchored(node)) {
+        lca = node_map_get(placement, node->_ins[LOAD_CONTROL]);
+    }
+    else {
+        for (SB_User* user = node->users; user < node->users + node->user_count; ++user) {
+            if (!node_set_has(live, user->node)) {
+                continue;
+            }
+
+            GCM_Block* block = use_block(placement, user);
+
+            if (block) {
+                lca = lca ? dominator_lca(lca, block) : block;
+            }
+
+            // Can't climb above the inputs, so the remaining uses don't matter
+            if (lca == early) {
+                break;
             }
         }
+    }
 
-        if (!changed) {
-            break;
+    if (!lca) {
+        return;
+    }
+
+    // Anywhere on the dominator path from the uses up to `early` is legal, prefer
+    // the shallowest loop and then the latest block. Nothing beats depth zero.
+    // A division's control is one of its inputs, so it never climbs above its guard.
+    GCM_Block* best = lca;
+
+    for (GCM_Block* block = lca; block != early && best->loop_depth;) {
+        block = block->immediate_dominator;
+        assert("early placement does not dominate uses" && block);
+
+        if (block->loop_depth < best->loop_depth) {
+            best = block;
         }
     }
 
-    control_flow_head->immediate_dominator = 0;
+    node_map_set(placement, node, best);
 }
 
-static void get_predecessors(Arena* arena, GCM_Block* control_flow_head) {
-    for (GCM_Block* block = control_flow_head; block; block = block->next) {
-        block->predecessors = arena_array(arena, GCM_Block*, block->predecessor_count);
-        block->predecessor_count = 0;
+static void schedule_late(Arena* arena, NodeMap* placement, NodeSet* live, NodeList* nodes) {
+    ScheduleStack stack = { .arena = arena };
+    NodeSet done = make_node_set(arena, live->bits->bit_count);
+
+    for (int i = 0; i < nodes->count; ++i) {
+        SB_Node* node = nodes->data[i];
+
+        if (is_pinned(node) || !node_set_add(&done, node)) {
+            continue;
+        }
+
+        schedule_push(&stack, node);
+
+        while (stack.count) {
+            ScheduleFrame* frame = &stack.data[stack.count - 1];
+
+            if (frame->user < frame->node->user_count) {
+                SB_Node* user = frame->node->users[frame->user++].node;
+
+                if (node_set_has(live, user) && !is_pinned(user) && node_set_add(&done, user)) {
+                    schedule_push(&stack, user);
+                }
+
+                continue;
+            }
+
+            place_late(placement, live, frame->node);
+            stack.count--;
+        }
     }
+}
 
-    for (GCM_Block* block = control_flow_head; block; block = block->next) {
-        for (int i = 0; i < block->successor_count; ++i) {
-            GCM_Block* successor = block->successors[i];
-            successor->predecessors[successor->predecessor_count++] = block;
+// Block starts come first, then phis, then everything else in dependence
+// order, then the terminator
+static int schedule_class(SB_Node* node) {
+    if (node->flags & SB_NODE_FLAG_STARTS_BLOCK) {
+        return 0;
+    }
+
+    switch (node->op) {
+        default:
+            return 2;
+
+        case SB_OP_PHI:
+            return 1;
+
+        case SB_OP_BRANCH:
+        case SB_OP_END:
+            return 3;
+    }
+}
+
+// Loads each store in a block has to wait for, as a list threaded through the loads
+typedef struct {
+    NodeMap position;
+    NodeMap first_reader;
+    NodeMap next_reader;
+    NodeMap next_store_to; // By alloca, only valid for stores in the block being swept
+} StoreReaders;
+
+// Place of a memory state along the part of the chain inside `block`. Stores
+// count from 1, anything from before the block or the phi at its top is 0.
+static int chain_position(StoreReaders* readers, NodeMap* placement, GCM_Block* block, SB_Node* state) {
+    int depth = 0;
+    SB_Node* base = state;
+
+    while (base->op == SB_OP_STORE && node_map_get(placement, base) == block && !node_map_get(&readers->position, base)) {
+        base = base->_ins[STORE_STORE];
+        depth++;
+    }
+
+    bool in_block = base->op == SB_OP_STORE && node_map_get(placement, base) == block;
+    int position = (in_block ? (int)(intptr_t)node_map_get(&readers->position, base) : 0) + depth;
+
+    for (int i = position; i > position - depth; --i) {
+        node_map_set(&readers->position, state, (void*)(intptr_t)i);
+        state = state->_ins[STORE_STORE];
+    }
+
+    return position;
+}
+
+static SB_Node* earlier_store(StoreReaders* readers, SB_Node* a, SB_Node* b) {
+    if (!a || !b) {
+        return a ? a : b;
+    }
+
+    intptr_t a_position = (intptr_t)node_map_get(&readers->position, a);
+    intptr_t b_position = (intptr_t)node_map_get(&readers->position, b);
+
+    return a_position < b_position ? a : b;
+}
+
+// A store has to follow every load in its block that reads an earlier state
+// and may alias it. Stores in a block form a single chain, so sweeping it
+// backwards finds the first such store for each load, and the stores after
+// that one follow it anyway.
+static void find_store_readers(Arena* scratch, StoreReaders* readers, NodeMap* placement, GCM_Block* block, int count, SB_Node** nodes) {
+    int store_count = 0;
+
+    for (int i = 0; i < count; ++i) {
+        if (nodes[i]->op == SB_OP_STORE) {
+            store_count++;
+        }
+    }
+
+    if (!store_count) {
+        return;
+    }
+
+    SB_Node** stores = arena_array(scratch, SB_Node*, store_count + 1);
+    SB_Node** loads = arena_array(scratch, SB_Node*, store_count + 1);
+
+    for (int i = 0; i < count; ++i) {
+        if (nodes[i]->op == SB_OP_STORE) {
+            int position = chain_position(readers, placement, block, nodes[i]);
+            assert("stores in a block are not a single chain" && !stores[position]);
+            stores[position] = nodes[i];
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (nodes[i]->op == SB_OP_LOAD) {
+            int position = chain_position(readers, placement, block, nodes[i]->_ins[LOAD_STORE]);
+            node_map_set(&readers->next_reader, nodes[i], loads[position]);
+            loads[position] = nodes[i];
         }
     }
+
+    SB_Node* next_store = 0;
+    SB_Node* next_unknown_store = 0;
+
+    for (int position = store_count; position >= 0; --position) {
+        SB_Node* load = loads[position];
+
+        while (load) {
+            SB_Node* next_load = node_map_get(&readers->next_reader, load);
+            SB_Node* address = load->_ins[LOAD_ADDRESS];
+            SB_Node* store = next_store;
+
+            if (address->op == SB_OP_ALLOCA) {
+                SB_Node* store_to = node_map_get(&readers->next_store_to, address);
+
+                if (store_to && node_map_get(placement, store_to) != block) {
+                    store_to = 0;
+                }
+
+                store = earlier_store(readers, store_to, next_unknown_store);
+            }
+
+            node_map_set(&readers->next_reader, load, store ? node_map_get(&readers->first_reader, store) : 0);
+
+            if (store) {
+                node_map_set(&readers->first_reader, store, load);
+            }
+
+            load = next_load;
+        }
+
+        SB_Node* store = stores[position];
+
+        if (store) {
+            SB_Node* address = store->_ins[STORE_ADDRESS];
+            next_store = store;
+
+            if (address->op == SB_OP_ALLOCA) {
+                node_map_set(&readers->next_store_to, address, store);
+            }
+            else {
+                next_unknown_store = store;
+            }
+        }
+    }
+}
+
+// Same-block inputs first, and for a store, the loads it has to wait for
+static SB_Node* next_local_dependency(StoreReaders* readers, NodeMap* placement, GCM_Block* block, ScheduleFrame* frame) {
+    SB_Node* node = frame->node;
+    int input_count = node->op == SB_OP_PHI ? 1 : node->in_count;
+
+    while (frame->input < input_count) {
+        SB_Node* input = node->_ins[frame->input++];
+
+        if (input && node_map_get(placement, input) == block) {
+            return input;
+        }
+    }
+
+    if (node->op != SB_OP_STORE) {
+        return 0;
+    }
+
+    if (!frame->started_readers) {
+        frame->started_readers = true;
+        frame->reader = node_map_get(&readers->first_reader, node);
+    }
+
+    SB_Node* reader = frame->reader;
+
+    if (reader) {
+        frame->reader = node_map_get(&readers->next_reader, reader);
+    }
+
+    return reader;
+}
+
+static void append_node(Arena* arena, GCM_Block* block, SB_Node* node) {
+    GCM_Node* gcm_node = arena_type(arena, GCM_Node);
+    gcm_node->block = block;
+    gcm_node->node = node;
+
+    gcm_node->prev = block->end;
+
+    if (block->end) {
+        block->end->next = gcm_node;
+    }
+    else {
+        block->start = gcm_node;
+    }
+
+    block->end = gcm_node;
+}
+
+static void schedule_block(Arena* arena, Arena* scratch, StoreReaders* readers, NodeMap* placement, NodeSet* scheduled, GCM_Block* block, int count, SB_Node** nodes) {
+    ScheduleStack stack = { .arena = scratch };
+
+    find_store_readers(scratch, readers, placement, block, count, nodes);
+
+    for (int schedule = 0; schedule <= 3; ++schedule) {
+        for (int i = 0; i < count; ++i) {
+            if (schedule_class(nodes[i]) != schedule || !node_set_add(scheduled, nodes[i])) {
+                continue;
+            }
+
+            schedule_push(&stack, nodes[i]);
+
+            while (stack.count) {
+                ScheduleFrame* frame = &stack.data[stack.count - 1];
+                SB_Node* dependency = next_local_dependency(readers, placement, block, frame);
+
+                if (dependency) {
+                    if (node_set_add(scheduled, dependency)) {
+                        schedule_push(&stack, dependency);
+                    }
+
+                    continue;
+                }
+
+                append_node(arena, block, frame->node);
+                stack.count--;
+            }
+        }
+    }
+}
+
+static void schedule_local(Arena* arena, Arena* scratch, NodeMap* placement, NodeList* nodes, GCM_Block* control_flow_head, int block_count) {
+    int* counts = arena_array(scratch, int, block_count);
+    SB_Node*** block_nodes = arena_array(scratch, SB_Node**, block_count);
+
+    for (int i = 0; i < nodes->count; ++i) {
+        GCM_Block* block = node_map_get(placement, nodes->data[i]);
+        counts[block->tid]++;
+    }
+
+    for (int i = 0; i < block_count; ++i) {
+        block_nodes[i] = arena_array(scratch, SB_Node*, counts[i]);
+        counts[i] = 0;
+    }
+
+    // Walk the live list backwards so nodes come out roughly in definition order
+    for (int i = nodes->count - 1; i >= 0; --i) {
+        GCM_Block* block = node_map_get(placement, nodes->data[i]);
+        block_nodes[block->tid][counts[block->tid]++] = nodes->data[i];
+    }
+
+    NodeSet scheduled = make_node_set(scratch, nodes->count);
+
+    StoreReaders readers = {
+        .position = make_node_map(scratch, nodes->count),
+        .first_reader = make_node_map(scratch, nodes->count),
+        .next_reader = make_node_map(scratch, nodes->count),
+        .next_store_to = make_node_map(scratch, nodes->count)
+    };
+
+    for (GCM_Block* block = control_flow_head; block; block = block->next) {
+        schedule_block(arena, scratch, &readers, placement, &scheduled, block, counts[block->tid], block_nodes[block->tid]);
+    }
 }
 
 GCM_Block* global_code_motion(Arena* arena, SB_Context* context, SB_Proc* proc) {
     Scratch scratch = scratch_get(&context->scratch_library, 1, &arena);
 
     GCM_Block* control_flow_head = 0;
-    Bitset* visited = make_bitset(scratch.arena, context->next_id);
-    GCM_Block** assignment = arena_array(scratch.arena, GCM_Block*, context->next_id);
+    NodeSet visited = make_node_set(scratch.arena, context->next_id);
+    NodeMap assignment = make_node_map(scratch.arena, context->next_id);
 
-    build_control_flow_graph(arena, visited, proc->start, &control_flow_head, 0, assignment);
-    assign_tids(control_flow_head);
+    build_control_flow_graph(arena, scratch.arena, &visited, proc->start, &control_flow_head, &assignment);
+    int block_count = assign_tids(control_flow_head);
 
     get_predecessors(arena, control_flow_head);
-    build_dominator_tree(control_flow_head);
 
-    scratch_release(&scratch);
+    DepthFirstTree tree = order_blocks(scratch.arena, &control_flow_head, block_count);
+    build_dominator_tree(scratch.arena, &tree);
+    number_dominator_tree(scratch.arena, control_flow_head, block_count);
+    build_loop_forest(arena, scratch.arena, control_flow_head, block_count);
 
-    gcm_print(control_flow_head);
+    NodeSet live = make_node_set(scratch.arena, context->next_id);
+    NodeList nodes = { .arena = scratch.arena };
+    collect_live_nodes(&live, &nodes, proc);
+
+    NodeMap placement = make_node_map(scratch.arena, context->next_id);
+
+    schedule_pinned(&placement, &assignment, &nodes);
+    schedule_early(scratch.arena, &placement, &nodes, control_flow_head);
+    schedule_late(scratch.arena, &placement, &live, &nodes);
+    schedule_local(arena, scratch.arena, &placement, &nodes, control_flow_head, block_count);
+
+    scratch_release(&scratch);
 
     return control_flow_head;
 }
 
+// A join point is in the frontier of every block on the way up the dominator
+// tree from each of its predecessors, stopping at its immediate dominator.
+// Counted first so each frontier is a single allocation.
+void gcm_dominance_frontiers(Arena* arena, SB_Context* context, GCM_Block* control_flow_head) {
+    Scratch scratch = scratch_get(&context->scratch_library, 1, &arena);
+    int block_count = assign_tids(control_flow_head);
+
+    // Tid plus one of the last join added to each block's frontier
+    int* last_join = arena_array(scratch.arena, int, block_count);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        for (GCM_Block* block = control_flow_head; block; block = block->next) {
+            if (pass == 0) {
+                block->frontier_count = 0;
+            }
+            else {
+                block->frontier = arena_array(arena, GCM_Block*, block->frontier_count);
+                block->frontier_count = 0;
+            }
+
+            last_join[block->tid] = 0;
+        }
+
+        for (GCM_Block* join = control_flow_head; join; join = join->next) {
+            if (join->predecessor_count < 2) {
+                continue;
+            }
+
+            for (int i = 0; i < join->predecessor_count; ++i) {
+                for (GCM_Block* runner = join->predecessors[i]; runner && runner != join->immediate_dominator; runner = runner->immediate_dominator) {
+                    // Another predecessor already walked the rest of the way up
+                    if (last_join[runner->tid] == join->tid + 1) {
+                        break;
+                    }
+
+                    last_join[runner->tid] = join->tid + 1;
+
+                    if (pass == 1) {
+                        runner->frontier[runner->frontier_count] = join;
+                    }
+
+                    runner->frontier_count++;
+                }
+            }
+        }
+    }
+
+    scratch_release(&scratch);
+}
+
 void gcm_print(GCM_Block* control_flow_head) {
     assign_tids(control_flow_head);
 
@@ -154,6 +994,32 @@ void gcm_print(GCM_Block* control_flow_head) {
             printf("  idom: bb_%d\n", block->immediate_dominator->tid);
         }
 
+        if (block->loop_depth) {
+            printf("  loop depth: %d, header: bb_%d\n", block->loop_depth, block->loop->header->tid);
+        }
+
+        for (GCM_Node* gcm_node = block->start; gcm_node; gcm_node = gcm_node->next) {
+            SB_Node* node = gcm_node->node;
+            printf("  n%d = %s", node->id, sb_op_name[node->op]);
+
+            if (node->op == SB_OP_INTEGER_CONSTANT) {
+                uint64_t value;
+                memcpy(&value, sb_node_data(node), sizeof(value));
+                printf(" %lld", (long long)value);
+            }
+
+            for (int i = 0; i < node->in_count; ++i) {
+                if (node->_ins[i]) {
+                    printf(" n%d", node->_ins[i]->id);
+                }
+                else {
+                    printf(" _");
+                }
+            }
+
+            printf("\n");
+        }
+
         if (block->successor_count == 1) {
             printf("  jmp bb_%d\n", block->successors[0]->tid);
         }
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+
+#include "sb_internal.h"
+
+bool is_value_numbered(SB_OpCode op) {
+    switch (op) {
+        default:
+            return false;
+
+        case SB_OP_INTEGER_CONSTANT:
+        case SB_OP_ADD:
+        case SB_OP_SUB:
+        case SB_OP_MUL:
+        case SB_OP_SDIV: // Its control is an input, divisions under different guards stay apart
+        case SB_OP_LOAD: // Same control, memory state and address read the same value
+            return true;
+    }
+}
+
+static uint64_t value_hash(SB_OpCode op, int in_count, SB_Node** ins, void* data, int data_size) {
+    uint64_t hash = fnv1a_hash(&op, sizeof(op));
+
+    for (int i = 0; i < in_count; ++i) {
+        int id = ins[i] ? ins[i]->id : -1;
+        hash = (hash ^ (uint64_t)(uint32_t)id) * 0x100000001b3;
+    }
+
+    if (data_size) {
+        hash ^= fnv1a_hash(data, data_size);
+    }
+
+    return hash ^ (hash >> 29);
+}
+
+static uint64_t node_hash(SB_Node* node) {
+    return value_hash(node->op, node->in_count, node->_ins, sb_node_data(node), node->data_size);
+}
+
+static bool value_equal(SB_Node* node, SB_OpCode op, int in_count, SB_Node** ins, void* data, int data_size) {
+    if (node->op != op || node->in_count != in_count || node->data_size != data_size) {
+        return false;
+    }
+
+    for (int i = 0; i < in_count; ++i) {
+        if (node->_ins[i] != ins[i]) {
+            return false;
+        }
+    }
+
+    return data_size == 0 || memcmp(sb_node_data(node), data, data_size) == 0;
+}
+
+static void value_table_insert_static(int capacity, SB_Node** slots, SB_Node* node) {
+    int i = (int)(node_hash(node) & (capacity - 1));
+
+    while (slots[i]) {
+        i = (i + 1) & (capacity - 1);
+    }
+
+    slots[i] = node;
+}
+
+static void value_table_make_room(ValueTable* table) {
+    if (!table->capacity || load_factor(table->count, table->capacity) > 0.5f) {
+        int new_capacity = table->capacity ? table->capacity * 2 : 64;
+        SB_Node** new_slots = calloc(new_capacity, sizeof(SB_Node*));
+
+        for (int i = 0; i < table->capacity; ++i) {
+            if (table->slots[i]) {
+                value_table_insert_static(new_capacity, new_slots, table->slots[i]);
+            }
+        }
+
+        free(table->slots);
+
+        table->capacity = new_capacity;
+        table->slots = new_slots;
+    }
+}
+
+SB_Node* value_table_lookup(SB_Context* context, SB_OpCode op, int in_count, SB_Node** ins, void* data, int data_size) {
+    ValueTable* table = &context->value_table;
+
+    if (!context->value_numbering || !table->count) {
+        return 0;
+    }
+
+    int i = (int)(value_hash(op, in_count, ins, data, data_size) & (table->capacity - 1));
+
+    while (table->slots[i]) {
+        if (value_equal(table->slots[i], op, in_count, ins, data, data_size)) {
+            return table->slots[i];
+        }
+
+        i = (i + 1) & (table->capacity - 1);
+    }
+
+    return 0;
+}
+
+SB_Node* value_table_find_or_insert(SB_Context* context, SB_Node* node) {
+    if (!context->value_numbering || !is_value_numbered(node->op)) {
+        return node;
+    }
+
+    ValueTable* table = &context->value_table;
+    value_table_make_room(table);
+
+    int i = (int)(node_hash(node) & (table->capacity - 1));
+
+    while (table->slots[i]) {
+        SB_Node* existing = table->slots[i];
+
+        if (existing == node || value_equal(existing, node->op, node->in_count, node->_ins, sb_node_data(node), node->data_size)) {
+            return existing;
+        }
+
+        i = (i + 1) & (table->capacity - 1);
+    }
+
+    table->slots[i] = node;
+    table->count++;
+
+    return node;
+}
+
+void value_table_remove(SB_Context* context, SB_Node* node) {
+    ValueTable* table = &context->value_table;
+
+    if (!table->count || !is_value_numbered(node->op)) {
+        return;
+    }
+
+    int mask = table->capacity - 1;
+    int i = (int)(node_hash(node) & mask);
+
+    while (table->slots[i] != node) {
+        if (!table->slots[i]) {
+            return;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    // Backward shift deletion keeps probe sequences intact without tombstones
+    for (int j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask) {
+        int home = (int)(node_hash(table->slots[j]) & mask);
+
+        bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+
+        if (movable) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+
+    table->slots[i] = 0;
+    table->count--;
+}
+
+void value_table_free(ValueTable* table) {
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
\ No newline at end of file
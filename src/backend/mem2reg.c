@@ -0,0 +1,426 @@
+#include "sb_internal.h"
+
+// Promotes allocas whose address is only ever loaded from or stored to into
+// plain SSA values. The store chain already is an SSA form of memory, so
+// rather than rebuilding dominance this reads each variable straight off it.
+//
+// The chain is cut into segments: runs of stores that follow each other with
+// nothing else consuming the memory state in between. A segment starts at
+// the start store, at a memory phi, or wherever the chain forks. Inside a
+// segment the value of a variable is just its last store. At the start of a
+// segment it's the value at the end of the single segment before it, or, at
+// a memory phi, a new data phi on the same region. Values found this way are
+// memoised per (variable, segment), so each pair is resolved once.
+//
+// Trivial phis are left for sb_opt to fold.
+
+typedef struct {
+    uint64_t key;
+    SB_Node* value;
+} PairSlot;
+
+// Keyed by (variable, segment)
+typedef struct {
+    Arena* arena;
+    int count;
+    int capacity;
+    PairSlot* slots;
+} PairMap;
+
+static uint64_t pair_key(int variable, int segment) {
+    return ((uint64_t)(uint32_t)variable << 32 | (uint32_t)segment) + 1;
+}
+
+static uint32_t pair_hash(uint64_t key) {
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+static PairSlot* pair_map_slot(PairSlot* slots, int capacity, uint64_t key) {
+    int i = pair_hash(key) & (capacity - 1);
+
+    while (slots[i].key && slots[i].key != key) {
+        i = (i + 1) & (capacity - 1);
+    }
+
+    return &slots[i];
+}
+
+static SB_Node* pair_map_get(PairMap* map, int variable, int segment) {
+    if (!map->capacity) {
+        return 0;
+    }
+
+    return pair_map_slot(map->slots, map->capacity, pair_key(variable, segment))->value;
+}
+
+static void pair_map_set(PairMap* map, int variable, int segment, SB_Node* value) {
+    if (!map->capacity || load_factor(map->count + 1, map->capacity) > 0.5f) {
+        int new_capacity = map->capacity ? map->capacity * 2 : 64;
+        PairSlot* new_slots = arena_array(map->arena, PairSlot, new_capacity);
+
+        for (int i = 0; i < map->capacity; ++i) {
+            if (map->slots[i].key) {
+                *pair_map_slot(new_slots, new_capacity, map->slots[i].key) = map->slots[i];
+            }
+        }
+
+        map->capacity = new_capacity;
+        map->slots = new_slots;
+    }
+
+    PairSlot* slot = pair_map_slot(map->slots, map->capacity, pair_key(variable, segment));
+
+    if (!slot->key) {
+        slot->key = pair_key(variable, segment);
+        map->count++;
+    }
+
+    slot->value = value;
+}
+
+typedef struct {
+    SB_Node* phi;
+    int variable;
+    int segment;
+} PendingPhi;
+
+typedef struct {
+    SB_Context* context;
+    Arena* arena;
+
+    int* variable;          // Promoted alloca index plus one, indexed by node id
+    int* segment;           // Segment index plus one, indexed by node id
+    SB_Node** continuation; // Next store in the same segment, indexed by node id
+
+    int segment_count;
+    SB_Node** segment_roots;
+    int* path;
+
+    PairMap last_store;     // Value of the last store to the variable inside the segment
+    PairMap entry;          // Value of the variable on entry to the segment
+
+    int pending_count;
+    int pending_capacity;
+    PendingPhi* pending;
+
+    SB_Node* undefined;
+} Promotion;
+
+static int variable_of(Promotion* p, SB_Node* address) {
+    return p->variable[address->id] - 1;
+}
+
+// Reading a variable nobody has written yet gives zero, like the backend does for a missing return
+static SB_Node* undefined_value(Promotion* p) {
+    if (!p->undefined) {
+        p->undefined = sb_node_null(p->context);
+    }
+
+    return p->undefined;
+}
+
+static void push_pending(Promotion* p, SB_Node* phi, int variable, int segment) {
+    if (p->pending_count == p->pending_capacity) {
+        int new_capacity = p->pending_capacity ? p->pending_capacity * 2 : 64;
+        PendingPhi* new_pending = arena_array(p->arena, PendingPhi, new_capacity);
+        memcpy(new_pending, p->pending, p->pending_count * sizeof(PendingPhi));
+
+        p->pending_capacity = new_capacity;
+        p->pending = new_pending;
+    }
+
+    p->pending[p->pending_count++] = (PendingPhi) { phi, variable, segment };
+}
+
+// Value of `variable` at the end of `segment`, or on entry to it
+static SB_Node* read_variable(Promotion* p, int variable, int segment, bool at_end) {
+    int path_count = 0;
+    SB_Node* value = 0;
+
+    for (;;) {
+        if (at_end) {
+            value = pair_map_get(&p->last_store, variable, segment);
+
+            if (value) {
+                break;
+            }
+        }
+
+        at_end = true;
+
+        value = pair_map_get(&p->entry, variable, segment);
+
+        if (value) {
+            break;
+        }
+
+        p->path[path_count++] = segment;
+
+        SB_Node* root = p->segment_roots[segment];
+
+        if (root->op == SB_OP_START_STORE) {
+            value = undefined_value(p);
+            break;
+        }
+
+        if (root->op == SB_OP_PHI) {
+            // Operands are filled in later, the phi has to exist first to break cycles
+            value = sb_node_phi(p->context);
+            push_pending(p, value, variable, segment);
+            break;
+        }
+
+        segment = p->segment[root->_ins[STORE_STORE]->id] - 1;
+    }
+
+    for (int i = 0; i < path_count; ++i) {
+        pair_map_set(&p->entry, variable, p->path[i], value);
+    }
+
+    return value;
+}
+
+// Unlinks the removed nodes and frees them, inputs left without users die
+// with them. `removed` serves as the stack and is left empty.
+static void remove_dead(SB_Context* context, NodeSet* dead, NodeList* removed) {
+    while (removed->count) {
+        SB_Node* node = removed->data[--removed->count];
+        value_table_remove(context, node);
+
+        for (int j = 0; j < node->in_count; ++j) {
+            SB_Node* input = node->_ins[j];
+
+            if (!input) {
+                continue;
+            }
+
+            remove_user(input, node, j);
+            node->_ins[j] = 0;
+
+            if (!input->user_count && node_set_add(dead, input)) {
+                node_list_push(removed, input);
+            }
+        }
+
+        free_node(context, node);
+    }
+}
+
+static int memory_user_count(SB_Node* node, SB_Node** only_store) {
+    int count = 0;
+    *only_store = 0;
+
+    for (SB_User* user = node->users; user < node->users + node->user_count; ++user) {
+        bool is_store = user->node->op == SB_OP_STORE && user->index == STORE_STORE;
+        bool is_phi = user->node->op == SB_OP_PHI && user->index > 0;
+
+        if (is_store || is_phi) {
+            count++;
+            *only_store = is_store ? user->node : 0;
+        }
+    }
+
+    if (count != 1) {
+        *only_store = 0;
+    }
+
+    return count;
+}
+
+static bool is_promotable(SB_Node* alloca) {
+    for (SB_User* user = alloca->users; user < alloca->users + alloca->user_count; ++user) {
+        bool is_load = user->node->op == SB_OP_LOAD && user->index == LOAD_ADDRESS;
+        bool is_store = user->node->op == SB_OP_STORE && user->index == STORE_ADDRESS;
+
+        if (!is_load && !is_store) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void sb_mem2reg(SB_Context* context, SB_Proc* proc) {
+    Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
+    int node_count = context->next_id;
+
+    Promotion p = {
+        .context = context,
+        .arena = scratch.arena,
+        .variable = arena_array(scratch.arena, int, node_count),
+        .segment = arena_array(scratch.arena, int, node_count),
+        .continuation = arena_array(scratch.arena, SB_Node*, node_count),
+        .last_store = { .arena = scratch.arena },
+        .entry = { .arena = scratch.arena }
+    };
+
+    // Find the promotable allocas and the start store among the live nodes
+    NodeSet visited = make_node_set(scratch.arena, node_count);
+    SB_Node** stack = arena_array(scratch.arena, SB_Node*, node_count);
+    int stack_count = 0;
+
+    int variable_count = 0;
+    SB_Node* start_store = 0;
+
+    node_set_add(&visited, proc->end);
+    stack[stack_count++] = proc->end;
+
+    while (stack_count) {
+        SB_Node* node = stack[--stack_count];
+
+        if (node->op == SB_OP_ALLOCA && is_promotable(node)) {
+            p.variable[node->id] = ++variable_count;
+        }
+
+        if (node->op == SB_OP_START_STORE) {
+            start_store = node;
+        }
+
+        for (int i = 0; i < node->in_count; ++i) {
+            SB_Node* input = node->_ins[i];
+
+            if (input && node_set_add(&visited, input)) {
+                stack[stack_count++] = input;
+            }
+        }
+    }
+
+    if (!variable_count || !start_store) {
+        scratch_release(&scratch);
+        return;
+    }
+
+    // Cut the store chain into segments, walking it forwards from the start store
+    SB_Node** memory = stack;
+    int memory_count = 0;
+
+    node_set_clear(&visited);
+    node_set_add(&visited, start_store);
+    memory[memory_count++] = start_store;
+
+    for (int i = 0; i < memory_count; ++i) {
+        for (SB_User* user = memory[i]->users; user < memory[i]->users + memory[i]->user_count; ++user) {
+            bool is_store = user->node->op == SB_OP_STORE && user->index == STORE_STORE;
+            bool is_phi = user->node->op == SB_OP_PHI && user->index > 0;
+
+            if ((is_store || is_phi) && node_set_add(&visited, user->node)) {
+                memory[memory_count++] = user->node;
+            }
+        }
+    }
+
+    p.segment_roots = arena_array(scratch.arena, SB_Node*, memory_count);
+    p.path = arena_array(scratch.arena, int, memory_count);
+
+    for (int i = 0; i < memory_count; ++i) {
+        SB_Node* node = memory[i];
+        SB_Node* next;
+
+        if (memory_user_count(node, &next) == 1 && next) {
+            p.continuation[node->id] = next;
+        }
+    }
+
+    for (int i = 0; i < memory_count; ++i) {
+        SB_Node* node = memory[i];
+        bool is_root = node->op != SB_OP_STORE || p.continuation[node->_ins[STORE_STORE]->id] != node;
+
+        if (!is_root) {
+            continue;
+        }
+
+        int segment = p.segment_count++;
+        p.segment_roots[segment] = node;
+
+        for (SB_Node* s = node; s; s = p.continuation[s->id]) {
+            p.segment[s->id] = segment + 1;
+
+            if (s->op == SB_OP_STORE && p.variable[s->_ins[STORE_ADDRESS]->id]) {
+                pair_map_set(&p.last_store, variable_of(&p, s->_ins[STORE_ADDRESS]), segment, s->_ins[STORE_VALUE]);
+            }
+        }
+    }
+
+    // Resolve every promoted load against the stores before it in its segment
+    SB_Node** current = arena_array(scratch.arena, SB_Node*, variable_count);
+    int* current_segment = arena_array(scratch.arena, int, variable_count);
+
+    NodeList loads = { .arena = scratch.arena };
+    NodeList values = { .arena = scratch.arena };
+    NodeList removed = { .arena = scratch.arena };
+
+    for (int segment = 0; segment < p.segment_count; ++segment) {
+        for (SB_Node* s = p.segment_roots[segment]; s; s = p.continuation[s->id]) {
+            if (s->op == SB_OP_STORE && p.variable[s->_ins[STORE_ADDRESS]->id]) {
+                int variable = variable_of(&p, s->_ins[STORE_ADDRESS]);
+                current[variable] = s->_ins[STORE_VALUE];
+                current_segment[variable] = segment + 1;
+            }
+
+            for (SB_User* user = s->users; user < s->users + s->user_count; ++user) {
+                SB_Node* load = user->node;
+
+                if (load->op != SB_OP_LOAD || user->index != LOAD_STORE || !p.variable[load->_ins[LOAD_ADDRESS]->id]) {
+                    continue;
+                }
+
+                int variable = variable_of(&p, load->_ins[LOAD_ADDRESS]);
+                SB_Node* value = current_segment[variable] == segment + 1 ? current[variable] : read_variable(&p, variable, segment, false);
+
+                node_list_push(&loads, load);
+                node_list_push(&values, value);
+            }
+        }
+    }
+
+    // Filling in a phi can ask for more phis further up the chain
+    while (p.pending_count) {
+        PendingPhi pending = p.pending[--p.pending_count];
+        SB_Node* memory_phi = p.segment_roots[pending.segment];
+
+        int operand_count = memory_phi->in_count - 1;
+        SB_Node** operands = arena_array(scratch.arena, SB_Node*, operand_count);
+
+        for (int i = 0; i < operand_count; ++i) {
+            SB_Node* state = memory_phi->_ins[i + 1];
+            operands[i] = state ? read_variable(&p, pending.variable, p.segment[state->id] - 1, true) : undefined_value(&p);
+        }
+
+        sb_set_phi_inputs(context, pending.phi, memory_phi->_ins[0], operand_count, operands);
+    }
+
+    // A load can stand for another load that's already been replaced
+    NodeMap forward = make_node_map(scratch.arena, node_count);
+    NodeSet dead = make_node_set(scratch.arena, node_count);
+
+    for (int i = 0; i < loads.count; ++i) {
+        SB_Node* load = loads.data[i];
+        SB_Node* value = values.data[i];
+
+        while (value->op == SB_OP_LOAD && node_map_get(&forward, value)) {
+            value = node_map_get(&forward, value);
+        }
+
+        node_map_set(&forward, load, value);
+        move_users(context, load, value);
+
+        node_set_add(&dead, load);
+        node_list_push(&removed, load);
+    }
+
+    // Take the promoted stores out of the chain, the allocas die with the last of them
+    for (int i = 0; i < memory_count; ++i) {
+        SB_Node* store = memory[i];
+
+        if (store->op == SB_OP_STORE && p.variable[store->_ins[STORE_ADDRESS]->id]) {
+            move_users(context, store, store->_ins[STORE_STORE]);
+
+            node_set_add(&dead, store);
+            node_list_push(&removed, store);
+        }
+    }
+
+    remove_dead(context, &dead, &removed);
+
+    scratch_release(&scratch);
+}
@@ -0,0 +1,90 @@
+#include "sb_internal.h"
+
+static int grown_capacity(int capacity, int id) {
+    int new_capacity = capacity ? capacity : 64;
+
+    while (id >= new_capacity) {
+        new_capacity *= 2;
+    }
+
+    return new_capacity;
+}
+
+NodeSet make_node_set(Arena* arena, int capacity) {
+    return (NodeSet) {
+        .arena = arena,
+        .bits = make_bitset(arena, capacity)
+    };
+}
+
+static void node_set_grow(NodeSet* set, int id) {
+    Bitset* old = set->bits;
+    Bitset* new = make_bitset(set->arena, grown_capacity((int)old->bit_count, id));
+    memcpy(new->data, old->data, old->word_count * sizeof(uint32_t));
+    set->bits = new;
+}
+
+bool node_set_add(NodeSet* set, SB_Node* node) {
+    if ((size_t)node->id >= set->bits->bit_count) {
+        node_set_grow(set, node->id);
+    }
+
+    if (bitset_get(set->bits, node->id)) {
+        return false;
+    }
+
+    bitset_set(set->bits, node->id);
+    return true;
+}
+
+void node_set_remove(NodeSet* set, SB_Node* node) {
+    if ((size_t)node->id < set->bits->bit_count) {
+        bitset_unset(set->bits, node->id);
+    }
+}
+
+bool node_set_has(NodeSet* set, SB_Node* node) {
+    return (size_t)node->id < set->bits->bit_count && bitset_get(set->bits, node->id);
+}
+
+void node_set_clear(NodeSet* set) {
+    bitset_clear(set->bits);
+}
+
+NodeMap make_node_map(Arena* arena, int capacity) {
+    return (NodeMap) {
+        .arena = arena,
+        .capacity = capacity,
+        .values = arena_array(arena, void*, capacity)
+    };
+}
+
+void node_map_set(NodeMap* map, SB_Node* node, void* value) {
+    if (node->id >= map->capacity) {
+        int new_capacity = grown_capacity(map->capacity, node->id);
+        void** new_values = arena_array(map->arena, void*, new_capacity);
+        memcpy(new_values, map->values, map->capacity * sizeof(void*));
+
+        map->capacity = new_capacity;
+        map->values = new_values;
+    }
+
+    map->values[node->id] = value;
+}
+
+void* node_map_get(NodeMap* map, SB_Node* node) {
+    return node->id < map->capacity ? map->values[node->id] : 0;
+}
+
+void node_list_push(NodeList* list, SB_Node* node) {
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 64;
+        SB_Node** new_data = arena_array(list->arena, SB_Node*, new_capacity);
+        memcpy(new_data, list->data, list->count * sizeof(SB_Node*));
+
+        list->capacity = new_capacity;
+        list->data = new_data;
+    }
+
+    list->data[list->count++] = node;
+}
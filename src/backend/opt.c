@@ -4,217 +4,104 @@
 #include "sb.h"
 #include "sb_internal.h"
 
-typedef enum {
-    EMPTY,
-    OCCUPIED,
-    REMOVED
-} HashSlotState;
-
-typedef struct {
-    int count;
-    int capacity;
-
-    int* keys;
-    int* values;
-    HashSlotState* states;
-} IndexTable;
-
 typedef struct {
+    Arena* arena;
     int count;
     int capacity;
     SB_Node** data;
 
-    IndexTable index_table;
-} WorkList;
-
+    NodeSet members;
+    NodeSet deleted;
 
-static bool index_table_set_static(int capacity, int* keys, int* values, HashSlotState* states, int id, int index) {
-    int i = fnv1a_hash(&id, sizeof(id)) % capacity;
-
-    for (int j = 0; j < capacity; ++j)
-    {
-        switch (states[i]) {
-            case EMPTY:
-            case REMOVED:
-                keys[i] = id;
-                values[i] = index;
-                states[i] = OCCUPIED;
-                return true;
-            case OCCUPIED:
-                if (keys[i] == id) {
-                    values[i] = index;
-                    return false;
-                }
-                break;
-        }
-
-        i = (i + 1) % capacity;
-    }
-
-    assert("hash table insertion failure" && false);
-    return false;
-}
-
-static void index_table_make_room(IndexTable* table) {
-    if (!table->capacity || load_factor(table->count, table->capacity) > 0.5f)
-    {
-        int new_capacity = table->capacity ? table->capacity * 2 : 8;
-
-        int* new_keys = calloc(new_capacity, sizeof(int));
-        int* new_values = calloc(new_capacity, sizeof(int));
-        HashSlotState* new_states = calloc(new_capacity, sizeof(HashSlotState));
-
-        for (int i = 0; i < table->capacity; ++i) {
-            if (table->states[i] == OCCUPIED)
-            {
-                int id = table->keys[i];
-                int index = table->values[i];
-
-                index_table_set_static(new_capacity, new_keys, new_values, new_states, id, index);
-            }
-        }
-
-        free(table->keys);
-        free(table->values);
-        free(table->states);
-
-        table->capacity = new_capacity;
-        table->keys = new_keys;
-        table->values = new_values;
-        table->states = new_states;
-    }
-}
-
-static void index_table_set(IndexTable* table, int id, int index)
-{
-    index_table_make_room(table);
-
-    if (index_table_set_static(table->capacity, table->keys, table->values, table->states, id, index)) {
-        table->count++;
-    }
-}
-
-static int _index_table_hash_find(IndexTable* table, int id) {
-    if (!table->capacity) {
-        return -1;
-    }
-
-    int i = fnv1a_hash(&id, sizeof(id)) % table->capacity;
-
-    for (int j = 0; j < table->capacity; ++j) {
-        switch (table->states[i]) {
-            case EMPTY:
-                return -1;
-            case OCCUPIED:
-                if (table->keys[i] == id) {
-                    return i;
-                }
-                break;
-        }
-
-        i = (i + 1) % table->capacity;
-    }
-
-    return -1;
-}
-
-static int index_table_remove(IndexTable* table, int id) {
-    int i = _index_table_hash_find(table, id);
+    SB_Context* context;
+} WorkList;
 
-    if (i == -1) {
-        return -1;
+static void work_list_add(WorkList* work_list, SB_Node* node) {
+    if (!node_set_add(&work_list->members, node)) {
+        return;
     }
 
-    int return_value = table->values[i];
-    table->states[i] = REMOVED;
-    table->count--;
-
-    return return_value;
-}
-
-static int index_table_get(IndexTable* table, int id) {
-    int i = _index_table_hash_find(table, id);
+    if (work_list->count == work_list->capacity) {
+        int new_capacity = work_list->capacity ? work_list->capacity * 2 : 64;
+        SB_Node** new_data = arena_array(work_list->arena, SB_Node*, new_capacity);
+        memcpy(new_data, work_list->data, work_list->count * sizeof(SB_Node*));
 
-    if (i == -1) {
-        return -1;
+        work_list->capacity = new_capacity;
+        work_list->data = new_data;
     }
 
-    return table->values[i];
+    work_list->data[work_list->count++] = node;
 }
 
-static void index_table_free(IndexTable* table) {
-    free(table->keys);
-    free(table->values);
-    free(table->states);
-    memset(table, 0, sizeof(*table));
+static bool work_list_has(WorkList* work_list, SB_Node* node) {
+    return node_set_has(&work_list->members, node);
 }
 
-static void work_list_add(WorkList* work_list, SB_Node* node) {
-    if (index_table_get(&work_list->index_table, node->id) != -1) {
-        return;
+// Removed nodes stay in `data` and are skipped when popped. A deleted node
+// can't be recycled while it's still in `data`, or the stale entry would
+// read whatever reuses its memory, so freeing waits until it's skipped.
+static void work_list_delete(WorkList* work_list, SB_Node* node) {
+    if (work_list_has(work_list, node)) {
+        node_set_remove(&work_list->members, node);
+        node_set_add(&work_list->deleted, node);
     }
-
-    if (work_list->count == work_list->capacity)
-    {
-        work_list->capacity = work_list->capacity ? work_list->capacity * 2 : 8;
-        work_list->data = realloc(work_list->data, work_list->capacity * sizeof(SB_Node*));
+    else {
+        free_node(work_list->context, node);
     }
-
-    int index = work_list->count++;
-    work_list->data[index] = node;
-
-    index_table_set(&work_list->index_table, node->id, index);
 }
 
-static void work_list_remove(WorkList* work_list, SB_Node* node) {
-    int index = index_table_get(&work_list->index_table, node->id);
+static bool work_list_empty(WorkList* work_list) {
+    while (work_list->count && !work_list_has(work_list, work_list->data[work_list->count - 1])) {
+        SB_Node* skipped = work_list->data[--work_list->count];
 
-    if (index != -1) {
-        SB_Node* last = work_list->data[index] = work_list->data[--work_list->count];
-        index_table_set(&work_list->index_table, last->id, index);
-        index_table_remove(&work_list->index_table, node->id);
+        if (node_set_has(&work_list->deleted, skipped)) {
+            node_set_remove(&work_list->deleted, skipped);
+            free_node(work_list->context, skipped);
+        }
     }
-}
 
-static bool work_list_empty(WorkList* work_list) {
     return work_list->count == 0;
 }
 
 static SB_Node* work_list_pop(WorkList* work_list) {
-    assert(work_list->count);
+    bool empty = work_list_empty(work_list);
+    assert(!empty);
+    (void)empty;
+
     SB_Node* result = work_list->data[--work_list->count];
-    index_table_remove(&work_list->index_table, result->id);
+    node_set_remove(&work_list->members, result);
     return result;
 }
 
-static void work_list_free(WorkList* work_list) {
-    free(work_list->data);
-    index_table_free(&work_list->index_table);
-    memset(work_list, 0, sizeof(*work_list));
-}
+// Adds everything reachable from END in the order a recursive preorder walk would
+static void work_list_init(WorkList* work_list, Arena* arena, SB_Context* context, SB_Proc* proc) {
+    *work_list = (WorkList) {
+        .arena = arena,
+        .members = make_node_set(arena, context->next_id),
+        .deleted = make_node_set(arena, context->next_id),
+        .context = context
+    };
 
-static bool work_list_has(WorkList* work_list, SB_Node* node) {
-    return index_table_get(&work_list->index_table, node->id) != -1;
-}
+    NodeList stack = { .arena = arena };
+    node_list_push(&stack, proc->end);
 
-static void _work_list_init(WorkList* work_list, SB_Node* node) {
-    if (work_list_has(work_list, node)) {
-        return;
-    }
+    while (stack.count) {
+        SB_Node* node = stack.data[--stack.count];
 
-    work_list_add(work_list, node);
+        if (work_list_has(work_list, node)) {
+            continue;
+        }
 
-    for (int i = 0; i < node->in_count; ++i) {
-        if (node->_ins[i]) {
-            _work_list_init(work_list, node->_ins[i]);
+        work_list_add(work_list, node);
+
+        for (int i = node->in_count - 1; i >= 0; --i) {
+            if (node->_ins[i] && !work_list_has(work_list, node->_ins[i])) {
+                node_list_push(&stack, node->_ins[i]);
+            }
         }
     }
 }
 
-static void work_list_init(WorkList* work_list, SB_Proc* proc) {
-    _work_list_init(work_list, proc->end);
-}
-
 typedef SB_Node* (*IdealizeFunction)(WorkList*, SB_Context*, SB_Node*);
 
 static SB_Node* _idealize_phi(WorkList* work_list, SB_Context* context, SB_Node* node) {
@@ -247,7 +134,7 @@ static SB_Node* _idealize_region(WorkList* work_list, SB_Context* context, SB_No
     (void)context;
     (void)work_list;
 
-    for (SB_User* user = node->users; user; user = user->next) {
+    for (SB_User* user = node->users; user < node->users + node->user_count; ++user) {
         if (user->node->op == SB_OP_PHI && user->index == 0) { // Can't eliminate region if phis depend on it
             return node;
         }
@@ -274,68 +161,333 @@ static SB_Node* _idealize_region(WorkList* work_list, SB_Context* context, SB_No
     return same;
 }
 
-static IdealizeFunction idealize_table[NUM_SB_OPS] = {
-    [SB_OP_PHI] = _idealize_phi,
-    [SB_OP_REGION] = _idealize_region,
-};
+static bool is_constant(SB_Node* node) {
+    return node->op == SB_OP_INTEGER_CONSTANT;
+}
 
-static void queue_users(WorkList* work_list, SB_Node* node) {
-    for (SB_User* user = node->users; user; user = user->next) {
-        work_list_add(work_list, user->node);
+static uint64_t constant_value(SB_Node* node) {
+    assert(is_constant(node));
+    uint64_t value;
+    memcpy(&value, sb_node_data(node), sizeof(value));
+    return value;
+}
+
+static bool is_constant_value(SB_Node* node, uint64_t value) {
+    return is_constant(node) && constant_value(node) == value;
+}
+
+// Commutative ops keep constants on the right so the other rules only look there
+static SB_Node* canonicalize_commutative(SB_Context* context, SB_Node* node) {
+    SB_Node* left = node->_ins[BINARY_LEFT];
+    SB_Node* right = node->_ins[BINARY_RIGHT];
+
+    if (is_constant(left) && !is_constant(right)) {
+        return node->op == SB_OP_ADD ? sb_node_add(context, right, left) : sb_node_mul(context, right, left);
+    }
+
+    return node;
+}
+
+static SB_Node* _idealize_add(WorkList* work_list, SB_Context* context, SB_Node* node) {
+    (void)work_list;
+
+    SB_Node* left = node->_ins[BINARY_LEFT];
+    SB_Node* right = node->_ins[BINARY_RIGHT];
+
+    if (is_constant(left) && is_constant(right)) {
+        return sb_node_integer_constant(context, constant_value(left) + constant_value(right));
+    }
+
+    SB_Node* canonical = canonicalize_commutative(context, node);
+    if (canonical != node) {
+        return canonical;
+    }
+
+    if (is_constant_value(right, 0)) {
+        return left;
     }
+
+    // (x + c1) + c2 -> x + (c1 + c2)
+    if (left->op == SB_OP_ADD && is_constant(left->_ins[BINARY_RIGHT]) && is_constant(right)) {
+        uint64_t value = constant_value(left->_ins[BINARY_RIGHT]) + constant_value(right);
+        return sb_node_add(context, left->_ins[BINARY_LEFT], sb_node_integer_constant(context, value));
+    }
+
+    return node;
 }
 
-static void delete_node(SB_Node* node) {
-    assert("cannot delete node, has users" && !node->users);
+static SB_Node* _idealize_sub(WorkList* work_list, SB_Context* context, SB_Node* node) {
+    (void)work_list;
+
+    SB_Node* left = node->_ins[BINARY_LEFT];
+    SB_Node* right = node->_ins[BINARY_RIGHT];
 
-    for (int i = 0; i < node->in_count; ++i) {
-        SB_Node* input = node->_ins[i];
+    if (is_constant(left) && is_constant(right)) {
+        return sb_node_integer_constant(context, constant_value(left) - constant_value(right));
+    }
 
-        if (!input) {
-            continue;
+    if (left == right) {
+        return sb_node_integer_constant(context, 0);
+    }
+
+    if (is_constant_value(right, 0)) {
+        return left;
+    }
+
+    // x - c -> x + (-c) so constants combine through the add rules
+    if (is_constant(right)) {
+        return sb_node_add(context, left, sb_node_integer_constant(context, 0 - constant_value(right)));
+    }
+
+    return node;
+}
+
+static SB_Node* _idealize_mul(WorkList* work_list, SB_Context* context, SB_Node* node) {
+    (void)work_list;
+
+    SB_Node* left = node->_ins[BINARY_LEFT];
+    SB_Node* right = node->_ins[BINARY_RIGHT];
+
+    if (is_constant(left) && is_constant(right)) {
+        return sb_node_integer_constant(context, constant_value(left) * constant_value(right));
+    }
+
+    SB_Node* canonical = canonicalize_commutative(context, node);
+    if (canonical != node) {
+        return canonical;
+    }
+
+    if (is_constant_value(right, 0)) {
+        return right;
+    }
+
+    if (is_constant_value(right, 1)) {
+        return left;
+    }
+
+    // (x * c1) * c2 -> x * (c1 * c2)
+    if (left->op == SB_OP_MUL && is_constant(left->_ins[BINARY_RIGHT]) && is_constant(right)) {
+        uint64_t value = constant_value(left->_ins[BINARY_RIGHT]) * constant_value(right);
+        return sb_node_mul(context, left->_ins[BINARY_LEFT], sb_node_integer_constant(context, value));
+    }
+
+    return node;
+}
+
+static SB_Node* _idealize_sdiv(WorkList* work_list, SB_Context* context, SB_Node* node) {
+    (void)work_list;
+
+    SB_Node* left = node->_ins[BINARY_LEFT];
+    SB_Node* right = node->_ins[BINARY_RIGHT];
+
+    if (is_constant(left) && is_constant(right)) {
+        int64_t dividend = (int64_t)constant_value(left);
+        int64_t divisor = (int64_t)constant_value(right);
+
+        // Both of these trap at runtime, leave them for the program to hit
+        if (divisor == 0 || (dividend == INT64_MIN && divisor == -1)) {
+            return node;
         }
 
-        for (SB_User** user = &input->users; *user;) {
-            if ((*user)->node == node && (*user)->index == i) {
-                *user = (*user)->next;
-            }
-            else {
-                user = &(*user)->next;
+        return sb_node_integer_constant(context, (uint64_t)(dividend / divisor));
+    }
+
+    if (is_constant_value(right, 1)) {
+        return left;
+    }
+
+    return node;
+}
+
+// Bounds how far loads and stores look along the store chain, so long chains stay linear
+#define MAX_MEMORY_WALK 32
+
+// A memory phi reads the same as the one state entering it when no path back
+// into it writes `address`, which is what makes a load in a loop invariant
+static SB_Node* skip_memory_phi(SB_Node* phi, SB_Node* address) {
+    SB_Node* same = 0;
+
+    for (int i = 1; i < phi->in_count; ++i) {
+        SB_Node* state = phi->_ins[i];
+
+        for (int j = 0; j < MAX_MEMORY_WALK && state && state->op == SB_OP_STORE; ++j) {
+            if (may_alias(state->_ins[STORE_ADDRESS], address)) {
+                break;
             }
+
+            state = state->_ins[STORE_STORE];
+        }
+
+        if (!state || state == phi) {
+            continue;
+        }
+
+        if (same && same != state) {
+            return 0;
         }
+
+        same = state;
     }
 
-    for (int i = 0; i < node->in_count; ++i) {
-        SB_Node* input = node->_ins[i];
+    return same;
+}
 
-        if (!input) {
+static SB_Node* _idealize_load(WorkList* work_list, SB_Context* context, SB_Node* node) {
+    SB_Node* address = node->_ins[LOAD_ADDRESS];
+    SB_Node* state = node->_ins[LOAD_STORE];
+
+    for (int i = 0; i < MAX_MEMORY_WALK; ++i) {
+        if (state->op == SB_OP_PHI) {
+            SB_Node* entry = skip_memory_phi(state, address);
+
+            if (!entry) {
+                break;
+            }
+
+            state = entry;
             continue;
         }
 
-        if (!input->users) {
-            delete_node(input);
+        if (state->op != SB_OP_STORE) {
+            break;
+        }
+
+        if (state->_ins[STORE_ADDRESS] == address) {
+            work_list_add(work_list, state); // Might now be overwritten before it's read
+            return state->_ins[STORE_VALUE];
+        }
+
+        if (may_alias(state->_ins[STORE_ADDRESS], address)) {
+            break;
+        }
+
+        state = state->_ins[STORE_STORE];
+    }
+
+    // Reading an earlier state lets loads on either side of unrelated stores
+    // number the same, and lets gcm hoist loads out of loops
+    if (state != node->_ins[LOAD_STORE]) {
+        return sb_node_load(context, node->_ins[LOAD_CONTROL], state, address);
+    }
+
+    return node;
+}
+
+static SB_Node* _idealize_store(WorkList* work_list, SB_Context* context, SB_Node* node) {
+    (void)work_list;
+    (void)context;
+
+    SB_Node* address = node->_ins[STORE_ADDRESS];
+    SB_Node* state = node;
+
+    // Follow the chain while it's linear, a store to the same address before any read kills this one
+    for (int i = 0; i < MAX_MEMORY_WALK; ++i) {
+        SB_Node* next = 0;
+
+        for (SB_User* user = state->users; user < state->users + state->user_count; ++user) {
+            SB_Node* reader = user->node;
+
+            if (reader->op == SB_OP_LOAD && user->index == LOAD_STORE) {
+                if (may_alias(reader->_ins[LOAD_ADDRESS], address)) {
+                    return node;
+                }
+
+                continue;
+            }
+
+            if (reader->op != SB_OP_STORE || user->index != STORE_STORE || next) {
+                return node;
+            }
+
+            next = reader;
+        }
+
+        if (!next) {
+            return node;
+        }
+
+        if (next->_ins[STORE_ADDRESS] == address) {
+            return node->_ins[STORE_STORE];
         }
+
+        state = next;
+    }
+
+    return node;
+}
+
+static IdealizeFunction idealize_table[NUM_SB_OPS] = {
+    [SB_OP_PHI] = _idealize_phi,
+    [SB_OP_REGION] = _idealize_region,
+    [SB_OP_ADD] = _idealize_add,
+    [SB_OP_SUB] = _idealize_sub,
+    [SB_OP_MUL] = _idealize_mul,
+    [SB_OP_SDIV] = _idealize_sdiv,
+    [SB_OP_LOAD] = _idealize_load,
+    [SB_OP_STORE] = _idealize_store,
+};
+
+static void queue_users(WorkList* work_list, SB_Node* node) {
+    for (SB_User* user = node->users; user < node->users + node->user_count; ++user) {
+        work_list_add(work_list, user->node);
     }
 }
 
-static void replace_node(SB_Node* target, SB_Node* source) {
-    while (target->users) {
-        SB_User* user = target->users;
-        target->users = user->next;
+static void delete_node(WorkList* work_list, SB_Context* context, SB_Node* node) {
+    assert("cannot delete node, has users" && !node->user_count);
+
+    // Deleting a node can orphan its inputs, which are deleted in turn off an explicit stack
+    NodeList stack = { .arena = work_list->arena };
+    node_list_push(&stack, node);
+
+    while (stack.count) {
+        node = stack.data[--stack.count];
+
+        value_table_remove(context, node);
+
+        for (int i = 0; i < node->in_count; ++i) {
+            SB_Node* input = node->_ins[i];
+
+            if (input) {
+                remove_user(input, node, i);
+            }
+        }
+
+        for (int i = node->in_count - 1; i >= 0; --i) {
+            SB_Node* input = node->_ins[i];
 
-        user->node->_ins[user->index] = source;
-        user->next = source->users;
-        source->users = user;
+            if (!input || input == node || input->user_count) {
+                continue;
+            }
+
+            // The same input can appear twice, it's only deleted once
+            bool repeated = false;
+
+            for (int j = 0; j < i && !repeated; ++j) {
+                repeated = node->_ins[j] == input;
+            }
+
+            if (!repeated) {
+                node_list_push(&stack, input);
+            }
+        }
+
+        work_list_delete(work_list, node);
     }
+}
 
-    delete_node(target);
+static void replace_node(WorkList* work_list, SB_Context* context, SB_Node* target, SB_Node* source) {
+    // The users are renumbered when they're popped off the work list
+    move_users(context, target, source);
+
+    delete_node(work_list, context, target);
 }
 
 void sb_opt(SB_Context* context, SB_Proc* proc) {
-    (void)context;
+    Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
 
-    WorkList work_list = {0};
-    work_list_init(&work_list, proc);
+    WorkList work_list;
+    work_list_init(&work_list, scratch.arena, context, proc);
 
     while(!work_list_empty(&work_list)) {
         SB_Node* node = work_list_pop(&work_list);
@@ -345,10 +497,19 @@ void sb_opt(SB_Context* context, SB_Proc* proc) {
 
             if (ideal != node) {
                 queue_users(&work_list, node);
-                replace_node(node, ideal);
+                replace_node(&work_list, context, node, ideal);
+                work_list_add(&work_list, ideal); // May be new, or simplify further with its new users
+                continue;
             }
         }
+
+        SB_Node* existing = value_table_find_or_insert(context, node);
+
+        if (existing != node) {
+            queue_users(&work_list, node);
+            replace_node(&work_list, context, node, existing);
+        }
     }
 
-    work_list_free(&work_list);
+    scratch_release(&scratch);
 }
\ No newline at end of file
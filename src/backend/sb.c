@@ -4,72 +4,126 @@
 #include "sb_internal.h"
 #include "sb.h"
 
-#define ARENA_SIZE (5 * 1024 * 1024)
-
+// The context and its procs live apart from the graph, so sb_compact can
+// throw the graph's arena away wholesale
 SB_Context* sb_init() {
-    Arena arena = init_arena(ARENA_SIZE, malloc(ARENA_SIZE));
+    Arena persistent = init_arena(ARENA_RESERVE_SIZE);
 
-    SB_Context* context = arena_type(&arena, SB_Context);
-    context->arena = arena;
-    init_scratch_library(&context->scratch_library, ARENA_SIZE);
+    SB_Context* context = arena_type(&persistent, SB_Context);
+    context->persistent = persistent;
+    context->arena = init_arena(ARENA_RESERVE_SIZE);
+    context->value_numbering = true;
+    init_scratch_library(&context->scratch_library, ARENA_RESERVE_SIZE);
 
     return context;
 }
 
-static void mark_useful(Bitset* useful, SB_Node* node) {
-    if (bitset_get(useful, node->id)) {
-        return;
-    }
+void sb_free(SB_Context* context) {
+    value_table_free(&context->value_table);
+    free_scratch_library(&context->scratch_library);
+    release_arena(&context->arena);
+
+    Arena persistent = context->persistent;
+    release_arena(&persistent);
+}
 
-    bitset_set(useful, node->id);
+// The walks below keep their own stacks, a store chain can be far deeper
+// than the native stack. Inputs are pushed in reverse and marked when popped,
+// which visits nodes in the same order a recursive walk would.
 
-    for (int i = 0; i < node->in_count; ++i) {
-        if (node->_ins[i]) {
-            mark_useful(useful, node->_ins[i]);
+static void mark_useful(Arena* arena, NodeSet* useful, SB_Node* end) {
+    NodeList stack = { .arena = arena };
+    node_list_push(&stack, end);
+
+    while (stack.count) {
+        SB_Node* node = stack.data[--stack.count];
+
+        if (!node_set_add(useful, node)) {
+            continue;
+        }
+
+        for (int i = node->in_count - 1; i >= 0; --i) {
+            if (node->_ins[i] && !node_set_has(useful, node->_ins[i])) {
+                node_list_push(&stack, node->_ins[i]);
+            }
         }
     }
 }
 
-static void trim(Bitset* trimmed, Bitset* useful, SB_Node* node) {
-    if (bitset_get(trimmed, node->id)) {
-        return;
-    }
+static void trim(SB_Context* context, Arena* arena, NodeSet* trimmed, NodeSet* useful, SB_Node* end) {
+    NodeList stack = { .arena = arena };
+    node_list_push(&stack, end);
 
-    bitset_set(trimmed, node->id);
+    while (stack.count) {
+        SB_Node* node = stack.data[--stack.count];
 
-    for (SB_User** user = &node->users; *user;)
-    {
-        if (bitset_get(useful, (*user)->node->id)) {
-            user = &(*user)->next;
+        if (!node_set_add(trimmed, node)) {
+            continue;
         }
-        else {
-            *user = (*user)->next;
+
+        int kept = 0;
+
+        for (int i = 0; i < node->user_count; ++i) {
+            SB_User user = node->users[i];
+
+            if (node_set_has(useful, user.node)) {
+                place_user(node, kept++, user);
+            }
+            else {
+                // Dead nodes must not be handed out again by value numbering
+                value_table_remove(context, user.node);
+            }
         }
-    }
 
-    for (int i = 0; i < node->in_count; ++i) {
-        if (node->_ins[i]) {
-            trim(trimmed, useful, node->_ins[i]);
+        node->user_count = kept;
+
+        for (int i = node->in_count - 1; i >= 0; --i) {
+            if (node->_ins[i] && !node_set_has(trimmed, node->_ins[i])) {
+                node_list_push(&stack, node->_ins[i]);
+            }
         }
     }
 }
 
+void sb_set_value_numbering(SB_Context* context, bool enabled) {
+    context->value_numbering = enabled;
+
+    if (!enabled) {
+        value_table_free(&context->value_table);
+    }
+}
+
+SB_MemoryStats sb_memory_stats(SB_Context* context) {
+    return (SB_MemoryStats) {
+        .arena_allocated = context->arena.allocated,
+        .arena_high_water = context->arena.high_water,
+        .scratch_high_water = scratch_library_high_water(&context->scratch_library),
+        .graph_live_bytes = context->graph_bytes - context->graph_free_bytes,
+        .graph_free_bytes = context->graph_free_bytes
+    };
+}
+
+void sb_reset_memory_high_water(SB_Context* context) {
+    arena_reset_high_water(&context->arena);
+    scratch_library_reset_high_water(&context->scratch_library);
+}
+
 SB_Proc* sb_make_proc(SB_Context* context, SB_Node* start, SB_Node* end) {
     Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
 
-    Bitset* useful  = make_bitset(scratch.arena, context->next_id);
-    Bitset* trimmed = make_bitset(scratch.arena, context->next_id);
+    NodeSet useful  = make_node_set(scratch.arena, context->next_id);
+    NodeSet trimmed = make_node_set(scratch.arena, context->next_id);
 
-    mark_useful(useful, end);
+    mark_useful(scratch.arena, &useful, end);
 
-    if (!bitset_get(useful, start->id)) {
+    if (!node_set_has(&useful, start)) {
         assert("start not reachable from end" && false);
         return 0;
     }
 
-    trim(trimmed, useful, end);
+    trim(context, scratch.arena, &trimmed, &useful, end);
 
-    SB_Proc* proc = arena_type(&context->arena, SB_Proc);
+    SB_Proc* proc = arena_type(&context->persistent, SB_Proc);
 
     proc->start = start;
     proc->end = end;
@@ -78,90 +132,261 @@ SB_Proc* sb_make_proc(SB_Context* context, SB_Node* start, SB_Node* end) {
     return proc;
 }
 
+static int log2_floor(size_t value) {
+    int result = 0;
+
+    while (value >> (result + 1)) {
+        result++;
+    }
+
+    return result;
+}
+
+static int log2_ceil(size_t value) {
+    int result = log2_floor(value);
+    return ((size_t)1 << result) < value ? result + 1 : result;
+}
+
+// A block goes into the largest class it covers and is taken from the
+// smallest class that covers the request, so any block found is big enough
+static void* allocate_block(SB_Context* context, size_t size) {
+    int class = log2_ceil(size);
+    assert(class < NUM_BLOCK_CLASSES);
+
+    FreeBlock* block = context->free_blocks[class];
+
+    if (!block) {
+        context->graph_bytes += size;
+        return arena_zero(&context->arena, size);
+    }
+
+    context->free_blocks[class] = block->next;
+    context->graph_free_bytes -= (size_t)1 << class;
+
+    memset(block, 0, size);
+    return block;
+}
+
+static void free_block(SB_Context* context, void* memory, size_t size) {
+    int class = log2_floor(size);
+    FreeBlock* block = memory;
+
+    block->next = context->free_blocks[class];
+    context->free_blocks[class] = block;
+    context->graph_free_bytes += (size_t)1 << class;
+}
+
+static size_t align8(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+// Inputs followed by their use list positions
+static size_t ins_size(int in_count) {
+    return align8(in_count * (sizeof(SB_Node*) + sizeof(int)));
+}
+
 static void allocate_ins(SB_Context* context, SB_Node* node, int in_count) {
     assert(!node->in_count);
     node->in_count = in_count;
-    node->_ins = arena_array(&context->arena, SB_Node*, in_count);
+    node->_ins = in_count ? allocate_block(context, ins_size(in_count)) : 0;
 }
 
-static SB_Node* make_node(SB_Context* context, SB_OpCode op, int in_count, SB_NodeFlags flags) {
-    SB_Node* node = arena_type(&context->arena, SB_Node);
+static size_t ins_offset(int data_size) {
+    return sizeof(SB_Node) + align8(data_size);
+}
+
+// Header, payload and fixed inputs go in one allocation
+static SB_Node* make_node(SB_Context* context, SB_OpCode op, int in_count, int data_size, SB_NodeFlags flags) {
+    size_t size = ins_offset(data_size) + ins_size(in_count);
+    int class = (int)(size / 8);
+    assert(class < NUM_NODE_CLASSES);
+
+    SB_Node* node;
+    FreeNode* free = context->free_nodes[class];
 
-    node->id = context->next_id++;  
-    node->op = op;
-    node->flags = flags;
+    if (free) {
+        context->free_nodes[class] = free->next;
+        context->graph_free_bytes -= size;
 
-    allocate_ins(context, node, in_count);
+        int id = free->id;
+        node = memset(free, 0, size);
+        node->id = id;
+    }
+    else {
+        context->graph_bytes += size;
+
+        node = arena_zero(&context->arena, size);
+        node->id = context->next_id++;
+    }
+
+    node->op = (uint8_t)op;
+    node->flags = (uint8_t)flags;
+    node->data_size = (uint8_t)data_size;
+
+    node->in_count = in_count;
+    node->_ins = in_count ? (SB_Node**)((char*)node + ins_offset(data_size)) : 0;
 
     return node;
 }
 
+static int user_capacity(SB_Node* node) {
+    return node->users ? 1 << node->users_log2 : 0;
+}
+
+static void grow_users(SB_Context* context, SB_Node* node, int needed) {
+    int log2 = log2_ceil(needed);
+    SB_User* new_users = allocate_block(context, sizeof(SB_User) << log2);
+    memcpy(new_users, node->users, node->user_count * sizeof(SB_User));
+
+    if (node->users) {
+        free_block(context, node->users, user_capacity(node) * sizeof(SB_User));
+    }
+
+    node->users = new_users;
+    node->users_log2 = (uint8_t)log2;
+}
+
+void free_node(SB_Context* context, SB_Node* node) {
+    assert("cannot free node, has users" && !node->user_count);
+
+    if (node->users) {
+        free_block(context, node->users, user_capacity(node) * sizeof(SB_User));
+    }
+
+    size_t size = ins_offset(node->data_size);
+
+    // Only regions and phis have their inputs set after creation
+    if (node->op != SB_OP_REGION && node->op != SB_OP_PHI) {
+        size += ins_size(node->in_count);
+    }
+    else if (node->_ins) {
+        free_block(context, node->_ins, ins_size(node->in_count));
+    }
+
+    int class = (int)(size / 8);
+    FreeNode* free = (FreeNode*)node;
+
+    free->next = context->free_nodes[class];
+    context->free_nodes[class] = free;
+    context->graph_free_bytes += size;
+}
+
+// Most nodes have a single user, so arrays start at one slot and double
+// when they fill. Removing users never shrinks them.
+void add_user(SB_Context* context, SB_Node* input, SB_Node* node, int index) {
+    if (input->user_count == user_capacity(input)) {
+        grow_users(context, input, input->user_count + 1);
+    }
+
+    place_user(input, input->user_count++, (SB_User) { node, index });
+}
+
+// Swaps the last user into the gap, user order carries no meaning
+void remove_user(SB_Node* input, SB_Node* node, int index) {
+    int position = input_positions(node)[index];
+
+    assert("edge is missing from the use list" && position < input->user_count &&
+        input->users[position].node == node && input->users[position].index == index);
+
+    SB_User last = input->users[--input->user_count];
+
+    if (position != input->user_count) {
+        place_user(input, position, last);
+    }
+}
+
+// Points every user of `target` at `source` instead. Rewiring changes the
+// users' hashes, so they leave the value table until they're renumbered.
+void move_users(SB_Context* context, SB_Node* target, SB_Node* source) {
+    for (int i = 0; i < target->user_count; ++i) {
+        SB_User user = target->users[i];
+
+        value_table_remove(context, user.node);
+        user.node->_ins[user.index] = source;
+    }
+
+    // The longer list keeps its array, only the shorter one is copied
+    if (target->user_count > source->user_count) {
+        SB_Node swapped = *source;
+
+        source->users = target->users;
+        source->users_log2 = target->users_log2;
+        source->user_count = target->user_count;
+
+        target->users = swapped.users;
+        target->users_log2 = swapped.users_log2;
+        target->user_count = swapped.user_count;
+    }
+
+    int count = source->user_count + target->user_count;
+
+    if (count > user_capacity(source)) {
+        grow_users(context, source, count);
+    }
+
+    for (int i = 0; i < target->user_count; ++i) {
+        place_user(source, source->user_count + i, target->users[i]);
+    }
+
+    source->user_count = count;
+    target->user_count = 0;
+}
+
 static void assign_input(SB_Context* context, SB_Node* node, SB_Node* input, int index) {
     assert(index < node->in_count);
     assert(!node->_ins[index]);
 
     node->_ins[index] = input;
-
-    SB_User* user = arena_type(&context->arena, SB_User);
-    user->node = node;
-    user->index = index;
-
-    user->next = input->users;
-    input->users = user;
+    add_user(context, input, node, index);
 }
 
 #define SET_INPUT(node, index, value) assign_input(context, node, value, index)
 
 SB_Node* sb_node_start(SB_Context* context) {
-    return make_node(context, SB_OP_START, 0, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_STARTS_BLOCK | SB_NODE_FLAG_IS_PINNED);
+    return make_node(context, SB_OP_START, 0, 0, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_STARTS_BLOCK | SB_NODE_FLAG_IS_PINNED);
 }
 
-enum {
-    END_CONTROL,
-    END_STORE,
-    END_RETURN_VALUE,
-    NUM_END_INS
-};
-
 SB_Node* sb_node_end(SB_Context* context, SB_Node* control, SB_Node* store, SB_Node* return_value) {
-    SB_Node* node = make_node(context, SB_OP_END, NUM_END_INS, SB_NODE_FLAG_IS_PINNED);
+    SB_Node* node = make_node(context, SB_OP_END, NUM_END_INS, 0, SB_NODE_FLAG_IS_PINNED);
     SET_INPUT(node, END_CONTROL, control);
     SET_INPUT(node, END_STORE, store);
     SET_INPUT(node, END_RETURN_VALUE, return_value);
     return node;
 }
 
-static void init_data_field(SB_Context* context, SB_Node* node, int size) {
-    node->data_size = size;
-    node->data = arena_push(&context->arena, size);
-}
-
 SB_Node* sb_node_null(SB_Context* context) {
-    return make_node(context, SB_OP_NULL, 0, SB_NODE_FLAG_NONE);
+    return make_node(context, SB_OP_NULL, 0, 0, SB_NODE_FLAG_NONE);
 }
 
 SB_Node* sb_node_integer_constant(SB_Context* context, uint64_t value) {
-    SB_Node* node = make_node(context, SB_OP_INTEGER_CONSTANT, 0, SB_NODE_FLAG_NONE);
-    init_data_field(context, node, sizeof(value));
-    memcpy(node->data, &value, sizeof(value));
-    return node;
+    SB_Node* existing = value_table_lookup(context, SB_OP_INTEGER_CONSTANT, 0, 0, &value, sizeof(value));
+    if (existing) {
+        return existing;
+    }
+
+    SB_Node* node = make_node(context, SB_OP_INTEGER_CONSTANT, 0, sizeof(value), SB_NODE_FLAG_NONE);
+    memcpy(sb_node_data(node), &value, sizeof(value));
+
+    return value_table_find_or_insert(context, node);
 }
 
 SB_Node* sb_node_alloca(SB_Context* context) {
-    return make_node(context, SB_OP_ALLOCA, 0, SB_NODE_FLAG_NONE);
+    return make_node(context, SB_OP_ALLOCA, 0, 0, SB_NODE_FLAG_NONE);
 }
 
-enum {
-    BINARY_LEFT,
-    BINARY_RIGHT,
-    NUM_BINARY_INS
-};
-
 static SB_Node* make_binary(SB_Context* context, SB_OpCode op, SB_Node* left, SB_Node* right) {
-    SB_Node* node = make_node(context, op, NUM_BINARY_INS, SB_NODE_FLAG_NONE);
+    SB_Node* ins[NUM_BINARY_INS] = { left, right };
+
+    SB_Node* existing = value_table_lookup(context, op, NUM_BINARY_INS, ins, 0, 0);
+    if (existing) {
+        return existing;
+    }
+
+    SB_Node* node = make_node(context, op, NUM_BINARY_INS, 0, SB_NODE_FLAG_NONE);
     SET_INPUT(node, BINARY_LEFT, left);
     SET_INPUT(node, BINARY_RIGHT, right);
-    return node;
+
+    return value_table_find_or_insert(context, node);
 }
 
 SB_Node* sb_node_add(SB_Context* context, SB_Node* left, SB_Node* right) {
@@ -176,35 +401,40 @@ SB_Node* sb_node_mul(SB_Context* context, SB_Node* left, SB_Node* right) {
     return make_binary(context, SB_OP_MUL, left, right);
 }
 
-SB_Node* sb_node_sdiv(SB_Context* context, SB_Node* left, SB_Node* right) {
-    return make_binary(context, SB_OP_SDIV, left, right);
-}
+SB_Node* sb_node_sdiv(SB_Context* context, SB_Node* control, SB_Node* left, SB_Node* right) {
+    SB_Node* ins[NUM_SDIV_INS] = { left, right, control };
 
-enum {
-    LOAD_CONTROL,
-    LOAD_STORE,
-    LOAD_ADDRESS,
-    NUM_LOAD_INS
-};
+    SB_Node* existing = value_table_lookup(context, SB_OP_SDIV, NUM_SDIV_INS, ins, 0, 0);
+    if (existing) {
+        return existing;
+    }
+
+    SB_Node* node = make_node(context, SB_OP_SDIV, NUM_SDIV_INS, 0, SB_NODE_FLAG_NONE);
+    SET_INPUT(node, BINARY_LEFT, left);
+    SET_INPUT(node, BINARY_RIGHT, right);
+    SET_INPUT(node, SDIV_CONTROL, control);
+
+    return value_table_find_or_insert(context, node);
+}
 
 SB_Node* sb_node_load(SB_Context* context, SB_Node* control, SB_Node* store, SB_Node* address) {
-    SB_Node* node = make_node(context, SB_OP_LOAD, NUM_LOAD_INS, SB_NODE_FLAG_NONE);
+    SB_Node* ins[NUM_LOAD_INS] = { control, store, address };
+
+    SB_Node* existing = value_table_lookup(context, SB_OP_LOAD, NUM_LOAD_INS, ins, 0, 0);
+    if (existing) {
+        return existing;
+    }
+
+    SB_Node* node = make_node(context, SB_OP_LOAD, NUM_LOAD_INS, 0, SB_NODE_FLAG_NONE);
     SET_INPUT(node, LOAD_CONTROL, control);
     SET_INPUT(node, LOAD_STORE, store);
     SET_INPUT(node, LOAD_ADDRESS, address);
-    return node;
-}
 
-enum {
-    STORE_CONTROL,
-    STORE_STORE,
-    STORE_ADDRESS,
-    STORE_VALUE,
-    NUM_STORE_INS
-};
+    return value_table_find_or_insert(context, node);
+}
 
 SB_Node* sb_node_store(SB_Context* context, SB_Node* control, SB_Node* store, SB_Node* address, SB_Node* value) {
-    SB_Node* node = make_node(context, SB_OP_STORE, NUM_STORE_INS, SB_NODE_FLAG_IS_PINNED);
+    SB_Node* node = make_node(context, SB_OP_STORE, NUM_STORE_INS, 0, SB_NODE_FLAG_IS_PINNED);
     SET_INPUT(node, STORE_CONTROL, control);
     SET_INPUT(node, STORE_STORE, store);
     SET_INPUT(node, STORE_ADDRESS, address);
@@ -212,44 +442,33 @@ SB_Node* sb_node_store(SB_Context* context, SB_Node* control, SB_Node* store, SB
     return node;
 }
 
-enum {
-    PROJECTION_INPUT,
-    NUM_PROJECTION_INS
-};
-
 SB_Node* sb_node_start_control(SB_Context* context, SB_Node* start) {
     assert(start->op == SB_OP_START);
-    SB_Node* node = make_node(context, SB_OP_START_CONTROL, NUM_PROJECTION_INS, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_IS_PINNED);
+    SB_Node* node = make_node(context, SB_OP_START_CONTROL, NUM_PROJECTION_INS, 0, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_IS_PINNED);
     SET_INPUT(node, PROJECTION_INPUT, start);
     return node;
 }
 
 SB_Node* sb_node_start_store(SB_Context* context, SB_Node* start) {
     assert(start->op == SB_OP_START);
-    SB_Node* node = make_node(context, SB_OP_START_STORE, NUM_PROJECTION_INS, SB_NODE_FLAG_NONE);
+    SB_Node* node = make_node(context, SB_OP_START_STORE, NUM_PROJECTION_INS, 0, SB_NODE_FLAG_NONE);
     SET_INPUT(node, PROJECTION_INPUT, start);
     return node;
 }
 
-enum {
-    BRANCH_CONTROL,
-    BRANCH_PREDICATE,
-    NUM_BRANCH_INS
-};
-
 SB_Node* sb_node_branch(SB_Context* context, SB_Node* control, SB_Node* predicate) {
-    SB_Node* node = make_node(context, SB_OP_BRANCH, NUM_BRANCH_INS, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_IS_PINNED);
+    SB_Node* node = make_node(context, SB_OP_BRANCH, NUM_BRANCH_INS, 0, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_IS_PINNED);
     SET_INPUT(node, BRANCH_CONTROL, control);
     SET_INPUT(node, BRANCH_PREDICATE, predicate);
     return node;
 }
 
 SB_Node* sb_node_region(SB_Context* context) {
-    return make_node(context, SB_OP_REGION, 0, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_STARTS_BLOCK | SB_NODE_FLAG_IS_PINNED);
+    return make_node(context, SB_OP_REGION, 0, 0, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_STARTS_BLOCK | SB_NODE_FLAG_IS_PINNED);
 }
 
 SB_Node* sb_node_phi(SB_Context* context) {
-    return make_node(context, SB_OP_PHI, 0, SB_NODE_FLAG_IS_PINNED);
+    return make_node(context, SB_OP_PHI, 0, 0, SB_NODE_FLAG_IS_PINNED);
 }
 
 void sb_set_region_inputs(SB_Context* context, SB_Node* region, int input_count, SB_Node** inputs) {
@@ -277,25 +496,19 @@ void sb_set_phi_inputs(SB_Context* context, SB_Node* phi, SB_Node* region, int i
 
 SB_Node* sb_node_branch_true(SB_Context* context, SB_Node* branch) {
     assert(branch->op == SB_OP_BRANCH);
-    SB_Node* node = make_node(context, SB_OP_BRANCH_TRUE, NUM_PROJECTION_INS, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_STARTS_BLOCK | SB_NODE_FLAG_IS_PINNED);
+    SB_Node* node = make_node(context, SB_OP_BRANCH_TRUE, NUM_PROJECTION_INS, 0, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_STARTS_BLOCK | SB_NODE_FLAG_IS_PINNED);
     SET_INPUT(node, PROJECTION_INPUT, branch);
     return node;
 }
 
 SB_Node* sb_node_branch_false(SB_Context* context, SB_Node* branch) {
     assert(branch->op == SB_OP_BRANCH);
-    SB_Node* node = make_node(context, SB_OP_BRANCH_FALSE, NUM_PROJECTION_INS, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_STARTS_BLOCK | SB_NODE_FLAG_IS_PINNED);
+    SB_Node* node = make_node(context, SB_OP_BRANCH_FALSE, NUM_PROJECTION_INS, 0, SB_NODE_FLAG_PRODUCES_CONTROL | SB_NODE_FLAG_STARTS_BLOCK | SB_NODE_FLAG_IS_PINNED);
     SET_INPUT(node, PROJECTION_INPUT, branch);
     return node;
 }
 
-static void graphviz(Bitset* visited, SB_Node* node) {
-    if (bitset_get(visited, node->id)) {
-        return;
-    }
-
-    bitset_set(visited, node->id);
-
+static void graphviz_node(SB_Node* node) {
     printf("  n%d [shape=\"record\",label=\"", node->id);
 
     if (node->in_count == 0) {
@@ -316,11 +529,49 @@ static void graphviz(Bitset* visited, SB_Node* node) {
     }
 
     printf("\"];\n");
+}
+
+typedef struct {
+    SB_Node* node;
+    int input;
+} GraphvizFrame;
+
+// A node is printed when it's first reached and each edge once its input's subtree is done
+static void graphviz(Arena* arena, NodeSet* visited, SB_Node* end, int node_count) {
+    GraphvizFrame* stack = arena_array(arena, GraphvizFrame, node_count);
+    int stack_count = 0;
 
-    for (int i = 0; i < node->in_count; ++i) {
-        if (node->_ins[i]) {
-            graphviz(visited, node->_ins[i]);
-            printf("  n%d -> n%d:i%d\n", node->_ins[i]->id, node->id, i);
+    node_set_add(visited, end);
+    graphviz_node(end);
+    stack[stack_count++] = (GraphvizFrame) { end, 0 };
+
+    while (stack_count) {
+        GraphvizFrame* frame = &stack[stack_count - 1];
+
+        if (frame->input == frame->node->in_count) {
+            stack_count--;
+
+            if (stack_count) {
+                GraphvizFrame* parent = &stack[stack_count - 1];
+                printf("  n%d -> n%d:i%d\n", frame->node->id, parent->node->id, parent->input);
+                parent->input++;
+            }
+
+            continue;
+        }
+
+        SB_Node* input = frame->node->_ins[frame->input];
+
+        if (!input) {
+            frame->input++;
+        }
+        else if (node_set_add(visited, input)) {
+            graphviz_node(input);
+            stack[stack_count++] = (GraphvizFrame) { input, 0 };
+        }
+        else {
+            printf("  n%d -> n%d:i%d\n", input->id, frame->node->id, frame->input);
+            frame->input++;
         }
     }
 }
@@ -330,10 +581,141 @@ void sb_visualize(SB_Context* context, SB_Proc* proc) {
 
     printf("digraph G {\n");
 
-    Bitset* visited = make_bitset(scratch.arena, context->next_id);
-    graphviz(visited, proc->end);
+    NodeSet visited = make_node_set(scratch.arena, context->next_id);
+    graphviz(scratch.arena, &visited, proc->end, context->next_id);
 
     printf("}\n\n");
 
     scratch_release(&scratch);
-}
\ No newline at end of file
+}
+
+int sb_node_count(SB_Context* context, SB_Proc* proc) {
+    Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
+
+    NodeSet visited = make_node_set(scratch.arena, context->next_id);
+    SB_Node** stack = arena_array(scratch.arena, SB_Node*, context->next_id);
+
+    int count = 0;
+    int stack_count = 0;
+
+    node_set_add(&visited, proc->end);
+    stack[stack_count++] = proc->end;
+
+    while (stack_count) {
+        SB_Node* node = stack[--stack_count];
+        count++;
+
+        for (int i = 0; i < node->in_count; ++i) {
+            SB_Node* input = node->_ins[i];
+
+            if (input && node_set_add(&visited, input)) {
+                stack[stack_count++] = input;
+            }
+        }
+    }
+
+    scratch_release(&scratch);
+    return count;
+}
+
+// Copies the graph reachable from END into a fresh arena and numbers it
+// densely. Nodes are laid out in postorder over their inputs, so a node
+// mostly sits just after what it reads, and the walks that follow, GCM's
+// schedule-early over inputs above all, move forward through memory rather
+// than around a heap scattered by rewrites. Ids, and with them id-indexed
+// side tables, follow the same order. Each node's use list, sized for its
+// live users, sits right after it. Anything else in the context is lost.
+void sb_compact(SB_Context* context, SB_Proc* proc) {
+    Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
+
+    int old_id_count = context->next_id;
+
+    NodeList order = { .arena = scratch.arena };
+    NodeSet visited = make_node_set(scratch.arena, old_id_count);
+
+    SB_Node** stack = arena_array(scratch.arena, SB_Node*, old_id_count);
+    int* next_input = arena_array(scratch.arena, int, old_id_count);
+    int stack_count = 0;
+
+    node_set_add(&visited, proc->end);
+    stack[stack_count++] = proc->end;
+
+    while (stack_count) {
+        SB_Node* node = stack[stack_count - 1];
+
+        if (next_input[node->id] == node->in_count) {
+            node_list_push(&order, node);
+            stack_count--;
+            continue;
+        }
+
+        SB_Node* input = node->_ins[next_input[node->id]++];
+
+        if (input && node_set_add(&visited, input)) {
+            stack[stack_count++] = input;
+        }
+    }
+
+    int* user_count = arena_array(scratch.arena, int, old_id_count);
+
+    for (int i = 0; i < order.count; ++i) {
+        SB_Node* node = order.data[i];
+
+        for (int j = 0; j < node->in_count; ++j) {
+            if (node->_ins[j]) {
+                user_count[node->_ins[j]->id]++;
+            }
+        }
+    }
+
+    Arena old_arena = context->arena;
+    context->arena = init_arena(ARENA_RESERVE_SIZE);
+
+    memset(context->free_nodes, 0, sizeof(context->free_nodes));
+    memset(context->free_blocks, 0, sizeof(context->free_blocks));
+    context->graph_bytes = 0;
+    context->graph_free_bytes = 0;
+    context->next_id = 0;
+
+    value_table_free(&context->value_table);
+
+    NodeMap copies = make_node_map(scratch.arena, old_id_count);
+
+    for (int i = 0; i < order.count; ++i) {
+        SB_Node* node = order.data[i];
+        bool late_ins = node->op == SB_OP_REGION || node->op == SB_OP_PHI;
+
+        SB_Node* copy = make_node(context, node->op, late_ins ? 0 : node->in_count, node->data_size, node->flags);
+        memcpy(sb_node_data(copy), sb_node_data(node), node->data_size);
+
+        if (late_ins) {
+            allocate_ins(context, copy, node->in_count);
+        }
+
+        if (user_count[node->id]) {
+            grow_users(context, copy, user_count[node->id]);
+        }
+
+        node_map_set(&copies, node, copy);
+    }
+
+    for (int i = 0; i < order.count; ++i) {
+        SB_Node* node = order.data[i];
+        SB_Node* copy = node_map_get(&copies, node);
+
+        for (int j = 0; j < node->in_count; ++j) {
+            if (node->_ins[j]) {
+                assign_input(context, copy, node_map_get(&copies, node->_ins[j]), j);
+            }
+        }
+
+        value_table_find_or_insert(context, copy);
+    }
+
+    proc->start = node_map_get(&copies, proc->start);
+    proc->end = node_map_get(&copies, proc->end);
+    assert("start not reachable from end" && proc->start);
+
+    release_arena(&old_arena);
+    scratch_release(&scratch);
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #define X(name, ...) SB_OP_##name,
 typedef enum {
@@ -22,26 +24,36 @@ typedef enum {
 typedef struct SB_User SB_User;
 typedef struct SB_Node SB_Node;
 
+// One input edge, seen from the input. Each node keeps its users in a
+// contiguous array, in no particular order.
 struct SB_User {
-    SB_User* next;
     SB_Node* node;
     int index;
 };
 
+// Small payloads (the value of a constant) follow the header directly and
+// fixed inputs follow the payload, so most nodes are a single allocation.
+// Regions and phis get their inputs later, those live in their own array.
+// Each input array is followed by the edges' positions in the use lists.
+// The users array holds `1 << users_log2` entries once it's allocated.
 struct SB_Node {
     int id;
-    SB_OpCode op;
-    SB_NodeFlags flags;
+    uint8_t op;
+    uint8_t flags;
+    uint8_t data_size;
+    uint8_t users_log2;
 
     int in_count;
-    SB_Node** _ins;
-
-    int data_size;
-    void* data;
+    int user_count;
 
+    SB_Node** _ins;
     SB_User* users;
 };
 
+static inline void* sb_node_data(SB_Node* node) {
+    return node + 1;
+}
+
 typedef struct {
     SB_Node* start;
     SB_Node* end;
@@ -49,7 +61,24 @@ typedef struct {
 
 typedef struct SB_Context SB_Context;
 
+typedef struct {
+    size_t arena_allocated;
+    size_t arena_high_water;
+    size_t scratch_high_water;
+
+    // Node and use list storage in use versus parked on the free lists
+    size_t graph_live_bytes;
+    size_t graph_free_bytes;
+} SB_MemoryStats;
+
 SB_Context* sb_init();
+void sb_free(SB_Context* context);
+
+// Hash-cons pure nodes (constants and arithmetic) as they're built. On by default.
+void sb_set_value_numbering(SB_Context* context, bool enabled);
+
+SB_MemoryStats sb_memory_stats(SB_Context* context);
+void sb_reset_memory_high_water(SB_Context* context);
 
 SB_Proc* sb_make_proc(SB_Context* context, SB_Node* start, SB_Node* end);
 
@@ -64,7 +93,7 @@ SB_Node* sb_node_alloca(SB_Context* context);
 SB_Node* sb_node_add(SB_Context* context, SB_Node* left, SB_Node* right);
 SB_Node* sb_node_sub(SB_Context* context, SB_Node* left, SB_Node* right);
 SB_Node* sb_node_mul(SB_Context* context, SB_Node* left, SB_Node* right);
-SB_Node* sb_node_sdiv(SB_Context* context, SB_Node* left, SB_Node* right);
+SB_Node* sb_node_sdiv(SB_Context* context, SB_Node* control, SB_Node* left, SB_Node* right);
 
 SB_Node* sb_node_load(SB_Context* context, SB_Node* control, SB_Node* store, SB_Node* address);
 SB_Node* sb_node_store(SB_Context* context, SB_Node* control, SB_Node* store, SB_Node* address, SB_Node* value);
@@ -83,8 +112,23 @@ void sb_set_phi_inputs(SB_Context* context, SB_Node* phi, SB_Node* region, int i
 SB_Node* sb_node_branch_true(SB_Context* context, SB_Node* branch);
 SB_Node* sb_node_branch_false(SB_Context* context, SB_Node* branch);
 
+// Turns allocas that are only loaded from and stored to into SSA values, run before sb_opt
+void sb_mem2reg(SB_Context* context, SB_Proc* proc);
+
+// Propagates constants along the paths that can actually run and prunes the branches that can't
+void sb_sccp(SB_Context* context, SB_Proc* proc);
+
 void sb_opt(SB_Context* context, SB_Proc* proc);
 
+// Moves the proc's live graph into a fresh arena with dense ids. Only valid
+// while the proc is the context's only graph, every other node is dropped.
+void sb_compact(SB_Context* context, SB_Proc* proc);
+
 void sb_visualize(SB_Context* context, SB_Proc* proc);
+int sb_node_count(SB_Context* context, SB_Proc* proc);
+
+void sb_generate_x64(SB_Context* context, SB_Proc* proc);
+bool sb_generate_x64_object(SB_Context* context, SB_Proc* proc, char* path);
 
-void sb_generate_x64(SB_Context* context, SB_Proc* proc);
\ No newline at end of file
+// Compiles the procedure into executable memory and calls it
+bool sb_run_x64(SB_Context* context, SB_Proc* proc, int64_t* result);
\ No newline at end of file
@@ -10,15 +10,168 @@ static const char* sb_op_name[] = {
 };
 #undef X
 
+// Input layouts of fixed-arity nodes
+
+enum {
+    END_CONTROL,
+    END_STORE,
+    END_RETURN_VALUE,
+    NUM_END_INS
+};
+
+enum {
+    BINARY_LEFT,
+    BINARY_RIGHT,
+    NUM_BINARY_INS
+};
+
+// Division traps on a zero divisor, so it also takes the control it was
+// written under, after its operands, and is never scheduled above it
+enum {
+    SDIV_CONTROL = NUM_BINARY_INS,
+    NUM_SDIV_INS
+};
+
+enum {
+    LOAD_CONTROL,
+    LOAD_STORE,
+    LOAD_ADDRESS,
+    NUM_LOAD_INS
+};
+
+enum {
+    STORE_CONTROL,
+    STORE_STORE,
+    STORE_ADDRESS,
+    STORE_VALUE,
+    NUM_STORE_INS
+};
+
+enum {
+    PROJECTION_INPUT,
+    NUM_PROJECTION_INS
+};
+
+enum {
+    BRANCH_CONTROL,
+    BRANCH_PREDICATE,
+    NUM_BRANCH_INS
+};
+
+// Distinct allocas never overlap, any other address might overlap anything
+static inline bool may_alias(SB_Node* a, SB_Node* b) {
+    return a == b || a->op != SB_OP_ALLOCA || b->op != SB_OP_ALLOCA;
+}
+
+// Every input slot records where its edge sits in the input's use list, so
+// an edge is unlinked without searching. The positions follow the inputs.
+static inline int* input_positions(SB_Node* node) {
+    return (int*)(node->_ins + node->in_count);
+}
+
+// Stores `user` at `position` in the use list and points its slot back at it
+static inline void place_user(SB_Node* input, int position, SB_User user) {
+    input->users[position] = user;
+    input_positions(user.node)[user.index] = position;
+}
+
+// Use list maintenance for passes that rewire edges themselves
+void add_user(SB_Context* context, SB_Node* input, SB_Node* node, int index);
+void remove_user(SB_Node* input, SB_Node* node, int index);
+void move_users(SB_Context* context, SB_Node* target, SB_Node* source);
+
+// Returns an unlinked node and its arrays to the context's free lists
+void free_node(SB_Context* context, SB_Node* node);
+
+// Hash-consing table for pure nodes. Every node in the table hashes by its
+// current op, inputs and data, so anything that rewires a pure node's inputs
+// has to take it out of the table first.
+
+typedef struct {
+    int count;
+    int capacity;
+    SB_Node** slots;
+} ValueTable;
+
+// Freed graph storage, reused before the arena grows. Nodes are binned by
+// exact size and keep their id while free, so the id is handed out again
+// with the memory. Arrays are binned by power of two.
+
+#define NUM_NODE_CLASSES 16
+#define NUM_BLOCK_CLASSES 48
+
+typedef struct FreeNode FreeNode;
+typedef struct FreeBlock FreeBlock;
+
+struct FreeNode {
+    int id;
+    FreeNode* next;
+};
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
 struct SB_Context {
-    Arena arena;
+    Arena persistent;
+
+    Arena arena; // Graph storage, replaced by sb_compact
     int next_id;
 
+    FreeNode* free_nodes[NUM_NODE_CLASSES];
+    FreeBlock* free_blocks[NUM_BLOCK_CLASSES];
+    size_t graph_bytes;
+    size_t graph_free_bytes;
+
+    bool value_numbering;
+    ValueTable value_table;
+
     ScratchLibrary scratch_library;
 };
 
+bool is_value_numbered(SB_OpCode op);
+SB_Node* value_table_lookup(SB_Context* context, SB_OpCode op, int in_count, SB_Node** ins, void* data, int data_size);
+SB_Node* value_table_find_or_insert(SB_Context* context, SB_Node* node);
+void value_table_remove(SB_Context* context, SB_Node* node);
+void value_table_free(ValueTable* table);
+
+// Side tables indexed directly by node id. Ids are dense, so these replace
+// hashing for membership and per-node data. Both grow on demand for nodes
+// created after the table was made.
+
+typedef struct {
+    Arena* arena;
+    Bitset* bits;
+} NodeSet;
+
+NodeSet make_node_set(Arena* arena, int capacity);
+bool node_set_add(NodeSet* set, SB_Node* node);
+void node_set_remove(NodeSet* set, SB_Node* node);
+bool node_set_has(NodeSet* set, SB_Node* node);
+void node_set_clear(NodeSet* set);
+
+typedef struct {
+    Arena* arena;
+    int capacity;
+    void** values;
+} NodeMap;
+
+NodeMap make_node_map(Arena* arena, int capacity);
+void node_map_set(NodeMap* map, SB_Node* node, void* value);
+void* node_map_get(NodeMap* map, SB_Node* node);
+
+typedef struct {
+    Arena* arena;
+    int count;
+    int capacity;
+    SB_Node** data;
+} NodeList;
+
+void node_list_push(NodeList* list, SB_Node* node);
+
 typedef struct GCM_Node GCM_Node;
 typedef struct GCM_Block GCM_Block;
+typedef struct GCM_Loop GCM_Loop;
 
 struct GCM_Node {
     GCM_Block* block;
@@ -32,6 +185,10 @@ struct GCM_Block {
     GCM_Block* next;
     
     int tid;
+    int dom_depth;
+    int dom_pre;
+    int dom_post;
+    int loop_depth;
 
     int successor_count;
     int predecessor_count;
@@ -43,7 +200,20 @@ struct GCM_Block {
     GCM_Node* end;
 
     GCM_Block* immediate_dominator;
+    GCM_Loop* loop; // Innermost loop containing the block
+
+    // Only filled in by gcm_dominance_frontiers
+    int frontier_count;
+    GCM_Block** frontier;
+};
+
+// A natural loop, all back edges into the same header form one loop
+struct GCM_Loop {
+    GCM_Loop* parent;
+    GCM_Block* header;
+    int depth;
 };
 
 GCM_Block* global_code_motion(Arena* arena, SB_Context* context, SB_Proc* proc);
+void gcm_dominance_frontiers(Arena* arena, SB_Context* context, GCM_Block* control_flow_head);
 void gcm_print(GCM_Block* control_flow_head);
\ No newline at end of file
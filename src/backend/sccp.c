@@ -0,0 +1,596 @@
+#include "sb_internal.h"
+
+// Sparse conditional constant propagation. Every node gets a lattice value
+// that only ever moves down: TOP (no information yet), a constant, or
+// BOTTOM (varies). Control nodes use the same lattice for reachability,
+// TOP being unreachable and BOTTOM reachable. A phi only merges the inputs
+// whose region edge is reachable, and a branch on a constant only reaches
+// one of its projections, so constants flow around dead paths.
+//
+// Once the values settle, constant nodes are replaced, unreachable region
+// edges are cut along with their phi inputs, and constant branches are
+// bypassed. A loop that only exited through dead paths keeps a never-taken
+// exit to END. Whatever END no longer reaches is swept. Regions and phis
+// left with a single input are folded by sb_opt.
+
+typedef enum {
+    LATTICE_TOP,
+    LATTICE_CONSTANT,
+    LATTICE_BOTTOM
+} LatticeKind;
+
+typedef struct {
+    SB_Context* context;
+
+    uint8_t* kind;
+    uint64_t* value;
+
+    NodeSet queued;
+    NodeList work;
+} Propagation;
+
+static bool is_control(SB_Node* node) {
+    return (node->flags & SB_NODE_FLAG_PRODUCES_CONTROL) || node->op == SB_OP_END;
+}
+
+static bool is_reachable(Propagation* p, SB_Node* control) {
+    return control && p->kind[control->id] == LATTICE_BOTTOM;
+}
+
+static uint64_t node_constant(SB_Node* node) {
+    uint64_t value;
+    memcpy(&value, sb_node_data(node), sizeof(value));
+    return value;
+}
+
+static void queue(Propagation* p, SB_Node* node) {
+    if (node_set_add(&p->queued, node)) {
+        node_list_push(&p->work, node);
+    }
+}
+
+// Phis read their region's edges and projections read their branch's
+// predicate, so a change has to reach them through the region or branch
+static void queue_users(Propagation* p, SB_Node* node) {
+    for (SB_User* user = node->users; user < node->users + node->user_count; ++user) {
+        queue(p, user->node);
+
+        if (user->node->op == SB_OP_REGION || user->node->op == SB_OP_BRANCH) {
+            for (SB_User* second = user->node->users; second < user->node->users + user->node->user_count; ++second) {
+                queue(p, second->node);
+            }
+        }
+    }
+}
+
+static LatticeKind fold_binary(SB_OpCode op, uint64_t left, uint64_t right, uint64_t* result) {
+    switch (op) {
+        default:
+            assert(false);
+            return LATTICE_BOTTOM;
+
+        case SB_OP_ADD:
+            *result = left + right;
+            return LATTICE_CONSTANT;
+
+        case SB_OP_SUB:
+            *result = left - right;
+            return LATTICE_CONSTANT;
+
+        case SB_OP_MUL:
+            *result = left * right;
+            return LATTICE_CONSTANT;
+
+        case SB_OP_SDIV: {
+            int64_t dividend = (int64_t)left;
+            int64_t divisor = (int64_t)right;
+
+            // Both of these trap at runtime, leave them for the program to hit
+            if (divisor == 0 || (dividend == INT64_MIN && divisor == -1)) {
+                return LATTICE_BOTTOM;
+            }
+
+            *result = (uint64_t)(dividend / divisor);
+            return LATTICE_CONSTANT;
+        }
+    }
+}
+
+static LatticeKind evaluate(Propagation* p, SB_Node* node, uint64_t* result) {
+    uint8_t* kind = p->kind;
+    uint64_t* value = p->value;
+
+    switch (node->op) {
+        default:
+            return LATTICE_BOTTOM;
+
+        case SB_OP_INTEGER_CONSTANT:
+            *result = node_constant(node);
+            return LATTICE_CONSTANT;
+
+        case SB_OP_ADD:
+        case SB_OP_SUB:
+        case SB_OP_MUL:
+        case SB_OP_SDIV: {
+            SB_Node* left = node->_ins[BINARY_LEFT];
+            SB_Node* right = node->_ins[BINARY_RIGHT];
+
+            if (kind[left->id] == LATTICE_TOP || kind[right->id] == LATTICE_TOP) {
+                return LATTICE_TOP;
+            }
+
+            if (kind[left->id] == LATTICE_CONSTANT && kind[right->id] == LATTICE_CONSTANT) {
+                return fold_binary(node->op, value[left->id], value[right->id], result);
+            }
+
+            return LATTICE_BOTTOM;
+        }
+
+        case SB_OP_START:
+            return LATTICE_BOTTOM;
+
+        case SB_OP_START_CONTROL:
+        case SB_OP_BRANCH:
+        case SB_OP_END:
+            return kind[node->_ins[0]->id] == LATTICE_BOTTOM ? LATTICE_BOTTOM : LATTICE_TOP;
+
+        case SB_OP_REGION:
+            for (int i = 0; i < node->in_count; ++i) {
+                if (is_reachable(p, node->_ins[i])) {
+                    return LATTICE_BOTTOM;
+                }
+            }
+
+            return LATTICE_TOP;
+
+        case SB_OP_BRANCH_TRUE:
+        case SB_OP_BRANCH_FALSE: {
+            SB_Node* branch = node->_ins[0];
+            SB_Node* predicate = branch->_ins[BRANCH_PREDICATE];
+
+            if (!is_reachable(p, branch) || kind[predicate->id] == LATTICE_TOP) {
+                return LATTICE_TOP;
+            }
+
+            if (kind[predicate->id] == LATTICE_CONSTANT && (value[predicate->id] != 0) != (node->op == SB_OP_BRANCH_TRUE)) {
+                return LATTICE_TOP;
+            }
+
+            return LATTICE_BOTTOM;
+        }
+
+        case SB_OP_PHI: {
+            SB_Node* region = node->_ins[0];
+            LatticeKind merged = LATTICE_TOP;
+
+            for (int i = 1; i < node->in_count; ++i) {
+                SB_Node* input = node->_ins[i];
+
+                if (!input || !is_reachable(p, region->_ins[i - 1]) || kind[input->id] == LATTICE_TOP) {
+                    continue;
+                }
+
+                if (kind[input->id] == LATTICE_BOTTOM) {
+                    return LATTICE_BOTTOM;
+                }
+
+                if (merged == LATTICE_CONSTANT && *result != value[input->id]) {
+                    return LATTICE_BOTTOM;
+                }
+
+                merged = LATTICE_CONSTANT;
+                *result = value[input->id];
+            }
+
+            return merged;
+        }
+    }
+}
+
+// Cutting an edge leaves its user entry behind, it's dropped by the sweep
+static void cut_input(SB_Node* node, int index) {
+    node->_ins[index] = 0;
+}
+
+// Constants made by the rewrite are newer than the lattice, but they're always constant nodes
+static bool has_constant_predicate(Propagation* p, SB_Node* branch) {
+    SB_Node* predicate = branch->_ins[BRANCH_PREDICATE];
+    return predicate->op == SB_OP_INTEGER_CONSTANT || p->kind[predicate->id] == LATTICE_CONSTANT;
+}
+
+static SB_Node* live_projection(Propagation* p, SB_Node* branch) {
+    for (SB_User* user = branch->users; user < branch->users + branch->user_count; ++user) {
+        if (is_reachable(p, user->node)) {
+            return user->node;
+        }
+    }
+
+    return 0;
+}
+
+static SB_Node* dead_projection(Propagation* p, SB_Node* branch) {
+    for (SB_User* user = branch->users; user < branch->users + branch->user_count; ++user) {
+        if (!is_reachable(p, user->node)) {
+            return user->node;
+        }
+    }
+
+    return 0;
+}
+
+static bool is_bypassed(Propagation* p, SB_Node* node) {
+    return node->op == SB_OP_BRANCH && has_constant_predicate(p, node);
+}
+
+static int control_in_count(SB_Node* node) {
+    return node->op == SB_OP_REGION ? node->in_count : (node->op == SB_OP_START ? 0 : 1);
+}
+
+// The control edge as it will be after the rewrite, null if it's cut. A
+// bypassed branch hands its projection's users its own control.
+static SB_Node* surviving_input(Propagation* p, SB_Node* node, int index) {
+    SB_Node* input = node->_ins[index];
+
+    if (!is_reachable(p, input)) {
+        return 0;
+    }
+
+    return is_bypassed(p, input) ? input->_ins[BRANCH_CONTROL] : input;
+}
+
+// Marks everything that reaches `root` over surviving control edges
+static void find_exiting(Propagation* p, NodeSet* found, NodeList* stack, SB_Node* root) {
+    node_set_add(found, root);
+    node_list_push(stack, root);
+
+    while (stack->count) {
+        SB_Node* node = stack->data[--stack->count];
+
+        for (int i = 0; i < control_in_count(node); ++i) {
+            SB_Node* input = surviving_input(p, node, i);
+
+            if (input && node_set_add(found, input)) {
+                node_list_push(stack, input);
+            }
+        }
+    }
+}
+
+// Postorder of a walk back over surviving control edges through the
+// reachable control nodes that don't reach END
+static void order_stuck(Propagation* p, Arena* arena, NodeList* nodes, NodeSet* found, NodeList* order) {
+    NodeSet visited = make_node_set(arena, p->context->next_id);
+    int* next_input = arena_array(arena, int, p->context->next_id);
+    NodeList stack = { .arena = arena };
+
+    for (int i = 0; i < nodes->count; ++i) {
+        SB_Node* root = nodes->data[i];
+
+        if (!is_control(root) || !is_reachable(p, root) || is_bypassed(p, root) || node_set_has(found, root)) {
+            continue;
+        }
+
+        if (node_set_add(&visited, root)) {
+            node_list_push(&stack, root);
+        }
+
+        while (stack.count) {
+            SB_Node* node = stack.data[stack.count - 1];
+
+            if (next_input[node->id] == control_in_count(node)) {
+                node_list_push(order, node);
+                stack.count--;
+                continue;
+            }
+
+            SB_Node* input = surviving_input(p, node, next_input[node->id]++);
+
+            if (input && !node_set_has(found, input) && node_set_add(&visited, input)) {
+                node_list_push(&stack, input);
+            }
+        }
+    }
+}
+
+// Nothing `node` leads to leaves its loop, so a walk forward stays inside
+// it. Of the loop's constant branches, picks the one nearest END in `nodes`.
+static SB_Node* stuck_branch(Propagation* p, NodeSet* visited, NodeList* stack, int* rank, SB_Node* node) {
+    SB_Node* best = 0;
+
+    node_set_add(visited, node);
+    node_list_push(stack, node);
+
+    while (stack->count) {
+        SB_Node* control = stack->data[--stack->count];
+
+        for (SB_User* user = control->users; user < control->users + control->user_count; ++user) {
+            SB_Node* next = user->node;
+
+            if (!is_control(next) || !is_reachable(p, next) || user->index >= control_in_count(next) || next->_ins[user->index] != control) {
+                continue;
+            }
+
+            if (is_bypassed(p, next)) {
+                if (dead_projection(p, next) && (!best || rank[next->id] < rank[best->id])) {
+                    best = next;
+                }
+
+                next = live_projection(p, next);
+            }
+
+            if (next && node_set_add(visited, next)) {
+                node_list_push(stack, next);
+            }
+        }
+    }
+
+    return best;
+}
+
+// A loop whose exits are all on dead paths would be left with no way to
+// END. Taking the stuck nodes by decreasing postorder visits a loop that
+// leads nowhere else first, as in Kosaraju's algorithm. Each one keeps a
+// constant branch, whose dead projection is given a never-taken edge to
+// END, and with it everything leading into the loop is connected again.
+static void keep_loop_exits(Propagation* p, Arena* arena, NodeList* nodes, SB_Node* end, NodeSet* kept, NodeList* exits) {
+    int node_count = p->context->next_id;
+
+    NodeSet found = make_node_set(arena, node_count);
+    NodeSet visited = make_node_set(arena, node_count);
+    NodeList stack = { .arena = arena };
+    NodeList order = { .arena = arena };
+    int* rank = arena_array(arena, int, node_count);
+
+    for (int i = 0; i < nodes->count; ++i) {
+        rank[nodes->data[i]->id] = i;
+    }
+
+    if (is_reachable(p, end)) {
+        find_exiting(p, &found, &stack, end);
+    }
+
+    order_stuck(p, arena, nodes, &found, &order);
+
+    for (int i = order.count - 1; i >= 0; --i) {
+        if (node_set_has(&found, order.data[i])) {
+            continue;
+        }
+
+        SB_Node* branch = stuck_branch(p, &visited, &stack, rank, order.data[i]);
+        assert("loop that never exits has no constant branch" && branch);
+
+        node_set_add(kept, branch);
+        node_list_push(exits, dead_projection(p, branch));
+        find_exiting(p, &found, &stack, branch->_ins[BRANCH_CONTROL]);
+    }
+}
+
+static SB_Node* start_store(SB_Context* context, SB_Node* start) {
+    for (SB_User* user = start->users; user < start->users + start->user_count; ++user) {
+        if (user->node->op == SB_OP_START_STORE) {
+            return user->node;
+        }
+    }
+
+    return sb_node_start_store(context, start);
+}
+
+// The old edge's user entry is dropped by the sweep
+static void replace_input(SB_Context* context, SB_Node* node, int index, SB_Node* input) {
+    node->_ins[index] = input;
+    add_user(context, input, node, index);
+}
+
+// Joins the kept exits with END's own path, if it has one. The exits are
+// never taken, so they hand END the initial store and a zero.
+static void join_exits(Propagation* p, SB_Proc* proc, NodeList* exits) {
+    SB_Context* context = p->context;
+    SB_Node* end = proc->end;
+
+    int count = 0;
+    SB_Node** controls = arena_array(exits->arena, SB_Node*, exits->count + 1);
+    SB_Node** stores = arena_array(exits->arena, SB_Node*, exits->count + 1);
+    SB_Node** values = arena_array(exits->arena, SB_Node*, exits->count + 1);
+
+    if (is_reachable(p, end)) {
+        controls[count] = end->_ins[END_CONTROL];
+        stores[count] = end->_ins[END_STORE];
+        values[count] = end->_ins[END_RETURN_VALUE];
+        count++;
+    }
+
+    for (int i = 0; i < exits->count; ++i) {
+        controls[count] = exits->data[i];
+        stores[count] = start_store(context, proc->start);
+        values[count] = sb_node_integer_constant(context, 0);
+        count++;
+    }
+
+    SB_Node* region = sb_node_region(context);
+    SB_Node* store = sb_node_phi(context);
+    SB_Node* value = sb_node_phi(context);
+
+    sb_set_region_inputs(context, region, count, controls);
+    sb_set_phi_inputs(context, store, region, count, stores);
+    sb_set_phi_inputs(context, value, region, count, values);
+
+    replace_input(context, end, END_CONTROL, region);
+    replace_input(context, end, END_STORE, store);
+    replace_input(context, end, END_RETURN_VALUE, value);
+}
+
+// Drops the user entries of dead nodes and of cut or rewired edges from
+// everything END still reaches, then frees the dead nodes. `nodes` can list
+// a new constant twice, the dead set makes sure it's freed once.
+static void sweep(SB_Context* context, Arena* arena, NodeList* nodes, SB_Node* end) {
+    NodeSet live = make_node_set(arena, context->next_id);
+    NodeList stack = { .arena = arena };
+    NodeList reached = { .arena = arena };
+
+    node_set_add(&live, end);
+    node_list_push(&stack, end);
+
+    while (stack.count) {
+        SB_Node* node = stack.data[--stack.count];
+        node_list_push(&reached, node);
+
+        for (int i = 0; i < node->in_count; ++i) {
+            SB_Node* input = node->_ins[i];
+
+            if (input && node_set_add(&live, input)) {
+                node_list_push(&stack, input);
+            }
+        }
+    }
+
+    for (int i = 0; i < reached.count; ++i) {
+        SB_Node* node = reached.data[i];
+        int kept = 0;
+
+        for (int j = 0; j < node->user_count; ++j) {
+            SB_User user = node->users[j];
+
+            if (node_set_has(&live, user.node) && user.node->_ins[user.index] == node) {
+                place_user(node, kept++, user);
+            }
+        }
+
+        node->user_count = kept;
+    }
+
+    NodeSet dead = make_node_set(arena, context->next_id);
+
+    for (int i = 0; i < nodes->count; ++i) {
+        if (!node_set_has(&live, nodes->data[i]) && node_set_add(&dead, nodes->data[i])) {
+            value_table_remove(context, nodes->data[i]);
+        }
+    }
+
+    // A dead node's users are dead too or no longer read it, so its use list is simply dropped
+    for (int i = 0; i < nodes->count; ++i) {
+        SB_Node* node = nodes->data[i];
+
+        if (node_set_has(&dead, node)) {
+            node_set_remove(&dead, node);
+            node->user_count = 0;
+            free_node(context, node);
+        }
+    }
+}
+
+void sb_sccp(SB_Context* context, SB_Proc* proc) {
+    Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
+    int node_count = context->next_id;
+
+    Propagation p = {
+        .context = context,
+        .kind = arena_array(scratch.arena, uint8_t, node_count),
+        .value = arena_array(scratch.arena, uint64_t, node_count),
+        .queued = make_node_set(scratch.arena, node_count),
+        .work = { .arena = scratch.arena }
+    };
+
+    NodeList nodes = { .arena = scratch.arena };
+    NodeSet visited = make_node_set(scratch.arena, node_count);
+
+    node_set_add(&visited, proc->end);
+    node_list_push(&nodes, proc->end);
+
+    for (int i = 0; i < nodes.count; ++i) {
+        SB_Node* node = nodes.data[i];
+
+        for (int j = 0; j < node->in_count; ++j) {
+            SB_Node* input = node->_ins[j];
+
+            if (input && node_set_add(&visited, input)) {
+                node_list_push(&nodes, input);
+            }
+        }
+    }
+
+    // Inputs come after their users in `nodes`, so walking it backwards mostly visits definitions first
+    for (int i = nodes.count - 1; i >= 0; --i) {
+        queue(&p, nodes.data[i]);
+    }
+
+    for (int i = 0; i < p.work.count; ++i) {
+        SB_Node* node = p.work.data[i];
+        node_set_remove(&p.queued, node);
+
+        uint64_t value = 0;
+        LatticeKind kind = evaluate(&p, node, &value);
+
+        if (kind == p.kind[node->id] && (kind != LATTICE_CONSTANT || value == p.value[node->id])) {
+            continue;
+        }
+
+        p.kind[node->id] = (uint8_t)kind;
+        p.value[node->id] = value;
+
+        queue_users(&p, node);
+    }
+
+    NodeList constants = { .arena = scratch.arena };
+
+    for (int i = 0; i < nodes.count; ++i) {
+        SB_Node* node = nodes.data[i];
+
+        if (p.kind[node->id] == LATTICE_CONSTANT && node->op != SB_OP_INTEGER_CONSTANT) {
+            SB_Node* constant = sb_node_integer_constant(context, p.value[node->id]);
+            move_users(context, node, constant);
+            node_list_push(&constants, constant);
+        }
+    }
+
+    NodeSet kept = make_node_set(scratch.arena, node_count);
+    NodeList exits = { .arena = scratch.arena };
+    keep_loop_exits(&p, scratch.arena, &nodes, proc->end, &kept, &exits);
+
+    for (int i = 0; i < nodes.count; ++i) {
+        SB_Node* region = nodes.data[i];
+
+        if (region->op != SB_OP_REGION || !is_reachable(&p, region)) {
+            continue;
+        }
+
+        for (int j = 0; j < region->in_count; ++j) {
+            if (!region->_ins[j] || is_reachable(&p, region->_ins[j])) {
+                continue;
+            }
+
+            cut_input(region, j);
+
+            for (SB_User* user = region->users; user < region->users + region->user_count; ++user) {
+                if (user->node->op == SB_OP_PHI && user->index == 0) {
+                    cut_input(user->node, j + 1);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < nodes.count; ++i) {
+        SB_Node* branch = nodes.data[i];
+
+        if (branch->op != SB_OP_BRANCH || !is_reachable(&p, branch) || !is_bypassed(&p, branch) || node_set_has(&kept, branch)) {
+            continue;
+        }
+
+        SB_Node* projection = live_projection(&p, branch);
+        assert("constant branch has no live projection" && projection);
+
+        move_users(context, projection, branch->_ins[BRANCH_CONTROL]);
+    }
+
+    if (exits.count) {
+        join_exits(&p, proc, &exits);
+    }
+
+    // A new constant can end up only used by dead code, the sweep has to forget it too
+    for (int i = 0; i < constants.count; ++i) {
+        node_list_push(&nodes, constants.data[i]);
+    }
+
+    sweep(context, scratch.arena, &nodes, proc->end);
+
+    scratch_release(&scratch);
+}
@@ -1,10 +1,733 @@
+#include <stdio.h>
+
 #include "sb.h"
-#include "sb_internal.h"
+#include "x64_internal.h"
+#include "platform.h"
+
+// Instruction selection walks the GCM schedule block by block and tiles each
+// node into machine instructions over virtual registers. Constants and
+// allocas are rematerialised at every use that needs them in a register,
+// and a load whose only user is the next arithmetic op in its block (with no
+// store in between) is folded into that op as a memory operand.
+
+typedef struct {
+    Arena* arena;
+    X64_Function* function;
+    X64_Block* block;
+
+    X64_Block** blocks;     // Indexed by GCM block tid
+    X64_Block** block_of;   // Indexed by node id
+    int* store_epoch;       // Stores scheduled before the node in its block
+    int* vreg;              // Indexed by node id, 0 when not assigned yet
+    int* slot;              // Alloca slot plus one, indexed by node id
+
+    NodeSet folded_loads;
+    NodeMap phi_kinds;
+} ISel;
+
+enum {
+    PHI_KIND_VALUE = 1,
+    PHI_KIND_MEMORY
+};
+
+enum {
+    ALLOW_IMMEDIATE = SB_BIT(0),
+    ALLOW_MEMORY = SB_BIT(1)
+};
+
+static X64_Operand reg_operand(int reg) {
+    return (X64_Operand) {
+        .kind = X64_OPERAND_REGISTER,
+        .reg = reg
+    };
+}
+
+static X64_Operand immediate_operand(int64_t value) {
+    return (X64_Operand) {
+        .kind = X64_OPERAND_IMMEDIATE,
+        .immediate = value
+    };
+}
+
+static X64_Operand slot_operand(int slot) {
+    return (X64_Operand) {
+        .kind = X64_OPERAND_MEMORY,
+        .slot = slot
+    };
+}
+
+static X64_Operand block_operand(X64_Block* block) {
+    return (X64_Operand) {
+        .kind = X64_OPERAND_BLOCK,
+        .block = block
+    };
+}
+
+static X64_Inst* emit(ISel* s, X64_OpCode op, int operand_count, X64_Operand* operands) {
+    X64_Inst* inst = arena_type(s->arena, X64_Inst);
+    inst->op = op;
+    inst->operand_count = operand_count;
+
+    for (int i = 0; i < operand_count; ++i) {
+        inst->operands[i] = operands[i];
+    }
+
+    X64_Block* block = s->block;
+    inst->prev = block->end;
+
+    if (block->end) {
+        block->end->next = inst;
+    }
+    else {
+        block->start = inst;
+    }
+
+    block->end = inst;
+
+    return inst;
+}
+
+static void emit0(ISel* s, X64_OpCode op) {
+    emit(s, op, 0, 0);
+}
+
+static void emit1(ISel* s, X64_OpCode op, X64_Operand a) {
+    emit(s, op, 1, &a);
+}
+
+static void emit2(ISel* s, X64_OpCode op, X64_Operand a, X64_Operand b) {
+    X64_Operand operands[] = { a, b };
+    emit(s, op, 2, operands);
+}
+
+static void emit3(ISel* s, X64_OpCode op, X64_Operand a, X64_Operand b, X64_Operand c) {
+    X64_Operand operands[] = { a, b, c };
+    emit(s, op, 3, operands);
+}
+
+static int new_vreg(ISel* s) {
+    return s->function->vreg_count++ + X64_FIRST_VREG;
+}
+
+static int node_vreg(ISel* s, SB_Node* node) {
+    if (!s->vreg[node->id]) {
+        s->vreg[node->id] = new_vreg(s);
+    }
+
+    return s->vreg[node->id];
+}
+
+static int alloca_slot(ISel* s, SB_Node* node) {
+    assert(node->op == SB_OP_ALLOCA);
+
+    if (!s->slot[node->id]) {
+        s->slot[node->id] = ++s->function->slot_count;
+    }
+
+    return s->slot[node->id] - 1;
+}
+
+static bool fits_imm32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// An undefined value (a path that falls off the end without returning) reads as zero
+static bool constant_value(SB_Node* node, int64_t* value) {
+    switch (node->op) {
+        default:
+            return false;
+
+        case SB_OP_NULL:
+            *value = 0;
+            return true;
+
+        case SB_OP_INTEGER_CONSTANT:
+            memcpy(value, sb_node_data(node), sizeof(*value));
+            return true;
+    }
+}
+
+static X64_Operand address_operand(ISel* s, SB_Node* address) {
+    if (address->op == SB_OP_ALLOCA) {
+        return slot_operand(alloca_slot(s, address));
+    }
+
+    return (X64_Operand) {
+        .kind = X64_OPERAND_MEMORY,
+        .reg = node_vreg(s, address),
+        .slot = X64_NO_SLOT
+    };
+}
+
+static X64_Operand use_value(ISel* s, SB_Node* node, int allow) {
+    int64_t value;
+
+    if (constant_value(node, &value)) {
+        if ((allow & ALLOW_IMMEDIATE) && fits_imm32(value)) {
+            return immediate_operand(value);
+        }
+
+        X64_Operand dest = reg_operand(new_vreg(s));
+        emit2(s, X64_OP_MOV, dest, immediate_operand(value));
+        return dest;
+    }
+
+    if (node->op == SB_OP_ALLOCA) {
+        X64_Operand dest = reg_operand(new_vreg(s));
+        emit2(s, X64_OP_LEA, dest, address_operand(s, node));
+        return dest;
+    }
+
+    if (node_set_has(&s->folded_loads, node)) {
+        assert("folded load used where memory isn't allowed" && (allow & ALLOW_MEMORY));
+        return address_operand(s, node->_ins[LOAD_ADDRESS]);
+    }
+
+    assert("value used before it was selected" && s->vreg[node->id]);
+    return reg_operand(s->vreg[node->id]);
+}
+
+static bool can_fold_load(ISel* s, SB_Node* load) {
+    if (load->user_count != 1) {
+        return false;
+    }
+
+    SB_User* use = &load->users[0];
+
+    SB_Node* user = use->node;
+
+    if (s->block_of[user->id] != s->block_of[load->id] || s->store_epoch[user->id] != s->store_epoch[load->id]) {
+        return false;
+    }
+
+    switch (user->op) {
+        default:
+            return false;
+
+        case SB_OP_ADD:
+        case SB_OP_MUL:
+            return true;
+
+        case SB_OP_SUB:
+        case SB_OP_SDIV:
+            return use->index == BINARY_RIGHT;
+    }
+}
+
+// Phis merge either values or memory states, never both, so the first
+// non-phi input anywhere in a connected group of phis decides for all of them
+static bool is_memory_phi(ISel* s, Arena* scratch, SB_Node* phi) {
+    intptr_t kind = (intptr_t)node_map_get(&s->phi_kinds, phi);
+
+    if (kind) {
+        return kind == PHI_KIND_MEMORY;
+    }
+
+    int stack_count = 0;
+    int stack_capacity = 16;
+    SB_Node** stack = arena_array(scratch, SB_Node*, stack_capacity);
+
+    int visited_count = 0;
+    int visited_capacity = 16;
+    SB_Node** visited = arena_array(scratch, SB_Node*, visited_capacity);
+
+    node_map_set(&s->phi_kinds, phi, (void*)(intptr_t)-1);
+    stack[stack_count++] = phi;
+
+    while (stack_count && !kind) {
+        SB_Node* node = stack[--stack_count];
+
+        if (visited_count == visited_capacity) {
+            SB_Node** new_visited = arena_array(scratch, SB_Node*, visited_capacity * 2);
+            memcpy(new_visited, visited, visited_count * sizeof(SB_Node*));
+            visited_capacity *= 2;
+            visited = new_visited;
+        }
+
+        visited[visited_count++] = node;
+
+        for (int i = 1; i < node->in_count && !kind; ++i) {
+            SB_Node* input = node->_ins[i];
+
+            if (!input) {
+                continue;
+            }
+
+            if (input->op != SB_OP_PHI) {
+                kind = (input->op == SB_OP_STORE || input->op == SB_OP_START_STORE) ? PHI_KIND_MEMORY : PHI_KIND_VALUE;
+                break;
+            }
+
+            intptr_t input_kind = (intptr_t)node_map_get(&s->phi_kinds, input);
+
+            if (input_kind > 0) {
+                kind = input_kind;
+                break;
+            }
+
+            if (input_kind == 0) {
+                node_map_set(&s->phi_kinds, input, (void*)(intptr_t)-1);
+
+                if (stack_count == stack_capacity) {
+                    SB_Node** new_stack = arena_array(scratch, SB_Node*, stack_capacity * 2);
+                    memcpy(new_stack, stack, stack_count * sizeof(SB_Node*));
+                    stack_capacity *= 2;
+                    stack = new_stack;
+                }
+
+                stack[stack_count++] = input;
+            }
+        }
+    }
+
+    assert("phi has no non-phi inputs" && kind);
+
+    for (int i = 0; i < visited_count; ++i) {
+        node_map_set(&s->phi_kinds, visited[i], (void*)kind);
+    }
+
+    for (int i = 0; i < stack_count; ++i) {
+        node_map_set(&s->phi_kinds, stack[i], (void*)kind);
+    }
+
+    return kind == PHI_KIND_MEMORY;
+}
+
+static X64_Block* successor_block(ISel* s, SB_Node* branch, SB_OpCode projection) {
+    for (SB_User* user = branch->users; user < branch->users + branch->user_count; ++user) {
+        if (user->node->op == projection) {
+            return s->block_of[user->node->id];
+        }
+    }
+
+    assert("branch is missing a projection" && false);
+    return 0;
+}
+
+// Copies for the phis of `successor` along the edge from the current block.
+// If a phi reads another phi of the same region the copies have to behave
+// like a parallel assignment, so everything goes through fresh temporaries.
+static void emit_phi_moves(ISel* s, Arena* scratch, GCM_Block* successor) {
+    GCM_Node* first = successor->start;
+
+    if (!first || first->node->op != SB_OP_REGION) {
+        return;
+    }
+
+    SB_Node* region = first->node;
+    int index = -1;
+
+    for (int i = 0; i < region->in_count; ++i) {
+        if (region->_ins[i] && s->block_of[region->_ins[i]->id] == s->block) {
+            index = i;
+            break;
+        }
+    }
+
+    assert(index != -1);
+
+    int phi_count = 0;
+    bool reads_phi = false;
+
+    for (GCM_Node* gcm_node = first->next; gcm_node && gcm_node->node->op == SB_OP_PHI; gcm_node = gcm_node->next) {
+        SB_Node* phi = gcm_node->node;
+
+        if (is_memory_phi(s, scratch, phi) || !phi->_ins[index + 1]) {
+            continue;
+        }
+
+        SB_Node* input = phi->_ins[index + 1];
+        reads_phi |= input->op == SB_OP_PHI && input->_ins[0] == region;
+        phi_count++;
+    }
+
+    if (!phi_count) {
+        return;
+    }
+
+    X64_Operand* sources = arena_array(scratch, X64_Operand, phi_count);
+    int count = 0;
+
+    for (GCM_Node* gcm_node = first->next; gcm_node && gcm_node->node->op == SB_OP_PHI; gcm_node = gcm_node->next) {
+        SB_Node* phi = gcm_node->node;
+
+        if (is_memory_phi(s, scratch, phi) || !phi->_ins[index + 1]) {
+            continue;
+        }
+
+        X64_Operand source = use_value(s, phi->_ins[index + 1], ALLOW_IMMEDIATE);
+
+        if (reads_phi) {
+            X64_Operand temporary = reg_operand(new_vreg(s));
+            emit2(s, X64_OP_MOV, temporary, source);
+            source = temporary;
+        }
+
+        sources[count++] = source;
+    }
+
+    count = 0;
+
+    for (GCM_Node* gcm_node = first->next; gcm_node && gcm_node->node->op == SB_OP_PHI; gcm_node = gcm_node->next) {
+        SB_Node* phi = gcm_node->node;
+
+        if (is_memory_phi(s, scratch, phi) || !phi->_ins[index + 1]) {
+            continue;
+        }
+
+        emit2(s, X64_OP_MOV, reg_operand(node_vreg(s, phi)), sources[count++]);
+    }
+}
+
+static void select_binary(ISel* s, SB_Node* node) {
+    SB_Node* left = node->_ins[BINARY_LEFT];
+    SB_Node* right = node->_ins[BINARY_RIGHT];
+
+    X64_Operand dest = reg_operand(node_vreg(s, node));
+
+    switch (node->op) {
+        default:
+            assert(false);
+            break;
+
+        case SB_OP_ADD:
+        case SB_OP_SUB: {
+            X64_OpCode op = node->op == SB_OP_ADD ? X64_OP_ADD : X64_OP_SUB;
+            X64_Operand a = use_value(s, left, ALLOW_IMMEDIATE | ALLOW_MEMORY);
+            X64_Operand b = use_value(s, right, ALLOW_IMMEDIATE | ALLOW_MEMORY);
+
+            emit2(s, X64_OP_MOV, dest, a);
+            emit2(s, op, dest, b);
+        } break;
+
+        case SB_OP_MUL: {
+            X64_Operand b = use_value(s, right, ALLOW_IMMEDIATE | ALLOW_MEMORY);
+
+            if (b.kind == X64_OPERAND_IMMEDIATE) {
+                X64_Operand a = use_value(s, left, ALLOW_MEMORY);
+                emit3(s, X64_OP_IMUL, dest, a, b);
+            }
+            else {
+                X64_Operand a = use_value(s, left, ALLOW_IMMEDIATE | ALLOW_MEMORY);
+                emit2(s, X64_OP_MOV, dest, a);
+                emit2(s, X64_OP_IMUL, dest, b);
+            }
+        } break;
+
+        case SB_OP_SDIV: {
+            X64_Operand a = use_value(s, left, ALLOW_IMMEDIATE | ALLOW_MEMORY);
+            X64_Operand b = use_value(s, right, ALLOW_MEMORY);
+
+            emit2(s, X64_OP_MOV, reg_operand(X64_RAX), a);
+            emit0(s, X64_OP_CQO);
+            emit1(s, X64_OP_IDIV, b);
+            emit2(s, X64_OP_MOV, dest, reg_operand(X64_RAX));
+        } break;
+    }
+}
+
+static void select_node(ISel* s, SB_Node* node) {
+    switch (node->op) {
+        default:
+            assert("unhandled op in instruction selection" && false);
+            break;
+
+        // No code: control, memory state and values rematerialised at their uses
+        case SB_OP_NULL:
+        case SB_OP_INTEGER_CONSTANT:
+        case SB_OP_ALLOCA:
+        case SB_OP_START:
+        case SB_OP_START_CONTROL:
+        case SB_OP_START_STORE:
+        case SB_OP_REGION:
+        case SB_OP_PHI:
+        case SB_OP_BRANCH_TRUE:
+        case SB_OP_BRANCH_FALSE:
+            break;
+
+        case SB_OP_ADD:
+        case SB_OP_SUB:
+        case SB_OP_MUL:
+        case SB_OP_SDIV:
+            select_binary(s, node);
+            break;
+
+        case SB_OP_LOAD:
+            if (can_fold_load(s, node)) {
+                node_set_add(&s->folded_loads, node);
+            }
+            else {
+                X64_Operand dest = reg_operand(node_vreg(s, node));
+                emit2(s, X64_OP_MOV, dest, address_operand(s, node->_ins[LOAD_ADDRESS]));
+            }
+            break;
+
+        case SB_OP_STORE: {
+            X64_Operand value = use_value(s, node->_ins[STORE_VALUE], ALLOW_IMMEDIATE);
+            emit2(s, X64_OP_MOV, address_operand(s, node->_ins[STORE_ADDRESS]), value);
+        } break;
+
+        case SB_OP_BRANCH: {
+            X64_Operand predicate = use_value(s, node->_ins[BRANCH_PREDICATE], 0);
+            emit2(s, X64_OP_TEST, predicate, predicate);
+
+            X64_Block* on_true = successor_block(s, node, SB_OP_BRANCH_TRUE);
+            X64_Block* on_false = successor_block(s, node, SB_OP_BRANCH_FALSE);
+
+            s->block->successor_count = 2;
+            s->block->successors[0] = on_true;
+            s->block->successors[1] = on_false;
+
+            // Fall through to whichever successor is laid out next
+            if (s->block->next == on_true) {
+                emit1(s, X64_OP_JZ, block_operand(on_false));
+            }
+            else {
+                emit1(s, X64_OP_JNZ, block_operand(on_true));
+
+                if (s->block->next != on_false) {
+                    emit1(s, X64_OP_JMP, block_operand(on_false));
+                }
+            }
+        } break;
+
+        case SB_OP_END:
+            emit2(s, X64_OP_MOV, reg_operand(X64_RAX), use_value(s, node->_ins[END_RETURN_VALUE], ALLOW_IMMEDIATE | ALLOW_MEMORY));
+            emit0(s, X64_OP_RET);
+            break;
+    }
+}
+
+static bool is_terminator(SB_Node* node) {
+    return node->op == SB_OP_BRANCH || node->op == SB_OP_END;
+}
+
+X64_Function* x64_select(Arena* arena, SB_Context* context, GCM_Block* control_flow_head) {
+    Scratch scratch = scratch_get(&context->scratch_library, 1, &arena);
+
+    X64_Function* function = arena_type(arena, X64_Function);
+
+    for (GCM_Block* block = control_flow_head; block; block = block->next) {
+        block->tid = function->block_count++;
+    }
+
+    ISel s = {
+        .arena = arena,
+        .function = function,
+        .blocks = arena_array(scratch.arena, X64_Block*, function->block_count),
+        .block_of = arena_array(scratch.arena, X64_Block*, context->next_id),
+        .store_epoch = arena_array(scratch.arena, int, context->next_id),
+        .vreg = arena_array(scratch.arena, int, context->next_id),
+        .slot = arena_array(scratch.arena, int, context->next_id),
+        .folded_loads = make_node_set(scratch.arena, context->next_id),
+        .phi_kinds = make_node_map(scratch.arena, context->next_id)
+    };
+
+    X64_Block* tail = 0;
+
+    for (GCM_Block* block = control_flow_head; block; block = block->next) {
+        X64_Block* x64_block = arena_type(arena, X64_Block);
+        x64_block->id = block->tid;
+        x64_block->loop_depth = block->loop_depth;
+
+        if (tail) {
+            tail->next = x64_block;
+        }
+        else {
+            function->blocks = x64_block;
+        }
+
+        tail = x64_block;
+        s.blocks[block->tid] = x64_block;
+
+        int stores = 0;
+
+        for (GCM_Node* gcm_node = block->start; gcm_node; gcm_node = gcm_node->next) {
+            SB_Node* node = gcm_node->node;
+
+            s.block_of[node->id] = x64_block;
+            s.store_epoch[node->id] = stores;
+
+            if (node->op == SB_OP_STORE) {
+                stores++;
+            }
+        }
+    }
+
+    for (GCM_Block* block = control_flow_head; block; block = block->next) {
+        s.block = s.blocks[block->tid];
+
+        GCM_Node* gcm_node = block->start;
+
+        for (; gcm_node && !is_terminator(gcm_node->node); gcm_node = gcm_node->next) {
+            select_node(&s, gcm_node->node);
+        }
+
+        if (gcm_node) {
+            assert(!gcm_node->next);
+            select_node(&s, gcm_node->node);
+            continue;
+        }
+
+        if (block->successor_count) {
+            assert(block->successor_count == 1);
+
+            GCM_Block* successor = block->successors[0];
+            X64_Block* target = s.blocks[successor->tid];
+
+            emit_phi_moves(&s, scratch.arena, successor);
+
+            s.block->successor_count = 1;
+            s.block->successors[0] = target;
+
+            if (s.block->next != target) {
+                emit1(&s, X64_OP_JMP, block_operand(target));
+            }
+        }
+    }
+
+    scratch_release(&scratch);
+
+    return function;
+}
+
+static void print_operand(FILE* file, X64_Operand* operand) {
+    switch (operand->kind) {
+        default:
+            assert(false);
+            break;
+
+        case X64_OPERAND_REGISTER:
+            if (operand->reg < X64_FIRST_VREG) {
+                fprintf(file, "%s", x64_register_name[operand->reg]);
+            }
+            else {
+                fprintf(file, "v%d", operand->reg - X64_FIRST_VREG);
+            }
+            break;
+
+        case X64_OPERAND_IMMEDIATE:
+            fprintf(file, "%lld", (long long)operand->immediate);
+            break;
+
+        case X64_OPERAND_MEMORY:
+            if (operand->slot != X64_NO_SLOT) {
+                fprintf(file, "qword ptr [rbp - %d]", (operand->slot + 1) * 8);
+            }
+            else {
+                X64_Operand base = reg_operand(operand->reg);
+                fprintf(file, "qword ptr [");
+                print_operand(file, &base);
+
+                if (operand->immediate) {
+                    fprintf(file, " + %lld", (long long)operand->immediate);
+                }
+
+                fprintf(file, "]");
+            }
+            break;
+
+        case X64_OPERAND_BLOCK:
+            fprintf(file, ".LBB%d", operand->block->id);
+            break;
+    }
+}
+
+void x64_print(FILE* file, X64_Function* function, char* name) {
+    fprintf(file, "    .intel_syntax noprefix\n");
+    fprintf(file, "    .text\n");
+    fprintf(file, "    .globl %s\n", name);
+    fprintf(file, "%s:\n", name);
+    fprintf(file, "    push rbp\n");
+    fprintf(file, "    mov rbp, rsp\n");
+
+    if (x64_frame_size(function)) {
+        fprintf(file, "    sub rsp, %d\n", x64_frame_size(function));
+    }
+
+    for (X64_Block* block = function->blocks; block; block = block->next) {
+        fprintf(file, ".LBB%d:\n", block->id);
+
+        for (X64_Inst* inst = block->start; inst; inst = inst->next) {
+            if (inst->op == X64_OP_RET) {
+                fprintf(file, "    leave\n");
+            }
+
+            fprintf(file, "    %s", x64_op_name[inst->op]);
+
+            for (int i = 0; i < inst->operand_count; ++i) {
+                fprintf(file, i ? ", " : " ");
+                print_operand(file, &inst->operands[i]);
+            }
+
+            fprintf(file, "\n");
+        }
+    }
+
+    // Like the ELF writer, mark the stack as not executable
+    fprintf(file, "    .section .note.GNU-stack,\"\",@progbits\n");
+}
+
+static X64_Function* compile_function(Arena* arena, SB_Context* context, SB_Proc* proc) {
+    GCM_Block* control_flow_head = global_code_motion(arena, context, proc);
+    X64_Function* function = x64_select(arena, context, control_flow_head);
+    x64_allocate_registers(arena, context, function);
+
+    return function;
+}
 
 void sb_generate_x64(SB_Context* context, SB_Proc* proc) {
     Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
 
-    global_code_motion(scratch.arena, context, proc);
+    X64_Function* function = compile_function(scratch.arena, context, proc);
+    x64_print(stdout, function, "main");
 
     scratch_release(&scratch);
-}
\ No newline at end of file
+}
+
+bool sb_generate_x64_object(SB_Context* context, SB_Proc* proc, char* path) {
+    FILE* file = open_file(path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
+
+    X64_Function* function = compile_function(scratch.arena, context, proc);
+    X64_Code code = x64_encode(scratch.arena, context, function);
+
+    bool written = x64_write_elf(scratch.arena, file, "main", &code);
+    bool closed = fclose(file) == 0;
+
+    scratch_release(&scratch);
+
+    return written && closed;
+}
+
+typedef int64_t (*X64_Entry)(void);
+
+bool sb_run_x64(SB_Context* context, SB_Proc* proc, int64_t* result) {
+    Scratch scratch = scratch_get(&context->scratch_library, 0, 0);
+
+    X64_Function* function = compile_function(scratch.arena, context, proc);
+    X64_Code code = x64_encode(scratch.arena, context, function);
+
+    bool success = false;
+    void* memory = vm_allocate_code(code.size);
+
+    if (memory) {
+        memcpy(memory, code.data, code.size);
+
+        if (vm_protect_code(memory, code.size)) {
+            X64_Entry entry = (X64_Entry)memory;
+            *result = entry();
+            success = true;
+        }
+
+        vm_release(memory, code.size);
+    }
+
+    scratch_release(&scratch);
+
+    return success;
+}
@@ -0,0 +1,268 @@
+#include "x64_internal.h"
+
+// Writes encoded code as an ELF64 relocatable object for x86-64 Linux. Every
+// offset is known once the string tables are sized, so the file goes out
+// front to back in a single pass:
+//
+//   ELF header | .text | .symtab | .strtab | .rela.text | .shstrtab | section headers
+//
+// The function itself is the only defined symbol. Each distinct symbol a
+// relocation names becomes an undefined global for the linker to resolve.
+
+typedef struct {
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint64_t entry;
+    uint64_t program_header_offset;
+    uint64_t section_header_offset;
+    uint32_t flags;
+    uint16_t header_size;
+    uint16_t program_header_size;
+    uint16_t program_header_count;
+    uint16_t section_header_size;
+    uint16_t section_header_count;
+    uint16_t section_name_index;
+} ElfHeader;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t address;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint32_t info;
+    uint64_t alignment;
+    uint64_t entry_size;
+} ElfSection;
+
+typedef struct {
+    uint32_t name;
+    uint8_t info;
+    uint8_t other;
+    uint16_t section;
+    uint64_t value;
+    uint64_t size;
+} ElfSymbol;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t info;
+    int64_t addend;
+} ElfRela;
+
+enum {
+    SHT_PROGBITS = 1,
+    SHT_SYMTAB = 2,
+    SHT_STRTAB = 3,
+    SHT_RELA = 4,
+
+    SHF_ALLOC = 0x2,
+    SHF_EXECINSTR = 0x4,
+    SHF_INFO_LINK = 0x40,
+
+    STB_LOCAL = 0,
+    STB_GLOBAL = 1,
+    STT_NOTYPE = 0,
+    STT_FUNC = 2,
+    STT_SECTION = 3,
+
+    R_X86_64_PLT32 = 4
+};
+
+enum {
+    SECTION_NULL,
+    SECTION_TEXT,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_RELA_TEXT,
+    SECTION_NOTE_STACK,
+    SECTION_SHSTRTAB,
+    NUM_SECTIONS
+};
+
+// The empty .note.GNU-stack marks the object as not needing an executable stack
+static const char section_names[] = "\0.text\0.symtab\0.strtab\0.rela.text\0.note.GNU-stack\0.shstrtab";
+
+static uint32_t section_name_offset(char* name) {
+    uint32_t offset = 1;
+
+    while (strcmp(section_names + offset, name) != 0) {
+        offset += (uint32_t)strlen(section_names + offset) + 1;
+    }
+
+    return offset;
+}
+
+static uint64_t align8(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+static uint8_t symbol_info(int binding, int type) {
+    return (uint8_t)((binding << 4) | type);
+}
+
+static void write_padding(FILE* file, uint64_t from, uint64_t to) {
+    static const uint8_t zeros[8] = {0};
+    fwrite(zeros, 1, (size_t)(to - from), file);
+}
+
+bool x64_write_elf(Arena* arena, FILE* file, char* name, X64_Code* code) {
+    // Symbols: null, .text section, the function, then one undefined symbol per external name
+    int* relocation_symbol = arena_array(arena, int, code->relocation_count);
+    char** externals = arena_array(arena, char*, code->relocation_count);
+    int external_count = 0;
+
+    uint64_t string_table_size = 1 + strlen(name) + 1;
+
+    for (int i = 0; i < code->relocation_count; ++i) {
+        char* symbol = code->relocations[i].symbol;
+        int index = 0;
+
+        while (index < external_count && strcmp(externals[index], symbol) != 0) {
+            index++;
+        }
+
+        if (index == external_count) {
+            externals[external_count++] = symbol;
+            string_table_size += strlen(symbol) + 1;
+        }
+
+        relocation_symbol[i] = 3 + index;
+    }
+
+    int symbol_count = 3 + external_count;
+
+    uint64_t text_offset = sizeof(ElfHeader);
+    uint64_t symtab_offset = align8(text_offset + code->size);
+    uint64_t strtab_offset = symtab_offset + symbol_count * sizeof(ElfSymbol);
+    uint64_t rela_offset = align8(strtab_offset + string_table_size);
+    uint64_t shstrtab_offset = rela_offset + code->relocation_count * sizeof(ElfRela);
+    uint64_t section_header_offset = align8(shstrtab_offset + sizeof(section_names));
+
+    ElfHeader header = {
+        .ident = { 0x7f, 'E', 'L', 'F', 2, 1, 1 }, // 64-bit, little endian, version 1, System V ABI
+        .type = 1, // ET_REL
+        .machine = 62, // EM_X86_64
+        .version = 1,
+        .section_header_offset = section_header_offset,
+        .header_size = (uint16_t)sizeof(ElfHeader),
+        .section_header_size = (uint16_t)sizeof(ElfSection),
+        .section_header_count = NUM_SECTIONS,
+        .section_name_index = SECTION_SHSTRTAB
+    };
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(code->data, 1, code->size, file);
+    write_padding(file, text_offset + code->size, symtab_offset);
+
+    ElfSymbol symbols[3] = {
+        {0},
+        {
+            .info = symbol_info(STB_LOCAL, STT_SECTION),
+            .section = SECTION_TEXT
+        },
+        {
+            .name = 1,
+            .info = symbol_info(STB_GLOBAL, STT_FUNC),
+            .section = SECTION_TEXT,
+            .size = code->size
+        }
+    };
+
+    fwrite(symbols, sizeof(symbols), 1, file);
+
+    uint32_t string_offset = 1 + (uint32_t)strlen(name) + 1;
+
+    for (int i = 0; i < external_count; ++i) {
+        ElfSymbol symbol = {
+            .name = string_offset,
+            .info = symbol_info(STB_GLOBAL, STT_NOTYPE)
+        };
+
+        fwrite(&symbol, sizeof(symbol), 1, file);
+        string_offset += (uint32_t)strlen(externals[i]) + 1;
+    }
+
+    fputc(0, file);
+    fwrite(name, 1, strlen(name) + 1, file);
+
+    for (int i = 0; i < external_count; ++i) {
+        fwrite(externals[i], 1, strlen(externals[i]) + 1, file);
+    }
+
+    write_padding(file, strtab_offset + string_table_size, rela_offset);
+
+    // rel32 fields are relative to the end of the field, hence the -4
+    for (int i = 0; i < code->relocation_count; ++i) {
+        ElfRela rela = {
+            .offset = (uint64_t)code->relocations[i].offset,
+            .info = ((uint64_t)relocation_symbol[i] << 32) | R_X86_64_PLT32,
+            .addend = -4
+        };
+
+        fwrite(&rela, sizeof(rela), 1, file);
+    }
+
+    fwrite(section_names, sizeof(section_names), 1, file);
+    write_padding(file, shstrtab_offset + sizeof(section_names), section_header_offset);
+
+    ElfSection sections[NUM_SECTIONS] = {
+        [SECTION_TEXT] = {
+            .name = section_name_offset(".text"),
+            .type = SHT_PROGBITS,
+            .flags = SHF_ALLOC | SHF_EXECINSTR,
+            .offset = text_offset,
+            .size = code->size,
+            .alignment = 16
+        },
+        [SECTION_SYMTAB] = {
+            .name = section_name_offset(".symtab"),
+            .type = SHT_SYMTAB,
+            .offset = symtab_offset,
+            .size = symbol_count * sizeof(ElfSymbol),
+            .link = SECTION_STRTAB,
+            .info = 2, // First global symbol
+            .alignment = 8,
+            .entry_size = sizeof(ElfSymbol)
+        },
+        [SECTION_STRTAB] = {
+            .name = section_name_offset(".strtab"),
+            .type = SHT_STRTAB,
+            .offset = strtab_offset,
+            .size = string_table_size,
+            .alignment = 1
+        },
+        [SECTION_RELA_TEXT] = {
+            .name = section_name_offset(".rela.text"),
+            .type = SHT_RELA,
+            .flags = SHF_INFO_LINK,
+            .offset = rela_offset,
+            .size = code->relocation_count * sizeof(ElfRela),
+            .link = SECTION_SYMTAB,
+            .info = SECTION_TEXT,
+            .alignment = 8,
+            .entry_size = sizeof(ElfRela)
+        },
+        [SECTION_NOTE_STACK] = {
+            .name = section_name_offset(".note.GNU-stack"),
+            .type = SHT_PROGBITS,
+            .offset = rela_offset,
+            .alignment = 1
+        },
+        [SECTION_SHSTRTAB] = {
+            .name = section_name_offset(".shstrtab"),
+            .type = SHT_STRTAB,
+            .offset = shstrtab_offset,
+            .size = sizeof(section_names),
+            .alignment = 1
+        }
+    };
+
+    fwrite(sections, sizeof(sections), 1, file);
+
+    return !ferror(file);
+}
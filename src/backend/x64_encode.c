@@ -0,0 +1,387 @@
+#include "x64_internal.h"
+
+// Encodes an allocated function straight to machine code. Every operand is a
+// 64-bit register, a [base + disp] or rbp-relative slot, an immediate or a
+// block, so each instruction is REX.W + opcode + ModRM (+ SIB) + disp + imm.
+// Where there is a choice, the encoding matches what GNU as picks for the
+// x64_print listing, which keeps the two byte-for-byte comparable.
+//
+// Branches start out as rel8 and get widened to rel32 when their target is
+// out of range. Widening only ever grows the code, so repeating until
+// nothing changes terminates.
+
+#define MAX_INST_SIZE 16
+
+typedef struct {
+    uint8_t* data;
+    int count;
+} Writer;
+
+static void put8(Writer* w, uint32_t value) {
+    w->data[w->count++] = (uint8_t)value;
+}
+
+static void put32(Writer* w, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        put8(w, (value >> (i * 8)) & 0xff);
+    }
+}
+
+static void put64(Writer* w, uint64_t value) {
+    put32(w, (uint32_t)value);
+    put32(w, (uint32_t)(value >> 32));
+}
+
+static bool fits_imm8(int64_t value) {
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static bool fits_imm32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// REX.W, the opcode and ModRM with `reg` in the reg field and `rm` as the register or memory operand
+static void encode_modrm(Writer* w, int opcode_count, uint8_t* opcode, int reg, X64_Operand* rm) {
+    int base;
+    int64_t displacement = 0;
+
+    if (rm->kind == X64_OPERAND_REGISTER) {
+        base = rm->reg;
+    }
+    else if (rm->slot != X64_NO_SLOT) {
+        base = X64_RBP;
+        displacement = -(int64_t)(rm->slot + 1) * 8;
+    }
+    else {
+        base = rm->reg;
+        displacement = rm->immediate;
+    }
+
+    assert(base < X64_FIRST_VREG && reg < X64_FIRST_VREG);
+    assert(fits_imm32(displacement));
+
+    put8(w, 0x48 | ((reg >> 3) << 2) | (base >> 3));
+
+    for (int i = 0; i < opcode_count; ++i) {
+        put8(w, opcode[i]);
+    }
+
+    if (rm->kind == X64_OPERAND_REGISTER) {
+        put8(w, 0xc0 | ((reg & 7) << 3) | (base & 7));
+        return;
+    }
+
+    // rbp and r13 have no disp-less form, rsp and r12 need a SIB byte
+    int mod;
+
+    if (displacement == 0 && (base & 7) != X64_RBP) {
+        mod = 0;
+    }
+    else if (fits_imm8(displacement)) {
+        mod = 1;
+    }
+    else {
+        mod = 2;
+    }
+
+    put8(w, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+
+    if ((base & 7) == X64_RSP) {
+        put8(w, 0x24);
+    }
+
+    if (mod == 1) {
+        put8(w, (uint32_t)displacement);
+    }
+    else if (mod == 2) {
+        put32(w, (uint32_t)displacement);
+    }
+}
+
+static void encode_op(Writer* w, uint8_t opcode, int reg, X64_Operand* rm) {
+    encode_modrm(w, 1, &opcode, reg, rm);
+}
+
+// add/sub share their encodings: op r/m, r; op r, r/m; op r/m, imm with a /digit
+static void encode_arithmetic(Writer* w, X64_Inst* inst, uint8_t store_opcode, uint8_t load_opcode, uint8_t accumulator_opcode, int digit) {
+    X64_Operand* dest = &inst->operands[0];
+    X64_Operand* source = &inst->operands[1];
+
+    switch (source->kind) {
+        default:
+            assert(false);
+            break;
+
+        case X64_OPERAND_REGISTER:
+            encode_op(w, store_opcode, source->reg, dest);
+            break;
+
+        case X64_OPERAND_MEMORY:
+            encode_op(w, load_opcode, dest->reg, source);
+            break;
+
+        case X64_OPERAND_IMMEDIATE:
+            if (fits_imm8(source->immediate)) {
+                encode_op(w, 0x83, digit, dest);
+                put8(w, (uint32_t)source->immediate);
+            }
+            else if (dest->kind == X64_OPERAND_REGISTER && dest->reg == X64_RAX) {
+                put8(w, 0x48);
+                put8(w, accumulator_opcode);
+                put32(w, (uint32_t)source->immediate);
+            }
+            else {
+                encode_op(w, 0x81, digit, dest);
+                put32(w, (uint32_t)source->immediate);
+            }
+            break;
+    }
+}
+
+static void encode_inst(Writer* w, X64_Inst* inst) {
+    X64_Operand* operands = inst->operands;
+
+    switch (inst->op) {
+        default:
+            assert("instruction cannot be encoded" && false);
+            break;
+
+        case X64_OP_MOV:
+            switch (operands[1].kind) {
+                default:
+                    assert(false);
+                    break;
+
+                case X64_OPERAND_REGISTER:
+                    encode_op(w, 0x89, operands[1].reg, &operands[0]);
+                    break;
+
+                case X64_OPERAND_MEMORY:
+                    encode_op(w, 0x8b, operands[0].reg, &operands[1]);
+                    break;
+
+                case X64_OPERAND_IMMEDIATE:
+                    if (fits_imm32(operands[1].immediate)) {
+                        encode_op(w, 0xc7, 0, &operands[0]);
+                        put32(w, (uint32_t)operands[1].immediate);
+                    }
+                    else {
+                        assert(operands[0].kind == X64_OPERAND_REGISTER);
+                        put8(w, 0x48 | (operands[0].reg >> 3));
+                        put8(w, 0xb8 | (operands[0].reg & 7));
+                        put64(w, (uint64_t)operands[1].immediate);
+                    }
+                    break;
+            }
+            break;
+
+        case X64_OP_LEA:
+            encode_op(w, 0x8d, operands[0].reg, &operands[1]);
+            break;
+
+        case X64_OP_ADD:
+            encode_arithmetic(w, inst, 0x01, 0x03, 0x05, 0);
+            break;
+
+        case X64_OP_SUB:
+            encode_arithmetic(w, inst, 0x29, 0x2b, 0x2d, 5);
+            break;
+
+        case X64_OP_IMUL:
+            if (inst->operand_count == 3) {
+                int64_t immediate = operands[2].immediate;
+
+                if (fits_imm8(immediate)) {
+                    encode_op(w, 0x6b, operands[0].reg, &operands[1]);
+                    put8(w, (uint32_t)immediate);
+                }
+                else {
+                    encode_op(w, 0x69, operands[0].reg, &operands[1]);
+                    put32(w, (uint32_t)immediate);
+                }
+            }
+            else {
+                uint8_t opcode[] = { 0x0f, 0xaf };
+                encode_modrm(w, 2, opcode, operands[0].reg, &operands[1]);
+            }
+            break;
+
+        case X64_OP_CQO:
+            put8(w, 0x48);
+            put8(w, 0x99);
+            break;
+
+        case X64_OP_IDIV:
+            encode_op(w, 0xf7, 7, &operands[0]);
+            break;
+
+        case X64_OP_TEST:
+            encode_op(w, 0x85, operands[1].reg, &operands[0]);
+            break;
+
+        case X64_OP_RET:
+            put8(w, 0xc9); // leave
+            put8(w, 0xc3);
+            break;
+    }
+}
+
+static bool is_branch(X64_Inst* inst) {
+    return inst->op == X64_OP_JMP || inst->op == X64_OP_JZ || inst->op == X64_OP_JNZ;
+}
+
+static int branch_size(X64_Inst* inst, bool is_long) {
+    if (!is_long) {
+        return 2;
+    }
+
+    return inst->op == X64_OP_JMP ? 5 : 6;
+}
+
+static void encode_branch(Writer* w, X64_Inst* inst, bool is_long, int displacement) {
+    uint8_t condition = inst->op == X64_OP_JZ ? 0x4 : 0x5;
+
+    if (!is_long) {
+        put8(w, inst->op == X64_OP_JMP ? 0xeb : 0x70 | condition);
+        put8(w, (uint32_t)displacement);
+    }
+    else if (inst->op == X64_OP_JMP) {
+        put8(w, 0xe9);
+        put32(w, (uint32_t)displacement);
+    }
+    else {
+        put8(w, 0x0f);
+        put8(w, 0x80 | condition);
+        put32(w, (uint32_t)displacement);
+    }
+}
+
+static void encode_prologue(Writer* w, X64_Function* function) {
+    put8(w, 0x55); // push rbp
+
+    X64_Inst mov = {
+        .op = X64_OP_MOV,
+        .operand_count = 2,
+        .operands = {
+            { .kind = X64_OPERAND_REGISTER, .reg = X64_RBP },
+            { .kind = X64_OPERAND_REGISTER, .reg = X64_RSP }
+        }
+    };
+
+    encode_inst(w, &mov);
+
+    if (x64_frame_size(function)) {
+        X64_Inst sub = {
+            .op = X64_OP_SUB,
+            .operand_count = 2,
+            .operands = {
+                { .kind = X64_OPERAND_REGISTER, .reg = X64_RSP },
+                { .kind = X64_OPERAND_IMMEDIATE, .immediate = x64_frame_size(function) }
+            }
+        };
+
+        encode_inst(w, &sub);
+    }
+}
+
+X64_Code x64_encode(Arena* arena, SB_Context* context, X64_Function* function) {
+    Scratch scratch = scratch_get(&context->scratch_library, 1, &arena);
+
+    int inst_count = 0;
+
+    for (X64_Block* block = function->blocks; block; block = block->next) {
+        for (X64_Inst* inst = block->start; inst; inst = inst->next) {
+            inst_count++;
+        }
+    }
+
+    int* sizes = arena_array(scratch.arena, int, inst_count);
+    bool* is_long = arena_array(scratch.arena, bool, inst_count);
+    int* block_offset = arena_array(scratch.arena, int, function->block_count);
+
+    uint8_t buffer[MAX_INST_SIZE];
+
+    Writer prologue = { buffer, 0 };
+    encode_prologue(&prologue, function);
+
+    int index = 0;
+
+    for (X64_Block* block = function->blocks; block; block = block->next) {
+        for (X64_Inst* inst = block->start; inst; inst = inst->next, ++index) {
+            if (is_branch(inst)) {
+                sizes[index] = branch_size(inst, false);
+            }
+            else {
+                Writer w = { buffer, 0 };
+                encode_inst(&w, inst);
+                sizes[index] = w.count;
+            }
+        }
+    }
+
+    int size;
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        size = prologue.count;
+        index = 0;
+
+        for (X64_Block* block = function->blocks; block; block = block->next) {
+            block_offset[block->id] = size;
+
+            for (X64_Inst* inst = block->start; inst; inst = inst->next, ++index) {
+                size += sizes[index];
+            }
+        }
+
+        // Offsets are from the start of this round, a round that widens nothing confirms them
+        size = prologue.count;
+        index = 0;
+
+        for (X64_Block* block = function->blocks; block; block = block->next) {
+            for (X64_Inst* inst = block->start; inst; inst = inst->next, ++index) {
+                size += sizes[index];
+
+                if (is_branch(inst) && !is_long[index]) {
+                    int displacement = block_offset[inst->operands[0].block->id] - size;
+
+                    if (!fits_imm8(displacement)) {
+                        is_long[index] = true;
+                        sizes[index] = branch_size(inst, true);
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    X64_Code code = {
+        .data = arena_array(arena, uint8_t, size),
+        .size = size
+    };
+
+    Writer w = { code.data, 0 };
+    encode_prologue(&w, function);
+
+    index = 0;
+
+    for (X64_Block* block = function->blocks; block; block = block->next) {
+        for (X64_Inst* inst = block->start; inst; inst = inst->next, ++index) {
+            if (is_branch(inst)) {
+                int end = w.count + sizes[index];
+                encode_branch(&w, inst, is_long[index], block_offset[inst->operands[0].block->id] - end);
+            }
+            else {
+                encode_inst(&w, inst);
+            }
+        }
+    }
+
+    assert(w.count == size);
+
+    scratch_release(&scratch);
+
+    return code;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "sb_internal.h"
+
+typedef enum {
+    X64_RAX,
+    X64_RCX,
+    X64_RDX,
+    X64_RBX,
+    X64_RSP,
+    X64_RBP,
+    X64_RSI,
+    X64_RDI,
+    X64_R8,
+    X64_R9,
+    X64_R10,
+    X64_R11,
+    X64_R12,
+    X64_R13,
+    X64_R14,
+    X64_R15,
+    NUM_X64_REGISTERS
+} X64_Register;
+
+static const char* x64_register_name[NUM_X64_REGISTERS] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+
+#define X64_REG_BIT(reg) (1u << (reg))
+
+typedef enum {
+    X64_FIRST_USE,
+    X64_FIRST_DEF,
+    X64_FIRST_USE_DEF
+} X64_FirstOperand;
+
+#define X(name, ...) X64_OP_##name,
+typedef enum {
+    X64_OP_ILLEGAL,
+    #include "x64_ops.inc"
+    NUM_X64_OPS
+} X64_OpCode;
+#undef X
+
+#define X(name, mnemonic, ...) mnemonic,
+static const char* x64_op_name[] = {
+    "illegal",
+    #include "x64_ops.inc"
+};
+#undef X
+
+#define X(name, mnemonic, first, ...) first,
+static const X64_FirstOperand x64_op_first_operand[] = {
+    X64_FIRST_USE,
+    #include "x64_ops.inc"
+};
+#undef X
+
+#define X(name, mnemonic, first, uses, defs) uses,
+static const uint32_t x64_op_implicit_uses[] = {
+    0,
+    #include "x64_ops.inc"
+};
+#undef X
+
+#define X(name, mnemonic, first, uses, defs) defs,
+static const uint32_t x64_op_implicit_defs[] = {
+    0,
+    #include "x64_ops.inc"
+};
+#undef X
+
+// Register numbers below NUM_X64_REGISTERS are physical, everything above is
+// a virtual register waiting for allocation.
+#define X64_FIRST_VREG NUM_X64_REGISTERS
+
+typedef enum {
+    X64_OPERAND_NONE,
+    X64_OPERAND_REGISTER,
+    X64_OPERAND_IMMEDIATE,
+    X64_OPERAND_MEMORY,
+    X64_OPERAND_BLOCK
+} X64_OperandKind;
+
+typedef struct X64_Block X64_Block;
+
+// Memory operands address either a stack slot off rbp or [reg + displacement]
+typedef struct {
+    X64_OperandKind kind;
+
+    int reg;
+    int slot;
+    int64_t immediate;
+
+    X64_Block* block;
+} X64_Operand;
+
+#define X64_NO_SLOT -1
+
+typedef struct X64_Inst X64_Inst;
+
+struct X64_Inst {
+    X64_Inst* prev;
+    X64_Inst* next;
+
+    X64_OpCode op;
+
+    int operand_count;
+    X64_Operand operands[3];
+};
+
+struct X64_Block {
+    X64_Block* next;
+
+    int id;
+    int loop_depth;
+
+    int successor_count;
+    X64_Block* successors[2];
+
+    X64_Inst* start;
+    X64_Inst* end;
+};
+
+typedef struct {
+    X64_Block* blocks;
+    int block_count;
+
+    int vreg_count;
+    int slot_count;
+} X64_Function;
+
+// A rel32 field at `offset` that the linker patches to reach an external symbol
+typedef struct {
+    int offset;
+    char* symbol;
+} X64_Relocation;
+
+typedef struct {
+    uint8_t* data;
+    int size;
+
+    int relocation_count;
+    X64_Relocation* relocations;
+} X64_Code;
+
+// Stack slots sit below the saved rbp, rounded so rsp stays 16-byte aligned
+static inline int x64_frame_size(X64_Function* function) {
+    return (function->slot_count * 8 + 15) & ~15;
+}
+
+X64_Function* x64_select(Arena* arena, SB_Context* context, GCM_Block* control_flow_head);
+void x64_allocate_registers(Arena* arena, SB_Context* context, X64_Function* function);
+X64_Code x64_encode(Arena* arena, SB_Context* context, X64_Function* function);
+bool x64_write_elf(Arena* arena, FILE* file, char* name, X64_Code* code);
+void x64_print(FILE* file, X64_Function* function, char* name);
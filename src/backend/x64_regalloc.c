@@ -0,0 +1,671 @@
+#include <limits.h>
+
+#include "x64_internal.h"
+
+// Linear scan over the block layout chosen by GCM. Every instruction k gets
+// two positions: its uses read at 2k and its defs write at 2k+1, so a value
+// can die in the same instruction that defines its replacement.
+//
+// Liveness is found by walking up from each upward-exposed use until a block
+// that defines the register, which costs time proportional to the size of the
+// live ranges rather than blocks times registers. Intervals have no holes.
+//
+// Physical registers named by instruction selection (rax/rdx around idiv and
+// the return value) become short fixed ranges. A virtual register is never
+// given a physical register whose fixed ranges overlap its interval, so those
+// constraints split nothing beyond the copies isel already inserted.
+//
+// Spilled registers live in a stack slot for their whole lifetime. Each use
+// either becomes a memory operand directly or goes through r10/r11, which are
+// kept out of allocation for that purpose.
+
+static const X64_Register allocation_order[] = {
+    X64_RAX, X64_RCX, X64_RDX, X64_R8, X64_R9,
+    X64_RSI, X64_RDI, X64_RBX, X64_R12, X64_R13, X64_R14, X64_R15
+};
+
+// rsi and rdi are only callee-saved on Windows, but saving them everywhere is cheap
+static const uint32_t callee_saved =
+    X64_REG_BIT(X64_RBX) | X64_REG_BIT(X64_RSI) | X64_REG_BIT(X64_RDI) |
+    X64_REG_BIT(X64_R12) | X64_REG_BIT(X64_R13) | X64_REG_BIT(X64_R14) | X64_REG_BIT(X64_R15);
+
+static const X64_Register spill_scratch[] = { X64_R10, X64_R11 };
+
+typedef struct {
+    int start;
+    int end;
+} Range;
+
+typedef struct {
+    int count;
+    int capacity;
+    Range* data;
+    int cursor;
+} FixedRanges;
+
+typedef struct {
+    int start;
+    int end;
+    int hint;
+    int reg;
+    int slot;
+} Interval;
+
+typedef struct {
+    int vreg;
+    int block;
+} BlockRef;
+
+typedef struct {
+    int reg;
+    bool use;
+    bool def;
+} RegisterRef;
+
+static X64_FirstOperand first_operand(X64_Inst* inst) {
+    // Three-operand imul only writes its destination
+    if (inst->op == X64_OP_IMUL && inst->operand_count == 3) {
+        return X64_FIRST_DEF;
+    }
+
+    return x64_op_first_operand[inst->op];
+}
+
+static int register_refs(X64_Inst* inst, RegisterRef* refs) {
+    int count = 0;
+
+    for (int i = 0; i < inst->operand_count; ++i) {
+        X64_Operand* operand = &inst->operands[i];
+
+        if (operand->kind == X64_OPERAND_MEMORY && operand->slot == X64_NO_SLOT) {
+            refs[count++] = (RegisterRef) { operand->reg, true, false };
+        }
+        else if (operand->kind == X64_OPERAND_REGISTER) {
+            X64_FirstOperand first = i == 0 ? first_operand(inst) : X64_FIRST_USE;
+            refs[count++] = (RegisterRef) { operand->reg, first != X64_FIRST_DEF, first != X64_FIRST_USE };
+        }
+    }
+
+    for (int reg = 0; reg < NUM_X64_REGISTERS; ++reg) {
+        bool use = x64_op_implicit_uses[inst->op] & X64_REG_BIT(reg);
+        bool def = x64_op_implicit_defs[inst->op] & X64_REG_BIT(reg);
+
+        if (use || def) {
+            refs[count++] = (RegisterRef) { reg, use, def };
+        }
+    }
+
+    return count;
+}
+
+static void push_range(Arena* arena, FixedRanges* ranges, int start, int end) {
+    if (ranges->count == ranges->capacity) {
+        int new_capacity = ranges->capacity ? ranges->capacity * 2 : 16;
+        Range* new_data = arena_array(arena, Range, new_capacity);
+        memcpy(new_data, ranges->data, ranges->count * sizeof(Range));
+
+        ranges->capacity = new_capacity;
+        ranges->data = new_data;
+    }
+
+    ranges->data[ranges->count++] = (Range) { start, end };
+}
+
+typedef struct {
+    Arena* arena;
+    int count;
+    int capacity;
+    BlockRef* data;
+} BlockRefList;
+
+static void push_block_ref(BlockRefList* list, int vreg, int block) {
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 64;
+        BlockRef* new_data = arena_array(list->arena, BlockRef, new_capacity);
+        memcpy(new_data, list->data, list->count * sizeof(BlockRef));
+
+        list->capacity = new_capacity;
+        list->data = new_data;
+    }
+
+    list->data[list->count++] = (BlockRef) { vreg, block };
+}
+
+// Counting sort by vreg, returns per-vreg offsets into the sorted array
+static int* bucket_by_vreg(Arena* arena, BlockRefList* list, int vreg_count, BlockRef** sorted) {
+    int* offsets = arena_array(arena, int, vreg_count + 1);
+
+    for (int i = 0; i < list->count; ++i) {
+        offsets[list->data[i].vreg + 1]++;
+    }
+
+    for (int i = 0; i < vreg_count; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+
+    int* fill = arena_array(arena, int, vreg_count);
+    memcpy(fill, offsets, vreg_count * sizeof(int));
+
+    *sorted = arena_array(arena, BlockRef, list->count);
+
+    for (int i = 0; i < list->count; ++i) {
+        (*sorted)[fill[list->data[i].vreg]++] = list->data[i];
+    }
+
+    return offsets;
+}
+
+static void extend(Interval* interval, int start, int end) {
+    if (start < interval->start) {
+        interval->start = start;
+    }
+
+    if (end > interval->end) {
+        interval->end = end;
+    }
+}
+
+static bool fixed_conflict(FixedRanges* ranges, int start, int end) {
+    while (ranges->cursor < ranges->count && ranges->data[ranges->cursor].end < start) {
+        ranges->cursor++;
+    }
+
+    return ranges->cursor < ranges->count && ranges->data[ranges->cursor].start <= end;
+}
+
+static void insert_before(X64_Block* block, X64_Inst* position, X64_Inst* inst) {
+    inst->next = position;
+    inst->prev = position->prev;
+
+    if (position->prev) {
+        position->prev->next = inst;
+    }
+    else {
+        block->start = inst;
+    }
+
+    position->prev = inst;
+}
+
+static void insert_after(X64_Block* block, X64_Inst* position, X64_Inst* inst) {
+    inst->prev = position;
+    inst->next = position->next;
+
+    if (position->next) {
+        position->next->prev = inst;
+    }
+    else {
+        block->end = inst;
+    }
+
+    position->next = inst;
+}
+
+static void remove_inst(X64_Block* block, X64_Inst* inst) {
+    if (inst->prev) {
+        inst->prev->next = inst->next;
+    }
+    else {
+        block->start = inst->next;
+    }
+
+    if (inst->next) {
+        inst->next->prev = inst->prev;
+    }
+    else {
+        block->end = inst->prev;
+    }
+}
+
+static X64_Inst* make_move(Arena* arena, X64_Operand dest, X64_Operand source) {
+    X64_Inst* inst = arena_type(arena, X64_Inst);
+    inst->op = X64_OP_MOV;
+    inst->operand_count = 2;
+    inst->operands[0] = dest;
+    inst->operands[1] = source;
+    return inst;
+}
+
+static X64_Operand physical_operand(int reg) {
+    return (X64_Operand) {
+        .kind = X64_OPERAND_REGISTER,
+        .reg = reg
+    };
+}
+
+static X64_Operand stack_operand(int slot) {
+    return (X64_Operand) {
+        .kind = X64_OPERAND_MEMORY,
+        .slot = slot
+    };
+}
+
+static bool memory_allowed(X64_Inst* inst, int index) {
+    switch (inst->op) {
+        default:
+            return false;
+
+        case X64_OP_MOV:
+        case X64_OP_ADD:
+        case X64_OP_SUB:
+            for (int i = 0; i < inst->operand_count; ++i) {
+                X64_Operand* operand = &inst->operands[i];
+
+                if (operand->kind == X64_OPERAND_IMMEDIATE && (operand->immediate < INT32_MIN || operand->immediate > INT32_MAX)) {
+                    return false;
+                }
+            }
+
+            return true;
+
+        case X64_OP_IMUL:
+            return index == 1;
+
+        case X64_OP_IDIV:
+        case X64_OP_TEST:
+            return index == 0;
+    }
+}
+
+static bool has_memory_operand(X64_Inst* inst) {
+    for (int i = 0; i < inst->operand_count; ++i) {
+        if (inst->operands[i].kind == X64_OPERAND_MEMORY) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void rewrite_spills(Arena* arena, X64_Block* block, X64_Inst* inst, Interval* intervals) {
+    int scratch_count = 0;
+
+    for (int i = 0; i < inst->operand_count; ++i) {
+        X64_Operand* operand = &inst->operands[i];
+
+        bool is_register = operand->kind == X64_OPERAND_REGISTER;
+        bool is_base = operand->kind == X64_OPERAND_MEMORY && operand->slot == X64_NO_SLOT;
+
+        if (!(is_register || is_base) || operand->reg < X64_FIRST_VREG) {
+            continue;
+        }
+
+        int vreg = operand->reg;
+        Interval* interval = &intervals[vreg - X64_FIRST_VREG];
+
+        int occurrences = 0;
+        bool use = false;
+        bool def = false;
+
+        for (int j = 0; j < inst->operand_count; ++j) {
+            X64_Operand* other = &inst->operands[j];
+
+            if (other->kind == X64_OPERAND_MEMORY && other->slot == X64_NO_SLOT && other->reg == vreg) {
+                occurrences++;
+                use = true;
+            }
+            else if (other->kind == X64_OPERAND_REGISTER && other->reg == vreg) {
+                X64_FirstOperand first = j == 0 ? first_operand(inst) : X64_FIRST_USE;
+                occurrences++;
+                use |= first != X64_FIRST_DEF;
+                def |= first != X64_FIRST_USE;
+            }
+        }
+
+        if (occurrences == 1 && is_register && memory_allowed(inst, i) && !has_memory_operand(inst)) {
+            *operand = stack_operand(interval->slot);
+            continue;
+        }
+
+        assert(scratch_count < (int)LENGTH(spill_scratch));
+        int scratch = spill_scratch[scratch_count++];
+
+        if (use) {
+            insert_before(block, inst, make_move(arena, physical_operand(scratch), stack_operand(interval->slot)));
+        }
+
+        if (def) {
+            insert_after(block, inst, make_move(arena, stack_operand(interval->slot), physical_operand(scratch)));
+        }
+
+        for (int j = 0; j < inst->operand_count; ++j) {
+            X64_Operand* other = &inst->operands[j];
+
+            if ((other->kind == X64_OPERAND_REGISTER || (other->kind == X64_OPERAND_MEMORY && other->slot == X64_NO_SLOT)) && other->reg == vreg) {
+                other->reg = scratch;
+            }
+        }
+    }
+}
+
+void x64_allocate_registers(Arena* arena, SB_Context* context, X64_Function* function) {
+    Scratch scratch = scratch_get(&context->scratch_library, 1, &arena);
+
+    int block_count = function->block_count;
+    int vreg_count = function->vreg_count;
+
+    X64_Block** blocks = arena_array(scratch.arena, X64_Block*, block_count);
+    int* predecessor_counts = arena_array(scratch.arena, int, block_count);
+    int* start_position = arena_array(scratch.arena, int, block_count);
+    int* end_position = arena_array(scratch.arena, int, block_count);
+
+    for (X64_Block* block = function->blocks; block; block = block->next) {
+        blocks[block->id] = block;
+
+        for (int i = 0; i < block->successor_count; ++i) {
+            predecessor_counts[block->successors[i]->id]++;
+        }
+    }
+
+    X64_Block*** predecessors = arena_array(scratch.arena, X64_Block**, block_count);
+
+    for (int i = 0; i < block_count; ++i) {
+        predecessors[i] = arena_array(scratch.arena, X64_Block*, predecessor_counts[i]);
+        predecessor_counts[i] = 0;
+    }
+
+    for (X64_Block* block = function->blocks; block; block = block->next) {
+        for (int i = 0; i < block->successor_count; ++i) {
+            int successor = block->successors[i]->id;
+            predecessors[successor][predecessor_counts[successor]++] = block;
+        }
+    }
+
+    Interval* intervals = arena_array(scratch.arena, Interval, vreg_count);
+
+    for (int i = 0; i < vreg_count; ++i) {
+        intervals[i] = (Interval) {
+            .start = INT_MAX,
+            .end = -1,
+            .hint = -1,
+            .reg = -1,
+            .slot = -1
+        };
+    }
+
+    FixedRanges fixed[NUM_X64_REGISTERS] = {0};
+
+    BlockRefList exposed = { .arena = scratch.arena };
+    BlockRefList defined = { .arena = scratch.arena };
+
+    // Block id plus one of the last block each vreg was defined or used upward-exposed in
+    int* def_seen = arena_array(scratch.arena, int, vreg_count);
+    int* use_seen = arena_array(scratch.arena, int, vreg_count);
+
+    int index = 0;
+
+    for (X64_Block* block = function->blocks; block; block = block->next) {
+        start_position[block->id] = index * 2;
+
+        for (X64_Inst* inst = block->start; inst; inst = inst->next, ++index) {
+            RegisterRef refs[8];
+            int ref_count = register_refs(inst, refs);
+
+            for (int i = 0; i < ref_count; ++i) {
+                RegisterRef* ref = &refs[i];
+
+                if (ref->reg < X64_FIRST_VREG) {
+                    FixedRanges* ranges = &fixed[ref->reg];
+
+                    if (ref->use) {
+                        if (ranges->count) {
+                            ranges->data[ranges->count - 1].end = index * 2;
+                        }
+                        else {
+                            push_range(scratch.arena, ranges, index * 2, index * 2);
+                        }
+                    }
+
+                    continue;
+                }
+
+                int vreg = ref->reg - X64_FIRST_VREG;
+
+                if (ref->use) {
+                    extend(&intervals[vreg], index * 2, index * 2);
+
+                    if (def_seen[vreg] != block->id + 1 && use_seen[vreg] != block->id + 1) {
+                        use_seen[vreg] = block->id + 1;
+                        push_block_ref(&exposed, vreg, block->id);
+                    }
+                }
+            }
+
+            for (int i = 0; i < ref_count; ++i) {
+                RegisterRef* ref = &refs[i];
+
+                if (!ref->def) {
+                    continue;
+                }
+
+                if (ref->reg < X64_FIRST_VREG) {
+                    push_range(scratch.arena, &fixed[ref->reg], index * 2 + 1, index * 2 + 1);
+                    continue;
+                }
+
+                int vreg = ref->reg - X64_FIRST_VREG;
+                extend(&intervals[vreg], index * 2 + 1, index * 2 + 1);
+
+                if (def_seen[vreg] != block->id + 1) {
+                    def_seen[vreg] = block->id + 1;
+                    push_block_ref(&defined, vreg, block->id);
+                }
+
+                if (inst->op == X64_OP_MOV && inst->operands[1].kind == X64_OPERAND_REGISTER && intervals[vreg].hint == -1) {
+                    intervals[vreg].hint = inst->operands[1].reg;
+                }
+            }
+        }
+
+        end_position[block->id] = index * 2 - 1;
+    }
+
+    BlockRef* exposed_sorted;
+    BlockRef* defined_sorted;
+    int* exposed_offsets = bucket_by_vreg(scratch.arena, &exposed, vreg_count, &exposed_sorted);
+    int* defined_offsets = bucket_by_vreg(scratch.arena, &defined, vreg_count, &defined_sorted);
+
+    int* def_stamp = arena_array(scratch.arena, int, block_count);
+    int* live_in_stamp = arena_array(scratch.arena, int, block_count);
+    int* stack = arena_array(scratch.arena, int, block_count);
+
+    for (int vreg = 0; vreg < vreg_count; ++vreg) {
+        Interval* interval = &intervals[vreg];
+
+        for (int i = defined_offsets[vreg]; i < defined_offsets[vreg + 1]; ++i) {
+            def_stamp[defined_sorted[i].block] = vreg + 1;
+        }
+
+        int stack_count = 0;
+
+        for (int i = exposed_offsets[vreg]; i < exposed_offsets[vreg + 1]; ++i) {
+            int block = exposed_sorted[i].block;
+
+            if (live_in_stamp[block] != vreg + 1) {
+                live_in_stamp[block] = vreg + 1;
+                extend(interval, start_position[block], start_position[block]);
+                stack[stack_count++] = block;
+            }
+        }
+
+        while (stack_count) {
+            int block = stack[--stack_count];
+
+            for (int i = 0; i < predecessor_counts[block]; ++i) {
+                int predecessor = predecessors[block][i]->id;
+                extend(interval, end_position[predecessor], end_position[predecessor]);
+
+                if (def_stamp[predecessor] != vreg + 1 && live_in_stamp[predecessor] != vreg + 1) {
+                    live_in_stamp[predecessor] = vreg + 1;
+                    extend(interval, start_position[predecessor], start_position[predecessor]);
+                    stack[stack_count++] = predecessor;
+                }
+            }
+        }
+    }
+
+    // Counting sort of intervals by start position
+    int position_count = index * 2 + 1;
+    int* bucket = arena_array(scratch.arena, int, position_count + 1);
+    int* order = arena_array(scratch.arena, int, vreg_count);
+    int order_count = 0;
+
+    for (int vreg = 0; vreg < vreg_count; ++vreg) {
+        if (intervals[vreg].end >= 0) {
+            bucket[intervals[vreg].start + 1]++;
+            order_count++;
+        }
+    }
+
+    for (int i = 0; i < position_count; ++i) {
+        bucket[i + 1] += bucket[i];
+    }
+
+    for (int vreg = 0; vreg < vreg_count; ++vreg) {
+        if (intervals[vreg].end >= 0) {
+            order[bucket[intervals[vreg].start]++] = vreg;
+        }
+    }
+
+    int active[LENGTH(allocation_order)];
+    int active_count = 0;
+
+    int owner[NUM_X64_REGISTERS];
+    for (int i = 0; i < NUM_X64_REGISTERS; ++i) {
+        owner[i] = -1;
+    }
+
+    uint32_t allocatable = 0;
+    for (int i = 0; i < (int)LENGTH(allocation_order); ++i) {
+        allocatable |= X64_REG_BIT(allocation_order[i]);
+    }
+
+    uint32_t used_registers = 0;
+
+    for (int i = 0; i < order_count; ++i) {
+        int vreg = order[i];
+        Interval* interval = &intervals[vreg];
+
+        for (int j = 0; j < active_count;) {
+            Interval* other = &intervals[active[j]];
+
+            if (other->end < interval->start) {
+                owner[other->reg] = -1;
+                active[j] = active[--active_count];
+            }
+            else {
+                ++j;
+            }
+        }
+
+        int reg = -1;
+        int hint = interval->hint;
+
+        if (hint >= X64_FIRST_VREG) {
+            hint = intervals[hint - X64_FIRST_VREG].reg;
+        }
+
+        bool hint_free = hint >= 0 && (allocatable & X64_REG_BIT(hint)) && owner[hint] == -1;
+
+        if (hint_free && !fixed_conflict(&fixed[hint], interval->start, interval->end)) {
+            reg = hint;
+        }
+
+        for (int j = 0; j < (int)LENGTH(allocation_order) && reg == -1; ++j) {
+            int candidate = allocation_order[j];
+
+            if (owner[candidate] == -1 && !fixed_conflict(&fixed[candidate], interval->start, interval->end)) {
+                reg = candidate;
+            }
+        }
+
+        if (reg == -1) {
+            // Spill whichever interval ends furthest away, as long as its register suits this one
+            int victim = -1;
+
+            for (int j = 0; j < active_count; ++j) {
+                Interval* other = &intervals[active[j]];
+
+                if (fixed_conflict(&fixed[other->reg], interval->start, interval->end)) {
+                    continue;
+                }
+
+                if (victim == -1 || other->end > intervals[active[victim]].end) {
+                    victim = j;
+                }
+            }
+
+            if (victim == -1 || intervals[active[victim]].end <= interval->end) {
+                interval->slot = function->slot_count++;
+                continue;
+            }
+
+            Interval* spilled = &intervals[active[victim]];
+            reg = spilled->reg;
+
+            spilled->reg = -1;
+            spilled->slot = function->slot_count++;
+
+            active[victim] = active[--active_count];
+        }
+
+        interval->reg = reg;
+        owner[reg] = vreg;
+        active[active_count++] = vreg;
+        used_registers |= X64_REG_BIT(reg);
+    }
+
+    for (X64_Block* block = function->blocks; block; block = block->next) {
+        for (X64_Inst* inst = block->start; inst;) {
+            X64_Inst* next = inst->next;
+
+            for (int i = 0; i < inst->operand_count; ++i) {
+                X64_Operand* operand = &inst->operands[i];
+                bool has_register = operand->kind == X64_OPERAND_REGISTER || (operand->kind == X64_OPERAND_MEMORY && operand->slot == X64_NO_SLOT);
+
+                if (has_register && operand->reg >= X64_FIRST_VREG && intervals[operand->reg - X64_FIRST_VREG].reg != -1) {
+                    operand->reg = intervals[operand->reg - X64_FIRST_VREG].reg;
+                }
+            }
+
+            rewrite_spills(arena, block, inst, intervals);
+
+            X64_Operand* operands = inst->operands;
+
+            if (inst->op == X64_OP_MOV && operands[0].kind == X64_OPERAND_REGISTER && operands[1].kind == X64_OPERAND_REGISTER && operands[0].reg == operands[1].reg) {
+                remove_inst(block, inst);
+            }
+
+            inst = next;
+        }
+    }
+
+    // Save callee-saved registers in their own slots on entry and restore them before every return
+    uint32_t saved = used_registers & callee_saved;
+
+    for (int reg = 0; reg < NUM_X64_REGISTERS; ++reg) {
+        if (!(saved & X64_REG_BIT(reg))) {
+            continue;
+        }
+
+        int slot = function->slot_count++;
+        X64_Block* entry = function->blocks;
+
+        X64_Inst* save = make_move(arena, stack_operand(slot), physical_operand(reg));
+
+        if (entry->start) {
+            insert_before(entry, entry->start, save);
+        }
+        else {
+            entry->start = entry->end = save;
+        }
+
+        for (X64_Block* block = function->blocks; block; block = block->next) {
+            if (block->end && block->end->op == X64_OP_RET) {
+                insert_before(block, block->end, make_move(arena, physical_operand(reg), stack_operand(slot)));
+            }
+        }
+    }
+
+    scratch_release(&scratch);
+}
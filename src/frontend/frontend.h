@@ -15,11 +15,35 @@ enum {
     TOKEN_KEYWORD_VAR,
 };
 
+// Identifiers are interned into dense atoms while lexing
+
+typedef uint32_t Atom;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t atom_plus_one;
+} InternSlot;
+
+typedef struct {
+    int count;
+    int capacity;
+    InternSlot* slots;
+
+    int string_capacity;
+    String* strings;
+} Interner;
+
+void init_interner(Interner* interner);
+void free_interner(Interner* interner);
+Atom intern(Interner* interner, char* data, size_t length);
+String atom_string(Interner* interner, Atom atom);
+
 typedef struct {
     int kind;
     int length;
     char* start;
     int line;
+    Atom atom;
 } Token;
 
 // Define op code enums
@@ -76,12 +100,14 @@ struct HIR_Block {
 
 typedef struct {
     HIR_Block* control_flow_head;
+    int token_count;
 } HIR_Proc;
 
 // Functions
 
 HIR_Proc* parse(Arena* arena, char* source_path, char* source);
 void hir_print(HIR_Proc* proc);
+int hir_node_count(HIR_Proc* proc);
 void hir_append(HIR_Block* block, HIR_Node* node);
 void hir_remove(HIR_Node* node);
 
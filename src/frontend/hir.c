@@ -79,6 +79,18 @@ void hir_print(HIR_Proc* proc) {
     printf("\n");
 }
 
+int hir_node_count(HIR_Proc* proc) {
+    int count = 0;
+
+    for (HIR_Block* block = proc->control_flow_head; block; block = block->next) {
+        for (HIR_Node* node = block->start; node; node = node->next) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
 static void fix_links(HIR_Node* node) {
     if (node->prev) {
         node->prev->next = node;
@@ -151,15 +163,25 @@ static void add_successor(Arena* arena, BlockList* succesors, int* predecessor_c
     predecessor_counts[successor->tid]++;
 }
 
-static void mark_reachable(Bitset* reachable, BlockList* successors, HIR_Block* block) {
-    if (bitset_get(reachable, block->tid)) {
-        return;
-    }
+// Each block is pushed at most once, so the stack never holds more than block_count blocks
+static void mark_reachable(Arena* arena, Bitset* reachable, BlockList* successors, HIR_Block* head, int block_count) {
+    HIR_Block** stack = arena_array(arena, HIR_Block*, block_count);
+    int stack_count = 0;
+
+    bitset_set(reachable, head->tid);
+    stack[stack_count++] = head;
 
-    bitset_set(reachable, block->tid);
+    while (stack_count) {
+        HIR_Block* block = stack[--stack_count];
 
-    for (int i = 0; i < successors[block->tid].count; ++i) {
-        mark_reachable(reachable, successors, successors[block->tid].data[i]);
+        for (int i = successors[block->tid].count - 1; i >= 0; --i) {
+            HIR_Block* successor = successors[block->tid].data[i];
+
+            if (!bitset_get(reachable, successor->tid)) {
+                bitset_set(reachable, successor->tid);
+                stack[stack_count++] = successor;
+            }
+        }
     }
 }
 
@@ -200,7 +222,7 @@ static ProcInfo compute_proc_info(Arena* arena, HIR_Proc* hir_proc) {
     }
 
     Bitset* reachable = make_bitset(arena, tids.block_count);
-    mark_reachable(reachable, successors, hir_proc->control_flow_head);
+    mark_reachable(arena, reachable, successors, hir_proc->control_flow_head, tids.block_count);
 
     return (ProcInfo) {
         .block_count = tids.block_count,
@@ -264,7 +286,7 @@ static SB_Node* lower_node(SB_Context* context, SB_Node** mapping, SB_Node** ret
         case HIR_OP_MUL:
             return sb_node_mul(context, GET(node->ins[0]), GET(node->ins[1]));
         case HIR_OP_DIV:
-            return sb_node_sdiv(context, GET(node->ins[0]), GET(node->ins[1]));
+            return sb_node_sdiv(context, flow->control, GET(node->ins[0]), GET(node->ins[1]));
 
         case HIR_OP_ASSIGN:
             return flow->store = sb_node_store(context, flow->control, flow->store, GET(node->ins[0]), GET(node->ins[1]));
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+
+#include "frontend.h"
+
+void init_interner(Interner* interner) {
+    memset(interner, 0, sizeof(*interner));
+}
+
+void free_interner(Interner* interner) {
+    free(interner->slots);
+    free(interner->strings);
+    memset(interner, 0, sizeof(*interner));
+}
+
+static void interner_insert_static(int capacity, InternSlot* slots, uint32_t hash, Atom atom) {
+    int i = hash & (capacity - 1);
+
+    while (slots[i].atom_plus_one) {
+        i = (i + 1) & (capacity - 1);
+    }
+
+    slots[i].hash = hash;
+    slots[i].atom_plus_one = atom + 1;
+}
+
+static void interner_make_room(Interner* interner) {
+    if (!interner->capacity || load_factor(interner->count, interner->capacity) > 0.5f) {
+        int new_capacity = interner->capacity ? interner->capacity * 2 : 64;
+        InternSlot* new_slots = calloc(new_capacity, sizeof(InternSlot));
+
+        for (int i = 0; i < interner->capacity; ++i) {
+            InternSlot* slot = &interner->slots[i];
+
+            if (slot->atom_plus_one) {
+                interner_insert_static(new_capacity, new_slots, slot->hash, slot->atom_plus_one - 1);
+            }
+        }
+
+        free(interner->slots);
+
+        interner->capacity = new_capacity;
+        interner->slots = new_slots;
+    }
+
+    if (interner->count == interner->string_capacity) {
+        interner->string_capacity = interner->string_capacity ? interner->string_capacity * 2 : 64;
+        interner->strings = realloc(interner->strings, interner->string_capacity * sizeof(String));
+    }
+}
+
+Atom intern(Interner* interner, char* data, size_t length) {
+    interner_make_room(interner);
+
+    String string = {
+        .data = data,
+        .length = length
+    };
+
+    uint32_t hash = (uint32_t)fnv1a_hash(data, length);
+    InternSlot* slots = interner->slots;
+
+    int i = hash & (interner->capacity - 1);
+
+    while (slots[i].atom_plus_one) {
+        Atom atom = slots[i].atom_plus_one - 1;
+
+        if (slots[i].hash == hash && strings_identical(interner->strings[atom], string)) {
+            return atom;
+        }
+
+        i = (i + 1) & (interner->capacity - 1);
+    }
+
+    Atom atom = interner->count++;
+
+    slots[i].hash = hash;
+    slots[i].atom_plus_one = atom + 1;
+    interner->strings[atom] = string;
+
+    return atom;
+}
+
+String atom_string(Interner* interner, Atom atom) {
+    assert(atom < (Atom)interner->count);
+    return interner->strings[atom];
+}
\ No newline at end of file
@@ -13,8 +13,20 @@ typedef struct {
 
     char* lexer_char;
     int lexer_line;
+    int lexer_token_count;
     Token lexer_cache;
 
+    Interner interner;
+
+    // Innermost declaration of each atom. Names can't be shadowed, so leaving a
+    // scope just unbinds everything it declared.
+    int symbol_capacity;
+    HIR_Node** symbols;
+
+    int declared_count;
+    int declared_capacity;
+    Atom* declared;
+
     HIR_Block* control_flow_tail;
 
     Token last_rbrace;
@@ -32,37 +44,220 @@ static HIR_Block* make_block(Parser* p) {
     return block;
 }
 
-static int isident(char c) {
-    return c == '_' || isalnum(c);
+// Character classes match the "C" locale isspace/isdigit/isalnum that the lexer used to call
+
+enum {
+    CHAR_SPACE = BIT(0),
+    CHAR_DIGIT = BIT(1),
+    CHAR_IDENT = BIT(2),
+};
+
+static const uint8_t char_class[256] = {
+    [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE, ['\v'] = CHAR_SPACE, ['\f'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+
+    ['0'] = CHAR_DIGIT | CHAR_IDENT, ['1'] = CHAR_DIGIT | CHAR_IDENT, ['2'] = CHAR_DIGIT | CHAR_IDENT, ['3'] = CHAR_DIGIT | CHAR_IDENT, ['4'] = CHAR_DIGIT | CHAR_IDENT,
+    ['5'] = CHAR_DIGIT | CHAR_IDENT, ['6'] = CHAR_DIGIT | CHAR_IDENT, ['7'] = CHAR_DIGIT | CHAR_IDENT, ['8'] = CHAR_DIGIT | CHAR_IDENT, ['9'] = CHAR_DIGIT | CHAR_IDENT,
+
+    ['a'] = CHAR_IDENT, ['b'] = CHAR_IDENT, ['c'] = CHAR_IDENT, ['d'] = CHAR_IDENT, ['e'] = CHAR_IDENT, ['f'] = CHAR_IDENT, ['g'] = CHAR_IDENT, ['h'] = CHAR_IDENT,
+    ['i'] = CHAR_IDENT, ['j'] = CHAR_IDENT, ['k'] = CHAR_IDENT, ['l'] = CHAR_IDENT, ['m'] = CHAR_IDENT, ['n'] = CHAR_IDENT, ['o'] = CHAR_IDENT, ['p'] = CHAR_IDENT,
+    ['q'] = CHAR_IDENT, ['r'] = CHAR_IDENT, ['s'] = CHAR_IDENT, ['t'] = CHAR_IDENT, ['u'] = CHAR_IDENT, ['v'] = CHAR_IDENT, ['w'] = CHAR_IDENT, ['x'] = CHAR_IDENT,
+    ['y'] = CHAR_IDENT, ['z'] = CHAR_IDENT,
+
+    ['A'] = CHAR_IDENT, ['B'] = CHAR_IDENT, ['C'] = CHAR_IDENT, ['D'] = CHAR_IDENT, ['E'] = CHAR_IDENT, ['F'] = CHAR_IDENT, ['G'] = CHAR_IDENT, ['H'] = CHAR_IDENT,
+    ['I'] = CHAR_IDENT, ['J'] = CHAR_IDENT, ['K'] = CHAR_IDENT, ['L'] = CHAR_IDENT, ['M'] = CHAR_IDENT, ['N'] = CHAR_IDENT, ['O'] = CHAR_IDENT, ['P'] = CHAR_IDENT,
+    ['Q'] = CHAR_IDENT, ['R'] = CHAR_IDENT, ['S'] = CHAR_IDENT, ['T'] = CHAR_IDENT, ['U'] = CHAR_IDENT, ['V'] = CHAR_IDENT, ['W'] = CHAR_IDENT, ['X'] = CHAR_IDENT,
+    ['Y'] = CHAR_IDENT, ['Z'] = CHAR_IDENT,
+
+    ['_'] = CHAR_IDENT,
+};
+
+#define CHAR_IS(c, class) (char_class[(uint8_t)(c)] & (class))
+
+// The scanners below find the end of a run of one character class. The SIMD
+// paths classify a whole aligned block at a time and take the run length from
+// the first clear bit of the block mask. Aligned loads never cross a page, so
+// reading the bytes past the null terminator that share its block is safe.
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define SCAN_WIDTH 32
+
+typedef __m256i ScanBlock;
+
+#define scan_load(address) _mm256_load_si256((ScanBlock*)(address))
+#define scan_splat(c) _mm256_set1_epi8(c)
+#define scan_equal(a, b) _mm256_cmpeq_epi8(a, b)
+#define scan_or(a, b) _mm256_or_si256(a, b)
+#define scan_sub(a, b) _mm256_sub_epi8(a, b)
+#define scan_min(a, b) _mm256_min_epu8(a, b)
+#define scan_mask(a) ((uint32_t)_mm256_movemask_epi8(a))
+
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+
+#include <emmintrin.h>
+
+#define SCAN_WIDTH 16
+
+typedef __m128i ScanBlock;
+
+#define scan_load(address) _mm_load_si128((ScanBlock*)(address))
+#define scan_splat(c) _mm_set1_epi8(c)
+#define scan_equal(a, b) _mm_cmpeq_epi8(a, b)
+#define scan_or(a, b) _mm_or_si128(a, b)
+#define scan_sub(a, b) _mm_sub_epi8(a, b)
+#define scan_min(a, b) _mm_min_epu8(a, b)
+#define scan_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+
+#endif
+
+#ifdef SCAN_WIDTH
+
+// Bytes of `block` in [low, low + count]
+static ScanBlock scan_range(ScanBlock block, char low, char count) {
+    ScanBlock offset = scan_sub(block, scan_splat(low));
+    return scan_equal(scan_min(offset, scan_splat(count)), offset);
+}
+
+static uint64_t scan_valid_bits(int count) {
+    return ((uint64_t)1 << count) - 1;
+}
+
+typedef uint32_t(*ScanClassifier)(ScanBlock);
+
+static uint32_t classify_digit(ScanBlock block) {
+    return scan_mask(scan_range(block, '0', 9));
+}
+
+static uint32_t classify_ident(ScanBlock block) {
+    ScanBlock letter = scan_range(scan_or(block, scan_splat(0x20)), 'a', 25);
+    ScanBlock digit = scan_range(block, '0', 9);
+    ScanBlock underscore = scan_equal(block, scan_splat('_'));
+    return scan_mask(scan_or(scan_or(letter, digit), underscore));
 }
 
-static int check_keyword(char* start, char* end, char* keyword, int kind) {
-    size_t length = end - start;
+static char* scan_run(char* c, ScanClassifier classify) {
+    while (true) {
+        int offset = (int)((uintptr_t)c & (SCAN_WIDTH - 1));
+        int valid = SCAN_WIDTH - offset;
 
-    if (length == strlen(keyword) && memcmp(start, keyword, length) == 0) {
-        return kind;
+        uint64_t outside = ~((uint64_t)classify(scan_load(c - offset)) >> offset) & scan_valid_bits(valid);
+
+        if (outside) {
+            return c + count_trailing_zeros((uint32_t)outside);
+        }
+
+        c += valid;
     }
+}
 
-    return TOKEN_IDENTIFIER;
+static char* skip_whitespace(char* c, int* line) {
+    while (true) {
+        int offset = (int)((uintptr_t)c & (SCAN_WIDTH - 1));
+        int valid = SCAN_WIDTH - offset;
+
+        ScanBlock block = scan_load(c - offset);
+        ScanBlock newline = scan_equal(block, scan_splat('\n'));
+        ScanBlock space = scan_or(scan_equal(block, scan_splat(' ')), scan_range(block, '\t', '\r' - '\t'));
+
+        uint64_t outside = ~((uint64_t)scan_mask(space) >> offset) & scan_valid_bits(valid);
+        int run = outside ? count_trailing_zeros((uint32_t)outside) : valid;
+
+        *line += count_bits((uint32_t)(((uint64_t)scan_mask(newline) >> offset) & scan_valid_bits(run)));
+        c += run;
+
+        if (outside) {
+            return c;
+        }
+    }
+}
+
+static char* skip_digits(char* c) {
+    return CHAR_IS(*c, CHAR_DIGIT) ? scan_run(c, classify_digit) : c;
 }
 
+static char* skip_ident(char* c) {
+    return CHAR_IS(*c, CHAR_IDENT) ? scan_run(c, classify_ident) : c;
+}
+
+#else
+
+static char* skip_whitespace(char* c, int* line) {
+    while (CHAR_IS(*c, CHAR_SPACE)) {
+        if (*c == '\n') {
+            ++*line;
+        }
+
+        ++c;
+    }
+
+    return c;
+}
+
+static char* skip_digits(char* c) {
+    while (CHAR_IS(*c, CHAR_DIGIT)) {
+        ++c;
+    }
+
+    return c;
+}
+
+static char* skip_ident(char* c) {
+    while (CHAR_IS(*c, CHAR_IDENT)) {
+        ++c;
+    }
+
+    return c;
+}
+
+#endif
+
+typedef struct {
+    char* keyword;
+    int length;
+    int kind;
+} Keyword;
+
+// Perfect hash on the first character and length, every keyword gets its own
+// slot so recognising one is a single table probe and compare
+#define KEYWORD_HASH(first, length) (((first) + (length) * 7) & 7)
+
+static const Keyword keyword_table[8] = {
+    [KEYWORD_HASH('r', 6)] = { "return", 6, TOKEN_KEYWORD_RETURN },
+    [KEYWORD_HASH('i', 2)] = { "if", 2, TOKEN_KEYWORD_IF },
+    [KEYWORD_HASH('e', 4)] = { "else", 4, TOKEN_KEYWORD_ELSE },
+    [KEYWORD_HASH('w', 5)] = { "while", 5, TOKEN_KEYWORD_WHILE },
+    [KEYWORD_HASH('v', 3)] = { "var", 3, TOKEN_KEYWORD_VAR },
+};
+
 static int identifier_kind(char* start, char* end) {
-    switch (start[0]) {
-        case 'r':
-            return check_keyword(start, end, "return", TOKEN_KEYWORD_RETURN);
-        case 'i':
-            return check_keyword(start, end, "if", TOKEN_KEYWORD_IF);
-        case 'e':
-            return check_keyword(start, end, "else", TOKEN_KEYWORD_ELSE);
-        case 'w':
-            return check_keyword(start, end, "while", TOKEN_KEYWORD_WHILE);
-        case 'v':
-            return check_keyword(start, end, "var", TOKEN_KEYWORD_VAR);
+    int length = (int)(end - start);
+    const Keyword* keyword = &keyword_table[KEYWORD_HASH(start[0], length)];
+
+    if (keyword->length == length && memcmp(start, keyword->keyword, length) == 0) {
+        return keyword->kind;
     }
 
     return TOKEN_IDENTIFIER;
 }
 
+static void bind_symbol_room(Parser* p, Atom atom) {
+    if ((int)atom < p->symbol_capacity) {
+        return;
+    }
+
+    int new_capacity = p->symbol_capacity ? p->symbol_capacity * 2 : 64;
+
+    while ((int)atom >= new_capacity) {
+        new_capacity *= 2;
+    }
+
+    p->symbols = realloc(p->symbols, new_capacity * sizeof(HIR_Node*));
+    memset(p->symbols + p->symbol_capacity, 0, (new_capacity - p->symbol_capacity) * sizeof(HIR_Node*));
+    p->symbol_capacity = new_capacity;
+}
+
 static Token lex(Parser* p) {
     if (p->lexer_cache.start) {
         Token cache = p->lexer_cache;
@@ -70,33 +265,31 @@ static Token lex(Parser* p) {
         return cache;
     }
 
-    while (isspace(*p->lexer_char)) {
-        if (*p->lexer_char == '\n') {
-            ++p->lexer_line;
-        }
-
-        ++p->lexer_char;
+    if (CHAR_IS(*p->lexer_char, CHAR_SPACE)) {
+        p->lexer_char = skip_whitespace(p->lexer_char, &p->lexer_line);
     }
 
     char* start = p->lexer_char++;
     int line = p->lexer_line;
     int kind = *start;
+    Atom atom = 0;
+
+    p->lexer_token_count++;
 
     switch (start[0]) {
         default:
-            if (isdigit(start[0])) {
-                while (isdigit(*p->lexer_char)) {
-                    p->lexer_char++;
-                }
-
+            if (CHAR_IS(start[0], CHAR_DIGIT)) {
+                p->lexer_char = skip_digits(p->lexer_char);
                 kind = TOKEN_INT_LITERAL;
             }
-            else if (isident(start[0])) {
-                while (isident(*p->lexer_char)) {
-                    p->lexer_char++;
-                }
-
+            else if (CHAR_IS(start[0], CHAR_IDENT)) {
+                p->lexer_char = skip_ident(p->lexer_char);
                 kind = identifier_kind(start, p->lexer_char);
+
+                if (kind == TOKEN_IDENTIFIER) {
+                    atom = intern(&p->interner, start, p->lexer_char - start);
+                    bind_symbol_room(p, atom);
+                }
             }
             break;
 
@@ -110,7 +303,8 @@ static Token lex(Parser* p) {
         .kind = kind,
         .length = (int)(p->lexer_char - start),
         .start = start,
-        .line = line
+        .line = line,
+        .atom = atom
     };
 }
 
@@ -163,13 +357,6 @@ static String extract_string(Arena* arena, Token token) {
     };
 }
 
-static String token_string_view(Token token) {
-    return (String) {
-        .data = token.start,
-        .length = token.length
-    };
-}
-
 static bool match(Parser* p, int kind, char* description) {
     Token token = peek(p);
 
@@ -199,107 +386,35 @@ static HIR_Node* make_node(Parser* p, HIR_Block* block, HIR_OpCode op, int in_co
     return result;
 }
 
-typedef struct {
-    int count;
-    int capacity;
-
-    String* keys;
-    HIR_Node** values;
-} SymbolTable;
-
-static void add_symbol_static(int capacity, String* keys, HIR_Node** values, HIR_Node* symbol, String name) {
-    int i = fnv1a_hash(name.data, name.length) % capacity;
-
-    for (int j = 0; j < capacity; ++j) {
-        if (!keys[i].data) {
-            keys[i] = name;
-            values[i] = symbol;
-            return;
-        }
-
-        assert(!strings_identical(keys[i], name));
-
-        i = (i + 1) % capacity;
-    }
-
-    assert(false);
-}
-
-static void add_symbol(SymbolTable* table, HIR_Node* symbol, String name) {
-    if (!table->capacity || load_factor(table->count, table->capacity) > 0.5f)
-    {
-        int new_capacity = table->capacity ? table->capacity * 2 : 8;
-        String* new_keys = calloc(new_capacity, sizeof(String));
-        HIR_Node** new_values = calloc(new_capacity, sizeof(HIR_Node*));
-
-        for (int i = 0; i < table->capacity; ++i) {
-            if (table->keys[i].data) {
-                add_symbol_static(new_capacity, new_keys, new_values, table->values[i], table->keys[i]);
-            }
-        }
-
-        free(table->keys);
-        free(table->values);
-
-        table->capacity = new_capacity;
-        table->keys = new_keys;
-        table->values = new_values;
-    }
-
-    add_symbol_static(table->capacity, table->keys, table->values, symbol, name);
-    table->count++;
-}
-
-static HIR_Node* find_symbol_in_table(SymbolTable* table, String name) {
-    if (!table->capacity) {
-        return 0;
-    }
-
-    int i = fnv1a_hash(name.data, name.length) % table->capacity;
-
-    for (int j = 0; j < table->capacity; ++j) {
-        if (!table->keys[i].data) {
-            return 0;
-        }
-
-        if (strings_identical(table->keys[i], name)) {
-            return table->values[i];
-        }
-
-        i = (i + 1) % table->capacity;
-    }
-
-    return 0;
-}
-
-static void free_symbol_table(SymbolTable* table) {
-    free(table->keys);
-    free(table->values);
-    memset(table, 0, sizeof(*table));
-}
-
 typedef struct Scope Scope;
 struct Scope {
     Scope* outer;
-    SymbolTable table;
+    int declared_start;
 };
 
-static HIR_Node* find_symbol(Scope* scope, String name) {
-    HIR_Node* result = find_symbol_in_table(&scope->table, name);
+static HIR_Node* find_symbol(Parser* p, Atom atom) {
+    return p->symbols[atom];
+}
 
-    if (result) {
-        return result;
+static void add_symbol(Parser* p, HIR_Node* symbol, Atom atom) {
+    if (p->declared_count == p->declared_capacity) {
+        p->declared_capacity = p->declared_capacity ? p->declared_capacity * 2 : 64;
+        p->declared = realloc(p->declared, p->declared_capacity * sizeof(Atom));
     }
 
-    if (scope->outer) {
-        return find_symbol(scope->outer, name);
-    }
+    p->declared[p->declared_count++] = atom;
+    p->symbols[atom] = symbol;
+}
 
-    return 0;
+static void leave_scope(Parser* p, Scope* scope) {
+    while (p->declared_count > scope->declared_start) {
+        p->symbols[p->declared[--p->declared_count]] = 0;
+    }
 }
 
 static HIR_Node* parse_primary(Parser* p, HIR_Block** block, Scope* scope) {
     (void)block;
+    (void)scope;
 
     Token token = peek(p);
 
@@ -323,7 +438,7 @@ static HIR_Node* parse_primary(Parser* p, HIR_Block** block, Scope* scope) {
         case TOKEN_IDENTIFIER: {
             lex(p);
 
-            HIR_Node* var = find_symbol(scope, token_string_view(token));
+            HIR_Node* var = find_symbol(p, token.atom);
             if (!var) {
                 error_at_token(p, token, "symbol does not exist in the current scope");
                 return 0;
@@ -451,6 +566,7 @@ static bool parse_block(Parser* p, HIR_Block** block, Scope* scope) {
 
     Scope inner = {
         .outer = scope,
+        .declared_start = p->declared_count
     };
 
     while (until(p, '}')) {
@@ -470,7 +586,7 @@ static bool parse_block(Parser* p, HIR_Block** block, Scope* scope) {
     p->last_rbrace = rbrace;
 
     exit:
-    free_symbol_table(&inner.table);
+    leave_scope(p, &inner);
     return result;
 }
 
@@ -596,7 +712,7 @@ static bool parse_statement(Parser* p, HIR_Block** block, Scope* scope) {
 
             REQUIRE(p, ';', ";");
 
-            if (find_symbol(scope, token_string_view(name))) {
+            if (find_symbol(p, name.atom)) {
                 error_at_token(p, name, "this symbol already exists in the current scope");
                 return false;
             }
@@ -604,7 +720,7 @@ static bool parse_statement(Parser* p, HIR_Block** block, Scope* scope) {
             HIR_Node* node = make_node(p, *block, HIR_OP_VAR, 0, sizeof(String), token);
             *(String*)node->data = extract_string(p->arena, name);
 
-            add_symbol(&scope->table, node, token_string_view(name));
+            add_symbol(p, node, name.atom);
 
             return true;
         } break;
@@ -624,12 +740,17 @@ HIR_Proc* parse(Arena* arena, char* source_path, char* source) {
     HIR_Block* control_flow_head = make_block(&p);
     HIR_Block* control_flow_tail = control_flow_head;
 
-    if (!parse_block(&p, &control_flow_tail, 0)) {
-        return 0;
+    HIR_Proc* proc = 0;
+
+    if (parse_block(&p, &control_flow_tail, 0)) {
+        proc = arena_type(arena, HIR_Proc);
+        proc->control_flow_head = control_flow_head;
+        proc->token_count = p.lexer_token_count;
     }
 
-    HIR_Proc* proc = arena_type(arena, HIR_Proc);
-    proc->control_flow_head = control_flow_head;
+    free_interner(&p.interner);
+    free(p.symbols);
+    free(p.declared);
 
     return proc;
 }
\ No newline at end of file
@@ -2,24 +2,84 @@
 #include <stdlib.h>
 
 #include "internal.h"
+#include "platform.h"
+
+Arena init_arena(size_t size) {
+    size_t page_size = vm_page_size();
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+    void* memory = vm_reserve(size);
+    assert("failed to reserve arena memory" && memory);
 
-Arena init_arena(size_t size, void* memory) {
     return (Arena) {
         .base = (size_t)memory,
         .size = size
     };
 }
 
+void release_arena(Arena* arena) {
+    if (arena->base) {
+        vm_release((void*)arena->base, arena->size);
+    }
+
+    memset(arena, 0, sizeof(*arena));
+}
+
+void arena_decommit(Arena* arena) {
+    size_t keep = (arena->allocated + ARENA_COMMIT_GRANULARITY - 1) & ~(ARENA_COMMIT_GRANULARITY - 1);
+
+    if (keep < ARENA_COMMIT_GRANULARITY) {
+        keep = ARENA_COMMIT_GRANULARITY;
+    }
+
+    if (keep < arena->committed) {
+        vm_decommit((void*)(arena->base + keep), arena->committed - keep);
+        arena->committed = keep;
+    }
+}
+
+void arena_reset(Arena* arena) {
+    arena->allocated = 0;
+    arena_decommit(arena);
+}
+
+static void arena_commit(Arena* arena, size_t end) {
+    size_t new_committed = (end + ARENA_COMMIT_GRANULARITY - 1) & ~(ARENA_COMMIT_GRANULARITY - 1);
+
+    if (new_committed > arena->size) {
+        new_committed = arena->size;
+    }
+
+    if (!vm_commit((void*)(arena->base + arena->committed), new_committed - arena->committed)) {
+        assert("failed to commit arena memory" && false);
+    }
+
+    arena->committed = new_committed;
+}
+
 void* arena_push(Arena* arena, size_t amount) {
     if (!amount) {
         return 0;
     }
 
-    size_t result = arena->base + arena->allocated;
-    result = (result + 7) & ~7;
-    assert("arena out of memory" && (arena->size-result) >= amount);
-    arena->allocated = result - arena->base + amount;
-    return (void*)result;
+    size_t offset = (arena->allocated + 7) & ~(size_t)7;
+    assert("arena out of memory" && offset <= arena->size && (arena->size - offset) >= amount);
+
+    if (offset + amount > arena->committed) {
+        arena_commit(arena, offset + amount);
+    }
+
+    arena->allocated = offset + amount;
+
+    if (arena->allocated > arena->high_water) {
+        arena->high_water = arena->allocated;
+    }
+
+    return (void*)(arena->base + offset);
+}
+
+void arena_reset_high_water(Arena* arena) {
+    arena->high_water = arena->allocated;
 }
 
 void* arena_zero(Arena* arena, size_t amount) {
@@ -59,14 +119,54 @@ void bitset_clear(Bitset* set) {
 }
 
 void init_scratch_library(ScratchLibrary* library, size_t arena_size) {
-    for (int i = 0; i < LENGTH(library->arenas); ++i) {
-        library->arenas[i] = init_arena(arena_size, malloc(arena_size));
+    memset(library, 0, sizeof(*library));
+    library->arena_size = arena_size;
+}
+
+void free_scratch_library(ScratchLibrary* library) {
+    for (int i = 0; i < library->count; ++i) {
+        release_arena(library->arenas[i]);
+        free(library->arenas[i]);
+    }
+
+    free(library->arenas);
+    memset(library, 0, sizeof(*library));
+}
+
+void scratch_library_reset_high_water(ScratchLibrary* library) {
+    for (int i = 0; i < library->count; ++i) {
+        arena_reset_high_water(library->arenas[i]);
+    }
+}
+
+size_t scratch_library_high_water(ScratchLibrary* library) {
+    size_t total = 0;
+
+    for (int i = 0; i < library->count; ++i) {
+        total += library->arenas[i]->high_water;
+    }
+
+    return total;
+}
+
+static Arena* scratch_library_grow(ScratchLibrary* library) {
+    if (library->count == library->capacity) {
+        library->capacity = library->capacity ? library->capacity * 2 : 4;
+        library->arenas = realloc(library->arenas, library->capacity * sizeof(Arena*));
     }
+
+    Arena* arena = malloc(sizeof(Arena));
+    *arena = init_arena(library->arena_size);
+
+    library->arenas[library->count++] = arena;
+    return arena;
 }
 
 Scratch scratch_get(ScratchLibrary* library, int conflict_count, Arena** conflicts) {
-    for (int i = 0; i < LENGTH(library->arenas); ++i) {
-        Arena* arena = &library->arenas[i];
+    Arena* available = 0;
+
+    for (int i = 0; i < library->count && !available; ++i) {
+        Arena* arena = library->arenas[i];
 
         bool does_conflict = false;
 
@@ -78,15 +178,18 @@ Scratch scratch_get(ScratchLibrary* library, int conflict_count, Arena** conflic
         }
 
         if (!does_conflict) {
-            return (Scratch) {
-                .arena = arena,
-                .allocated = arena->allocated
-            };
+            available = arena;
         }
     }
 
-    assert("no available scratch arenas" && false);
-    return (Scratch){0};
+    if (!available) {
+        available = scratch_library_grow(library);
+    }
+
+    return (Scratch) {
+        .arena = available,
+        .allocated = available->allocated
+    };
 }
 
 void scratch_release(Scratch* scratch) {
@@ -10,20 +10,63 @@
 
 #define BIT(x) (1 << (x))
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static inline int count_trailing_zeros(uint32_t x) {
+    assert(x);
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (int)index;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+// __popcnt always emits POPCNT, which the SSE2 baseline doesn't guarantee,
+// but every CPU with AVX has it. gcc and clang only emit it when the target
+// allows it.
+static inline int count_bits(uint32_t x) {
+#if defined(_MSC_VER) && defined(__AVX__)
+    return (int)__popcnt(x);
+#elif defined(_MSC_VER)
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0f0f0f0f;
+    return (int)((x * 0x01010101) >> 24);
+#else
+    return __builtin_popcount(x);
+#endif
+}
+
+#define ARENA_RESERVE_SIZE ((size_t)64 * 1024 * 1024 * 1024)
+#define ARENA_COMMIT_GRANULARITY ((size_t)64 * 1024)
+
 typedef struct {
     size_t base;
     size_t allocated;
+    size_t committed;
     size_t size;
+    size_t high_water;
 } Arena;
 
-Arena init_arena(size_t size, void* memory);
+Arena init_arena(size_t size);
+void release_arena(Arena* arena);
+void arena_reset(Arena* arena);
+void arena_decommit(Arena* arena);
+void arena_reset_high_water(Arena* arena);
 void* arena_push(Arena* arena, size_t amount);
 void* arena_zero(Arena* arena, size_t amount);
 #define arena_type(arena, type) ((type*)arena_zero(arena, sizeof(type)))
 #define arena_array(arena, type, count) ((type*)arena_zero(arena, (count) * sizeof(type)))
 
 typedef struct {
-    Arena arenas[2];
+    size_t arena_size;
+    int count;
+    int capacity;
+    Arena** arenas;
 } ScratchLibrary;
 
 typedef struct {
@@ -32,6 +75,9 @@ typedef struct {
 } Scratch;
 
 void init_scratch_library(ScratchLibrary* library, size_t arena_size);
+void free_scratch_library(ScratchLibrary* library);
+void scratch_library_reset_high_water(ScratchLibrary* library);
+size_t scratch_library_high_water(ScratchLibrary* library);
 
 Scratch scratch_get(ScratchLibrary* library, int conflict_count, Arena** conflicts);
 void scratch_release(Scratch* scratch);
@@ -50,7 +96,7 @@ void bitset_clear(Bitset* set);
 
 uint64_t fnv1a_hash(void* data, size_t length);
 
-inline float load_factor(int count, int capacity) {
+static inline float load_factor(int count, int capacity) {
     return (float)count/(float)capacity;
 }
 
@@ -59,7 +105,7 @@ typedef struct {
     size_t length;
 } String;
 
-inline String make_string(Arena* arena, char* string) {
+static inline String make_string(Arena* arena, char* string) {
     size_t length = strlen(string);
     char* data = arena_push(arena, length + 1);
 
@@ -72,13 +118,13 @@ inline String make_string(Arena* arena, char* string) {
     };
 }
 
-inline String string_view(char* string) {
+static inline String string_view(char* string) {
     return (String) {
         .length = strlen(string),
         .data = string
     };
 }
 
-inline bool strings_identical(String a, String b) {
+static inline bool strings_identical(String a, String b) {
     return a.length == b.length && memcmp(a.data, b.data, a.length) == 0;
 }
\ No newline at end of file
@@ -1,74 +1,235 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "frontend/frontend.h"
+#include "timing.h"
+#include "platform.h"
 
-static Arena scratch_arenas[2];
+static ScratchLibrary global_scratch_library;
 
 Scratch get_global_scratch(int conflict_count, Arena** conflicts) {
-    for (int i = 0; i < LENGTH(scratch_arenas); ++i) {
-        Arena* arena = &scratch_arenas[i];
+    return scratch_get(&global_scratch_library, conflict_count, conflicts);
+}
 
-        bool does_conflict = false;
+#define COUNT(timer, expression) ((timer)->enabled ? (expression) : -1)
 
-        for (int j = 0; j < conflict_count; ++j) {
-            if (arena == conflicts[j]) {
-                does_conflict = true;
-                break;
-            }
-        }
+typedef enum {
+    OUTPUT_LISTING,
+    OUTPUT_RUN,
+    OUTPUT_OBJECT
+} Output;
+
+// foo/bar.sg becomes foo/bar.o
+static char* object_path(Arena* arena, char* source_path) {
+    size_t length = strlen(source_path);
+    size_t stem = length;
 
-        if (!does_conflict) {
-            return (Scratch) {
-                .arena = arena,
-                .allocated = arena->allocated
-            };
+    for (size_t i = length; i > 0 && source_path[i - 1] != '/' && source_path[i - 1] != '\\'; --i) {
+        if (source_path[i - 1] == '.') {
+            stem = i - 1;
+            break;
         }
     }
 
-    assert(false);
-    return (Scratch){0};
-}
-
-int main() {
-    size_t arena_size = 5 * 1024  * 1024;
-    Arena arena = init_arena(arena_size, malloc(arena_size));
-
-    for (int i = 0; i < LENGTH(scratch_arenas); ++i) {
-        scratch_arenas[i] = init_arena(arena_size, malloc(arena_size));
-    }
+    char* path = arena_push(arena, stem + 3);
+    memcpy(path, source_path, stem);
+    memcpy(path + stem, ".o", 3);
 
-    char* source_path = "examples/test.sg";
+    return path;
+}
 
-    FILE* file;
-    if (fopen_s(&file, source_path, "r")) {
+static bool compile_file(Arena* arena, PassTimer* timer, char* source_path, Output output) {
+    MappedFile source;
+    if (!map_file(source_path, &source)) {
         printf("Failed to load '%s'\n", source_path);
-        return 1;
+        return false;
     }
 
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+    timer->source_path = source_path;
 
-    char* source = malloc(file_size + 1);
-    size_t source_size = fread(source, 1, file_size, file);
-    source[source_size] = '\0';
+    pass_begin(timer, "parse");
+    HIR_Proc* hir_proc = parse(arena, source_path, source.data);
+    pass_end(timer);
 
-    HIR_Proc* hir_proc = parse(&arena, source_path, source);
     if (!hir_proc) {
-        return 1;
+        unmap_file(&source);
+        return false;
     }
 
-    hir_print(hir_proc);
+    int hir_nodes = COUNT(timer, hir_node_count(hir_proc));
+    pass_counts(timer, hir_proc->token_count, hir_nodes);
+
+    // The debug dumps only accompany the listing, so running or writing an object stays quiet
+    if (output == OUTPUT_LISTING) {
+        pass_begin(timer, "hir_print");
+        hir_print(hir_proc);
+        pass_end(timer);
+        pass_counts(timer, hir_nodes, hir_nodes);
+    }
 
     SB_Context* sbc = sb_init();
+    timer->sb_context = sbc;
+
+    pass_begin(timer, "hir_lower");
     SB_Proc* lir_proc = hir_lower(sbc, hir_proc);
+    pass_end(timer);
 
-    sb_visualize(sbc, lir_proc);
+    int sb_nodes = COUNT(timer, sb_node_count(sbc, lir_proc));
+    pass_counts(timer, hir_nodes, sb_nodes);
+
+    if (output == OUTPUT_LISTING) {
+        pass_begin(timer, "sb_visualize");
+        sb_visualize(sbc, lir_proc);
+        pass_end(timer);
+        pass_counts(timer, sb_nodes, sb_nodes);
+    }
+
+    pass_begin(timer, "sb_mem2reg");
+    sb_mem2reg(sbc, lir_proc);
+    pass_end(timer);
+
+    int sb_nodes_in = sb_nodes;
+    sb_nodes = COUNT(timer, sb_node_count(sbc, lir_proc));
+    pass_counts(timer, sb_nodes_in, sb_nodes);
+
+    pass_begin(timer, "sb_sccp");
+    sb_sccp(sbc, lir_proc);
+    pass_end(timer);
+
+    sb_nodes_in = sb_nodes;
+    sb_nodes = COUNT(timer, sb_node_count(sbc, lir_proc));
+    pass_counts(timer, sb_nodes_in, sb_nodes);
+
+    pass_begin(timer, "sb_opt");
     sb_opt(sbc, lir_proc);
-    sb_visualize(sbc, lir_proc);
+    pass_end(timer);
+
+    sb_nodes_in = sb_nodes;
+    sb_nodes = COUNT(timer, sb_node_count(sbc, lir_proc));
+    pass_counts(timer, sb_nodes_in, sb_nodes);
+
+    pass_begin(timer, "sb_compact");
+    sb_compact(sbc, lir_proc);
+    pass_end(timer);
+    pass_counts(timer, sb_nodes, sb_nodes);
+
+    bool result = true;
+
+    switch (output) {
+        case OUTPUT_LISTING: {
+            pass_begin(timer, "sb_visualize");
+            sb_visualize(sbc, lir_proc);
+            pass_end(timer);
+            pass_counts(timer, sb_nodes, sb_nodes);
+
+            pass_begin(timer, "sb_generate_x64");
+            sb_generate_x64(sbc, lir_proc);
+            pass_end(timer);
+            pass_counts(timer, sb_nodes, -1);
+        } break;
+
+        case OUTPUT_RUN: {
+            int64_t value = 0;
+
+            pass_begin(timer, "sb_run_x64");
+            result = sb_run_x64(sbc, lir_proc, &value);
+            pass_end(timer);
+            pass_counts(timer, sb_nodes, -1);
+
+            if (result) {
+                printf("%lld\n", (long long)value);
+            }
+            else {
+                printf("Failed to run '%s'\n", source_path);
+            }
+        } break;
+
+        case OUTPUT_OBJECT: {
+            char* path = object_path(arena, source_path);
+
+            pass_begin(timer, "sb_generate_x64_object");
+            result = sb_generate_x64_object(sbc, lir_proc, path);
+            pass_end(timer);
+            pass_counts(timer, sb_nodes, -1);
+
+            if (!result) {
+                printf("Failed to write '%s'\n", path);
+            }
+        } break;
+    }
+
+    timer->sb_context = 0;
+    sb_free(sbc);
+
+    // Tokens point into the mapping, so it has to outlive everything allocated from the arena
+    arena_reset(arena);
+    unmap_file(&source);
+
+    return result;
+}
+
+int main(int argc, char** argv) {
+    bool time_passes = false;
+    Output output = OUTPUT_LISTING;
+    char* trace_path = "sugar_trace.json";
+
+    int source_count = 0;
+    char** source_paths = calloc(argc, sizeof(char*));
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--time-passes") == 0) {
+            time_passes = true;
+        }
+        else if (strcmp(argv[i], "--run") == 0) {
+            output = OUTPUT_RUN;
+        }
+        else if (strcmp(argv[i], "--object") == 0) {
+            output = OUTPUT_OBJECT;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            time_passes = true;
+            trace_path = argv[++i];
+        }
+        else if (argv[i][0] != '-') {
+            source_paths[source_count++] = argv[i];
+        }
+        else {
+            source_count = 0;
+            break;
+        }
+    }
+
+    if (!source_count) {
+        printf("usage: %s [--time-passes] [--trace <file.json>] [--run | --object] <file.sg>...\n", argv[0]);
+        return 1;
+    }
+
+    Arena arena = init_arena(ARENA_RESERVE_SIZE);
+    init_scratch_library(&global_scratch_library, ARENA_RESERVE_SIZE);
+
+    PassTimer timer;
+    init_pass_timer(&timer, time_passes, &arena, &global_scratch_library);
+
+    int result = 0;
+
+    for (int i = 0; i < source_count; ++i) {
+        if (!compile_file(&arena, &timer, source_paths[i], output)) {
+            result = 1;
+        }
+    }
+
+    if (time_passes) {
+        print_pass_timings(&timer, stderr);
+
+        if (!write_pass_trace(&timer, trace_path)) {
+            printf("Failed to write '%s'\n", trace_path);
+            result = 1;
+        }
+    }
 
-    sb_generate_x64(sbc, lir_proc);
+    free_pass_timer(&timer);
+    free(source_paths);
 
-    return 0;
+    return result;
 }
\ No newline at end of file
@@ -0,0 +1,306 @@
+#include <string.h>
+
+#include "platform.h"
+
+typedef struct {
+    void (*function)(void*);
+    void* argument;
+} ThreadStart;
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+size_t vm_page_size() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+void* vm_reserve(size_t size) {
+    return VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool vm_commit(void* address, size_t size) {
+    return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != 0;
+}
+
+void vm_decommit(void* address, size_t size) {
+    VirtualFree(address, size, MEM_DECOMMIT);
+}
+
+void vm_release(void* address, size_t size) {
+    (void)size;
+    VirtualFree(address, 0, MEM_RELEASE);
+}
+
+void* vm_allocate_code(size_t size) {
+    return VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+bool vm_protect_code(void* address, size_t size) {
+    DWORD old_protect;
+
+    if (!VirtualProtect(address, size, PAGE_EXECUTE_READ, &old_protect)) {
+        return false;
+    }
+
+    return FlushInstructionCache(GetCurrentProcess(), address, size) != 0;
+}
+
+uint64_t timer_ns() {
+    static LARGE_INTEGER frequency;
+
+    if (!frequency.QuadPart) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    uint64_t seconds = counter.QuadPart / frequency.QuadPart;
+    uint64_t remainder = counter.QuadPart % frequency.QuadPart;
+
+    return seconds * 1000000000ull + remainder * 1000000000ull / frequency.QuadPart;
+}
+
+FILE* open_file(char* path, char* mode) {
+    FILE* file;
+
+    if (fopen_s(&file, path, mode)) {
+        return 0;
+    }
+
+    return file;
+}
+
+static bool read_whole_file(HANDLE handle, char* data, size_t size) {
+    while (size) {
+        DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+        DWORD read;
+
+        if (!ReadFile(handle, data, chunk, &read, 0) || read == 0) {
+            return false;
+        }
+
+        data += read;
+        size -= read;
+    }
+
+    return true;
+}
+
+bool map_file(char* path, MappedFile* file) {
+    memset(file, 0, sizeof(*file));
+
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(handle, &file_size)) {
+        CloseHandle(handle);
+        return false;
+    }
+
+    size_t size = (size_t)file_size.QuadPart;
+    bool result = false;
+
+    if (size % vm_page_size() != 0) {
+        // The tail of the last page is zero filled, which gives us the sentinel for free
+        HANDLE mapping = CreateFileMappingA(handle, 0, PAGE_READONLY, 0, 0, 0);
+
+        if (mapping) {
+            file->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            file->mapping = mapping;
+            result = file->data != 0;
+
+            if (!result) {
+                CloseHandle(mapping);
+            }
+        }
+    }
+    else {
+        // No room for a sentinel inside the mapping, copy into committed memory instead
+        file->data = VirtualAlloc(0, size + 1, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        file->copied = true;
+        result = file->data && read_whole_file(handle, file->data, size);
+
+        if (!result && file->data) {
+            VirtualFree(file->data, 0, MEM_RELEASE);
+        }
+    }
+
+    CloseHandle(handle);
+
+    if (!result) {
+        memset(file, 0, sizeof(*file));
+        return false;
+    }
+
+    file->size = size;
+    return true;
+}
+
+void unmap_file(MappedFile* file) {
+    if (file->copied) {
+        VirtualFree(file->data, 0, MEM_RELEASE);
+    }
+    else if (file->data) {
+        UnmapViewOfFile(file->data);
+        CloseHandle(file->mapping);
+    }
+
+    memset(file, 0, sizeof(*file));
+}
+
+static DWORD WINAPI thread_main(LPVOID parameter) {
+    ThreadStart* start = parameter;
+    start->function(start->argument);
+    return 0;
+}
+
+bool run_thread(size_t stack_size, void (*function)(void*), void* argument) {
+    ThreadStart start = { function, argument };
+
+    HANDLE thread = CreateThread(0, stack_size, thread_main, &start, STACK_SIZE_PARAM_IS_A_RESERVATION, 0);
+    if (!thread) {
+        return false;
+    }
+
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+
+    return true;
+}
+
+#else
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+size_t vm_page_size() {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void* vm_reserve(size_t size) {
+    void* address = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return address == MAP_FAILED ? 0 : address;
+}
+
+bool vm_commit(void* address, size_t size) {
+    return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void vm_decommit(void* address, size_t size) {
+    madvise(address, size, MADV_DONTNEED);
+    mprotect(address, size, PROT_NONE);
+}
+
+void vm_release(void* address, size_t size) {
+    munmap(address, size);
+}
+
+void* vm_allocate_code(size_t size) {
+    void* address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return address == MAP_FAILED ? 0 : address;
+}
+
+bool vm_protect_code(void* address, size_t size) {
+    return mprotect(address, size, PROT_READ | PROT_EXEC) == 0;
+}
+
+uint64_t timer_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+FILE* open_file(char* path, char* mode) {
+    return fopen(path, mode);
+}
+
+bool map_file(char* path, MappedFile* file) {
+    memset(file, 0, sizeof(*file));
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) == -1 || !S_ISREG(status.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)status.st_size;
+    size_t page_size = vm_page_size();
+    size_t mapping_size = (size + 1 + page_size - 1) & ~(page_size - 1);
+
+    // Reserve zero pages covering the file plus at least one byte, then map the
+    // file over the front. Whatever isn't covered by the file stays zero.
+    char* data = mmap(0, mapping_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    if (size && mmap(data, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(data, mapping_size);
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+
+    if (size) {
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    file->data = data;
+    file->size = size;
+    file->mapping_size = mapping_size;
+
+    return true;
+}
+
+void unmap_file(MappedFile* file) {
+    if (file->data) {
+        munmap(file->data, file->mapping_size);
+    }
+
+    memset(file, 0, sizeof(*file));
+}
+
+static void* thread_main(void* parameter) {
+    ThreadStart* start = parameter;
+    start->function(start->argument);
+    return 0;
+}
+
+bool run_thread(size_t stack_size, void (*function)(void*), void* argument) {
+    ThreadStart start = { function, argument };
+
+    pthread_attr_t attributes;
+    pthread_t thread;
+
+    if (pthread_attr_init(&attributes) != 0) {
+        return false;
+    }
+
+    bool created = pthread_attr_setstacksize(&attributes, stack_size) == 0 &&
+        pthread_create(&thread, &attributes, thread_main, &start) == 0;
+
+    pthread_attr_destroy(&attributes);
+
+    return created && pthread_join(thread, 0) == 0;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Virtual memory
+
+size_t vm_page_size();
+
+void* vm_reserve(size_t size);
+bool vm_commit(void* address, size_t size);
+void vm_decommit(void* address, size_t size);
+void vm_release(void* address, size_t size);
+
+// Executable memory. Code is written into a fresh read-write allocation and
+// then flipped to read-execute, so no page is ever writable and executable at
+// once. Release it with vm_release.
+
+void* vm_allocate_code(size_t size);
+bool vm_protect_code(void* address, size_t size);
+
+// Timing
+
+uint64_t timer_ns();
+
+// Files
+
+FILE* open_file(char* path, char* mode);
+
+// Read-only file mappings. `data` is always followed by at least one null
+// byte, either from the zero fill at the end of the last page or from a
+// zero page mapped directly after the file.
+
+typedef struct {
+    char* data;
+    size_t size;
+
+    size_t mapping_size;
+    void* mapping;
+    bool copied;
+} MappedFile;
+
+bool map_file(char* path, MappedFile* file);
+void unmap_file(MappedFile* file);
+
+// Threads
+
+// Runs `function` on a new thread with a stack of `stack_size` bytes and
+// waits for it to finish
+bool run_thread(size_t stack_size, void (*function)(void*), void* argument);
@@ -0,0 +1,178 @@
+#include <stdlib.h>
+
+#include "timing.h"
+#include "platform.h"
+
+void init_pass_timer(PassTimer* timer, bool enabled, Arena* arena, ScratchLibrary* scratch_library) {
+    memset(timer, 0, sizeof(*timer));
+
+    timer->enabled = enabled;
+    timer->origin_ns = timer_ns();
+    timer->arena = arena;
+    timer->scratch_library = scratch_library;
+}
+
+void free_pass_timer(PassTimer* timer) {
+    free(timer->passes);
+    memset(timer, 0, sizeof(*timer));
+}
+
+void pass_begin(PassTimer* timer, char* name) {
+    if (!timer->enabled) {
+        return;
+    }
+
+    if (timer->count == timer->capacity) {
+        timer->capacity = timer->capacity ? timer->capacity * 2 : 16;
+        timer->passes = realloc(timer->passes, timer->capacity * sizeof(PassTiming));
+    }
+
+    arena_reset_high_water(timer->arena);
+    scratch_library_reset_high_water(timer->scratch_library);
+
+    if (timer->sb_context) {
+        sb_reset_memory_high_water(timer->sb_context);
+    }
+
+    PassTiming* pass = &timer->passes[timer->count];
+    memset(pass, 0, sizeof(*pass));
+
+    pass->name = name;
+    pass->source_path = timer->source_path;
+    pass->start_ns = timer_ns();
+}
+
+void pass_end(PassTimer* timer) {
+    if (!timer->enabled) {
+        return;
+    }
+
+    PassTiming* pass = &timer->passes[timer->count++];
+    pass->duration_ns = timer_ns() - pass->start_ns;
+
+    pass->count_in = -1;
+    pass->count_out = -1;
+
+    pass->arena_high_water = timer->arena->high_water;
+    pass->scratch_high_water = scratch_library_high_water(timer->scratch_library);
+
+    if (timer->sb_context) {
+        SB_MemoryStats stats = sb_memory_stats(timer->sb_context);
+        pass->sb_arena_high_water = stats.arena_high_water;
+        pass->sb_scratch_high_water = stats.scratch_high_water;
+        pass->sb_graph_live_bytes = stats.graph_live_bytes;
+        pass->sb_graph_free_bytes = stats.graph_free_bytes;
+    }
+}
+
+void pass_counts(PassTimer* timer, int count_in, int count_out) {
+    if (!timer->enabled) {
+        return;
+    }
+
+    assert(timer->count);
+
+    PassTiming* pass = &timer->passes[timer->count - 1];
+    pass->count_in = count_in;
+    pass->count_out = count_out;
+}
+
+static void print_count(FILE* file, int count) {
+    if (count < 0) {
+        fprintf(file, " %10s", "-");
+    }
+    else {
+        fprintf(file, " %10d", count);
+    }
+}
+
+void print_pass_timings(PassTimer* timer, FILE* file) {
+    if (!timer->enabled) {
+        return;
+    }
+
+    uint64_t total_ns = 0;
+
+    for (int i = 0; i < timer->count; ++i) {
+        total_ns += timer->passes[i].duration_ns;
+    }
+
+    fprintf(file, "%-16s %10s %6s %10s %10s %12s %12s %12s %12s %12s %12s\n",
+        "pass", "ms", "%", "in", "out", "arena KB", "scratch KB", "sb KB", "sb scr KB", "live KB", "free KB");
+
+    for (int i = 0; i < timer->count; ++i) {
+        PassTiming* pass = &timer->passes[i];
+
+        if (pass->source_path && (i == 0 || pass->source_path != timer->passes[i - 1].source_path)) {
+            fprintf(file, "%s:\n", pass->source_path);
+        }
+
+        fprintf(file, "%-16s %10.3f %6.1f", pass->name, pass->duration_ns / 1e6, total_ns ? 100.0 * pass->duration_ns / total_ns : 0.0);
+
+        print_count(file, pass->count_in);
+        print_count(file, pass->count_out);
+
+        fprintf(file, " %12zu %12zu %12zu %12zu %12zu %12zu\n",
+            pass->arena_high_water / 1024,
+            pass->scratch_high_water / 1024,
+            pass->sb_arena_high_water / 1024,
+            pass->sb_scratch_high_water / 1024,
+            pass->sb_graph_live_bytes / 1024,
+            pass->sb_graph_free_bytes / 1024);
+    }
+
+    fprintf(file, "%-16s %10.3f\n", "total", total_ns / 1e6);
+}
+
+bool write_pass_trace(PassTimer* timer, char* path) {
+    if (!timer->enabled) {
+        return true;
+    }
+
+    FILE* file = open_file(path, "w");
+    if (!file) {
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (int i = 0; i < timer->count; ++i) {
+        PassTiming* pass = &timer->passes[i];
+
+        double start_us = (pass->start_ns - timer->origin_ns) / 1e3;
+        double end_us = start_us + pass->duration_ns / 1e3;
+
+        fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"pass\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+            i ? ",\n" : "", pass->name, start_us, pass->duration_ns / 1e3);
+
+        if (pass->source_path) {
+            fprintf(file, "\"file\":\"");
+
+            for (char* c = pass->source_path; *c; ++c) {
+                if (*c == '"' || *c == '\\') {
+                    fputc('\\', file);
+                }
+
+                fputc(*c, file);
+            }
+
+            fprintf(file, "\",");
+        }
+
+        fprintf(file, "\"count_in\":%d,\"count_out\":%d,", pass->count_in, pass->count_out);
+
+        fprintf(file, "\"arena_high_water\":%zu,\"scratch_high_water\":%zu,\"sb_arena_high_water\":%zu,\"sb_scratch_high_water\":%zu}}",
+            pass->arena_high_water, pass->scratch_high_water, pass->sb_arena_high_water, pass->sb_scratch_high_water);
+
+        fprintf(file, ",\n{\"name\":\"memory\",\"ph\":\"C\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"args\":{", end_us);
+
+        fprintf(file, "\"arena\":%zu,\"scratch\":%zu,\"sb_arena\":%zu,\"sb_scratch\":%zu,\"sb_graph_live\":%zu,\"sb_graph_free\":%zu}}",
+            pass->arena_high_water, pass->scratch_high_water, pass->sb_arena_high_water, pass->sb_scratch_high_water,
+            pass->sb_graph_live_bytes, pass->sb_graph_free_bytes);
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "internal.h"
+#include "backend/sb.h"
+
+// Counts that don't apply to a pass are recorded as -1
+
+typedef struct {
+    char* name;
+    char* source_path;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+
+    int count_in;
+    int count_out;
+
+    size_t arena_high_water;
+    size_t scratch_high_water;
+    size_t sb_arena_high_water;
+    size_t sb_scratch_high_water;
+    size_t sb_graph_live_bytes;
+    size_t sb_graph_free_bytes;
+} PassTiming;
+
+typedef struct {
+    bool enabled;
+    uint64_t origin_ns;
+
+    Arena* arena;
+    ScratchLibrary* scratch_library;
+    SB_Context* sb_context;
+    char* source_path;
+
+    int count;
+    int capacity;
+    PassTiming* passes;
+} PassTimer;
+
+void init_pass_timer(PassTimer* timer, bool enabled, Arena* arena, ScratchLibrary* scratch_library);
+void free_pass_timer(PassTimer* timer);
+
+void pass_begin(PassTimer* timer, char* name);
+void pass_end(PassTimer* timer);
+void pass_counts(PassTimer* timer, int count_in, int count_out);
+
+void print_pass_timings(PassTimer* timer, FILE* file);
+bool write_pass_trace(PassTimer* timer, char* path);
\ No newline at end of file
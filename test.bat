@@ -0,0 +1,16 @@
+@echo off
+
+if not exist build/tests/ mkdir build\tests
+
+set options=-nologo -W4 -WX
+set options=%options% -D_DEBUG -Zi
+set options=%options% -Fobuild/tests/ -Fdbuild/tests/ -Isrc/
+set sources=src/internal.c src/platform.c src/frontend/*.c src/backend/*.c
+
+cl %options% -Febuild/tests/x64_encode_test.exe tests/x64_encode_test.c %sources% || exit /b 1
+cl %options% -Febuild/tests/guarded_division_test.exe tests/guarded_division_test.c %sources% || exit /b 1
+cl %options% -Febuild/tests/deep_pipeline_test.exe tests/deep_pipeline_test.c bench/generate.c %sources% || exit /b 1
+
+build\tests\x64_encode_test.exe || exit /b 1
+build\tests\guarded_division_test.exe || exit /b 1
+build\tests\deep_pipeline_test.exe
@@ -0,0 +1,90 @@
+// Compiles and runs the deepest generated programs on a small stack. A
+// million-line chain only gets through if no pass recurses along it.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "frontend/frontend.h"
+#include "backend/sb.h"
+#include "platform.h"
+
+#include "../bench/generate.h"
+
+#define LINE_COUNT 1000000
+#define STACK_SIZE (256 * 1024)
+
+static ScratchLibrary global_scratch_library;
+
+Scratch get_global_scratch(int conflict_count, Arena** conflicts) {
+    return scratch_get(&global_scratch_library, conflict_count, conflicts);
+}
+
+typedef struct {
+    GeneratedSource* source;
+    bool ran;
+    int64_t result;
+} Job;
+
+static void compile_and_run(void* argument) {
+    Job* job = argument;
+    Arena arena = init_arena(ARENA_RESERVE_SIZE);
+
+    HIR_Proc* hir_proc = parse(&arena, "<generated>", job->source->data);
+
+    if (hir_proc) {
+        SB_Context* context = sb_init();
+        SB_Proc* proc = hir_lower(context, hir_proc);
+
+        sb_mem2reg(context, proc);
+        sb_sccp(context, proc);
+        sb_opt(context, proc);
+        sb_compact(context, proc);
+
+        job->ran = sb_run_x64(context, proc, &job->result);
+        sb_free(context);
+    }
+
+    release_arena(&arena);
+}
+
+// Both shapes leave x at 8 after their opening loop and double it on every
+// `x = x + x;`, a doubling of zero being zero whether the if runs or not
+static int64_t expected_result(GeneratedSource* source) {
+    uint64_t x = 8;
+
+    for (char* line = strstr(source->data, "x = x + x;"); line; line = strstr(line + 1, "x = x + x;")) {
+        x += x;
+    }
+
+    return (int64_t)x;
+}
+
+static bool check_shape(Shape shape) {
+    GeneratedSource source = generate_source(shape, LINE_COUNT);
+    Job job = { .source = &source };
+
+    bool passed = run_thread(STACK_SIZE, compile_and_run, &job) && job.ran &&
+        job.result == expected_result(&source);
+
+    if (passed) {
+        printf("%s: %d lines returned %lld\n", shape_name[shape], source.line_count, (long long)job.result);
+    }
+    else {
+        printf("FAIL %s: %d lines, expected %lld, got %lld\n", shape_name[shape], source.line_count,
+            (long long)expected_result(&source), (long long)job.result);
+    }
+
+    free_generated_source(&source);
+    return passed;
+}
+
+int main() {
+    init_scratch_library(&global_scratch_library, ARENA_RESERVE_SIZE);
+
+    bool passed = check_shape(SHAPE_STORE_CHAIN);
+    passed &= check_shape(SHAPE_BLOCK_CHAIN);
+
+    free_scratch_library(&global_scratch_library);
+
+    return passed ? 0 : 1;
+}
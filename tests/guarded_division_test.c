@@ -0,0 +1,122 @@
+// Runs programs whose divisions are only safe under a guard. The divisor is
+// zero at run time, but SCCP can't tell, so a division scheduled above its
+// guard kills the test with a divide error.
+
+#include <stdio.h>
+
+#include "frontend/frontend.h"
+#include "backend/sb.h"
+
+static ScratchLibrary global_scratch_library;
+
+Scratch get_global_scratch(int conflict_count, Arena** conflicts) {
+    return scratch_get(&global_scratch_library, conflict_count, conflicts);
+}
+
+static int failures;
+
+// y ends up as 6 - 6 by way of a loop, c as 6
+#define OPAQUE_ZERO \
+    "var y; var c; var n; n = 3; y = 0; c = 0;" \
+    "while n { y = y + n; c = c + n; n = n - 1; }" \
+    "y = y - 6;"
+
+static void check(char* name, char* source, int64_t expected) {
+    Arena arena = init_arena(ARENA_RESERVE_SIZE);
+    HIR_Proc* hir_proc = parse(&arena, name, source);
+
+    bool ran = false;
+    int64_t result = 0;
+
+    if (hir_proc) {
+        SB_Context* context = sb_init();
+        SB_Proc* proc = hir_lower(context, hir_proc);
+
+        sb_mem2reg(context, proc);
+        sb_sccp(context, proc);
+        sb_opt(context, proc);
+        sb_compact(context, proc);
+
+        ran = sb_run_x64(context, proc, &result);
+        sb_free(context);
+    }
+
+    if (!ran || result != expected) {
+        failures++;
+        printf("FAIL %s: expected %lld, got %lld\n", name, (long long)expected, (long long)result);
+    }
+
+    release_arena(&arena);
+}
+
+// The same division on both sides of an if, each under its own test
+static void test_both_arms() {
+    check("both arms",
+        "{ var s; s = 7;" OPAQUE_ZERO
+        "if c { if y { s = 100 / y; } } else { if y { s = 100 / y + 1; } }"
+        "return s; }",
+        7);
+}
+
+// Value numbering merges divisions only when they share a control
+static void test_value_numbering() {
+    SB_Context* context = sb_init();
+
+    SB_Node* start = sb_node_start(context);
+    SB_Node* branch = sb_node_branch(context, sb_node_start_control(context, start), sb_node_alloca(context));
+    SB_Node* on_true = sb_node_branch_true(context, branch);
+    SB_Node* on_false = sb_node_branch_false(context, branch);
+
+    SB_Node* dividend = sb_node_integer_constant(context, 100);
+    SB_Node* divisor = sb_node_alloca(context);
+
+    SB_Node* a = sb_node_sdiv(context, on_true, dividend, divisor);
+    SB_Node* b = sb_node_sdiv(context, on_false, dividend, divisor);
+    SB_Node* c = sb_node_sdiv(context, on_true, dividend, divisor);
+
+    if (a == b || a != c) {
+        failures++;
+        printf("FAIL value numbering: divisions under different controls %s, under the same control %s\n",
+            a == b ? "merged" : "kept apart", a == c ? "merged" : "kept apart");
+    }
+
+    sb_free(context);
+}
+
+// The same division after two unrelated guards
+static void test_one_after_another() {
+    check("one after another",
+        "{ var s; var t; s = 1; t = 2;" OPAQUE_ZERO
+        "if y { s = 100 / y; }"
+        "if c { if y { t = 100 / y; } }"
+        "return s + t; }",
+        3);
+}
+
+// An invariant division under a test inside a loop, which mustn't be hoisted out
+static void test_loop() {
+    check("loop",
+        "{ var s; var i; s = 3; i = 5;" OPAQUE_ZERO
+        "while i { if y { s = s + 100 / y; } i = i - 1; }"
+        "return s; }",
+        3);
+}
+
+int main() {
+    init_scratch_library(&global_scratch_library, ARENA_RESERVE_SIZE);
+
+    test_both_arms();
+    test_one_after_another();
+    test_value_numbering();
+    test_loop();
+
+    free_scratch_library(&global_scratch_library);
+
+    if (failures) {
+        printf("%d guarded division checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all guarded division checks passed\n");
+    return 0;
+}
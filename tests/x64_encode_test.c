@@ -0,0 +1,242 @@
+// Byte-exact checks of the x64 encoder against encodings from GNU as
+
+#include <stdio.h>
+
+#include "backend/x64_internal.h"
+
+static Arena arena;
+static SB_Context* context;
+static int failures;
+
+static X64_Operand reg(int r) {
+    return (X64_Operand) { .kind = X64_OPERAND_REGISTER, .reg = r, .slot = X64_NO_SLOT };
+}
+
+static X64_Operand imm(int64_t value) {
+    return (X64_Operand) { .kind = X64_OPERAND_IMMEDIATE, .immediate = value, .slot = X64_NO_SLOT };
+}
+
+static X64_Operand mem(int base, int64_t displacement) {
+    return (X64_Operand) { .kind = X64_OPERAND_MEMORY, .reg = base, .immediate = displacement, .slot = X64_NO_SLOT };
+}
+
+static X64_Operand slot(int index) {
+    return (X64_Operand) { .kind = X64_OPERAND_MEMORY, .slot = index };
+}
+
+static X64_Operand target(X64_Block* block) {
+    return (X64_Operand) { .kind = X64_OPERAND_BLOCK, .block = block, .slot = X64_NO_SLOT };
+}
+
+static X64_Block* add_block(X64_Function* function) {
+    X64_Block* block = arena_type(&arena, X64_Block);
+    block->id = function->block_count++;
+
+    X64_Block** link = &function->blocks;
+
+    while (*link) {
+        link = &(*link)->next;
+    }
+
+    *link = block;
+    return block;
+}
+
+static void add_inst(X64_Block* block, X64_OpCode op, int operand_count, X64_Operand* operands) {
+    X64_Inst* inst = arena_type(&arena, X64_Inst);
+    inst->op = op;
+    inst->operand_count = operand_count;
+
+    for (int i = 0; i < operand_count; ++i) {
+        inst->operands[i] = operands[i];
+    }
+
+    if (block->end) {
+        block->end->next = inst;
+        inst->prev = block->end;
+    }
+    else {
+        block->start = inst;
+    }
+
+    block->end = inst;
+}
+
+#define INST(block, op, ...) add_inst(block, X64_OP_##op, \
+    sizeof((X64_Operand[]) { __VA_ARGS__ }) / sizeof(X64_Operand), (X64_Operand[]) { __VA_ARGS__ })
+
+// Pads a block with exactly `size` bytes of 7- and 3-byte movs
+static void add_filler(X64_Block* block, int size) {
+    while (size % 3) {
+        INST(block, MOV, reg(X64_RAX), imm(0x12345678));
+        size -= 7;
+    }
+
+    for (; size; size -= 3) {
+        INST(block, MOV, reg(X64_RAX), reg(X64_RCX));
+    }
+}
+
+// push rbp; mov rbp, rsp
+static const uint8_t prologue[] = { 0x55, 0x48, 0x89, 0xe5 };
+
+// Compares `expected` against the code `offset` bytes past the prologue, and
+// checks the code after the prologue is `size` bytes long
+static void check(char* name, X64_Function* function, int offset, int size, int expected_size, const uint8_t* expected) {
+    X64_Code code = x64_encode(&arena, context, function);
+    uint8_t* body = code.data + sizeof(prologue);
+
+    bool same = code.size == (int)sizeof(prologue) + size &&
+        memcmp(code.data, prologue, sizeof(prologue)) == 0 &&
+        memcmp(body + offset, expected, expected_size) == 0;
+
+    if (same) {
+        return;
+    }
+
+    failures++;
+    printf("FAIL %s\n  expected:", name);
+
+    for (int i = 0; i < expected_size; ++i) {
+        printf(" %02x", expected[i]);
+    }
+
+    printf(" (%d bytes in all)\n  actual:  ", size);
+
+    for (int i = offset; i < offset + expected_size && i < code.size - (int)sizeof(prologue); ++i) {
+        printf(" %02x", body[i]);
+    }
+
+    printf(" (%d bytes in all)\n", code.size - (int)sizeof(prologue));
+}
+
+#define BYTES(...) sizeof((uint8_t[]) { __VA_ARGS__ }), (uint8_t[]) { __VA_ARGS__ }
+
+// One instruction in an otherwise empty function
+#define CHECK_INST(op, operands, ...) do { \
+        X64_Function function = {0}; \
+        X64_Block* block = add_block(&function); \
+        INST(block, op, UNPACK operands); \
+        check(#op " " #operands, &function, 0, sizeof((uint8_t[]) { __VA_ARGS__ }), BYTES(__VA_ARGS__)); \
+    } while (0)
+
+#define UNPACK(...) __VA_ARGS__
+
+static void test_registers() {
+    CHECK_INST(MOV, (reg(X64_RAX), reg(X64_RCX)), 0x48, 0x89, 0xc8);
+    CHECK_INST(MOV, (reg(X64_R8), reg(X64_RAX)), 0x49, 0x89, 0xc0);
+    CHECK_INST(MOV, (reg(X64_RAX), reg(X64_R9)), 0x4c, 0x89, 0xc8);
+    CHECK_INST(MOV, (reg(X64_R15), reg(X64_R12)), 0x4d, 0x89, 0xe7);
+    CHECK_INST(IMUL, (reg(X64_RDX), reg(X64_R8)), 0x49, 0x0f, 0xaf, 0xd0);
+    CHECK_INST(IDIV, (reg(X64_R13)), 0x49, 0xf7, 0xfd);
+    CHECK_INST(TEST, (reg(X64_RAX), reg(X64_RAX)), 0x48, 0x85, 0xc0);
+}
+
+static void test_memory() {
+    // rsp and r12 bases need a SIB byte
+    CHECK_INST(MOV, (reg(X64_RAX), mem(X64_RSP, 0)), 0x48, 0x8b, 0x04, 0x24);
+    CHECK_INST(MOV, (reg(X64_RAX), mem(X64_R12, 8)), 0x49, 0x8b, 0x44, 0x24, 0x08);
+    CHECK_INST(MOV, (mem(X64_RSP, 0x200), reg(X64_RCX)), 0x48, 0x89, 0x8c, 0x24, 0x00, 0x02, 0x00, 0x00);
+    CHECK_INST(MOV, (mem(X64_R12, 0), reg(X64_R9)), 0x4d, 0x89, 0x0c, 0x24);
+
+    // rbp and r13 bases always carry a displacement
+    CHECK_INST(MOV, (reg(X64_RAX), mem(X64_RBP, 0)), 0x48, 0x8b, 0x45, 0x00);
+    CHECK_INST(MOV, (reg(X64_RAX), mem(X64_R13, 0)), 0x49, 0x8b, 0x45, 0x00);
+    CHECK_INST(MOV, (reg(X64_RAX), mem(X64_R13, -8)), 0x49, 0x8b, 0x45, 0xf8);
+    CHECK_INST(MOV, (reg(X64_RAX), mem(X64_RBP, 0x80)), 0x48, 0x8b, 0x85, 0x80, 0x00, 0x00, 0x00);
+
+    CHECK_INST(LEA, (reg(X64_RDX), mem(X64_RBX, -0x1000)), 0x48, 0x8d, 0x93, 0x00, 0xf0, 0xff, 0xff);
+    CHECK_INST(SUB, (reg(X64_RAX), mem(X64_RBP, -8)), 0x48, 0x2b, 0x45, 0xf8);
+}
+
+static void test_immediates() {
+    CHECK_INST(ADD, (reg(X64_RAX), imm(1)), 0x48, 0x83, 0xc0, 0x01);
+    CHECK_INST(SUB, (reg(X64_R10), imm(-128)), 0x49, 0x83, 0xea, 0x80);
+    CHECK_INST(ADD, (reg(X64_RCX), imm(0x1000)), 0x48, 0x81, 0xc1, 0x00, 0x10, 0x00, 0x00);
+    CHECK_INST(ADD, (reg(X64_RAX), imm(0x1000)), 0x48, 0x05, 0x00, 0x10, 0x00, 0x00);
+
+    CHECK_INST(MOV, (reg(X64_RAX), imm(0x12345678)), 0x48, 0xc7, 0xc0, 0x78, 0x56, 0x34, 0x12);
+    CHECK_INST(MOV, (reg(X64_RAX), imm(-1)), 0x48, 0xc7, 0xc0, 0xff, 0xff, 0xff, 0xff);
+    CHECK_INST(MOV, (reg(X64_R11), imm(0x123456789)), 0x49, 0xbb, 0x89, 0x67, 0x45, 0x23, 0x01, 0x00, 0x00, 0x00);
+
+    CHECK_INST(IMUL, (reg(X64_RAX), reg(X64_RCX), imm(3)), 0x48, 0x6b, 0xc1, 0x03);
+    CHECK_INST(IMUL, (reg(X64_R9), mem(X64_R14, 0x100), imm(1000)), 0x4d, 0x69, 0x8e, 0x00, 0x01, 0x00, 0x00, 0xe8, 0x03, 0x00, 0x00);
+}
+
+static void test_implicit_operands() {
+    X64_Function function = {0};
+    X64_Block* block = add_block(&function);
+    add_inst(block, X64_OP_CQO, 0, 0);
+    add_inst(block, X64_OP_RET, 0, 0);
+
+    check("cqo; ret", &function, 0, 4, BYTES(0x48, 0x99, 0xc9, 0xc3));
+}
+
+static void test_frame() {
+    // A slot makes the prologue reserve 16 bytes with sub rsp, 16
+    X64_Function function = { .slot_count = 1 };
+    X64_Block* block = add_block(&function);
+    INST(block, MOV, reg(X64_RAX), slot(0));
+    add_inst(block, X64_OP_RET, 0, 0);
+
+    check("frame", &function, 0, 10, BYTES(0x48, 0x83, 0xec, 0x10, 0x48, 0x8b, 0x45, 0xf8, 0xc9, 0xc3));
+}
+
+// jmp over `filler` bytes to a ret, only the jmp itself is compared
+static void check_forward(char* name, int filler, int expected_size, const uint8_t* expected) {
+    X64_Function function = {0};
+    X64_Block* entry = add_block(&function);
+    X64_Block* middle = add_block(&function);
+    X64_Block* exit = add_block(&function);
+
+    INST(entry, JMP, target(exit));
+    add_filler(middle, filler);
+    add_inst(exit, X64_OP_RET, 0, 0);
+
+    check(name, &function, 0, expected_size + filler + 2, expected_size, expected);
+}
+
+// `filler` bytes followed by a jnz back to their start, then a ret
+static void check_backward(char* name, int filler, int expected_size, const uint8_t* expected) {
+    X64_Function function = {0};
+    X64_Block* loop = add_block(&function);
+    X64_Block* exit = add_block(&function);
+
+    add_filler(loop, filler);
+    INST(loop, JNZ, target(loop));
+    add_inst(exit, X64_OP_RET, 0, 0);
+
+    check(name, &function, filler, filler + expected_size, expected_size, expected);
+}
+
+// rel8 reaches 127 bytes forward and 128 back, one byte further needs rel32
+static void test_relaxation() {
+    check_forward("jmp over 127 bytes", 127, BYTES(0xeb, 0x7f));
+    check_forward("jmp over 128 bytes", 128, BYTES(0xe9, 0x80, 0x00, 0x00, 0x00));
+
+    check_backward("jnz back over 126 bytes", 126, BYTES(0x75, 0x80, 0xc9, 0xc3));
+    check_backward("jnz back over 127 bytes", 127, BYTES(0x0f, 0x85, 0x7b, 0xff, 0xff, 0xff, 0xc9, 0xc3));
+}
+
+int main() {
+    arena = init_arena(ARENA_RESERVE_SIZE);
+    context = sb_init();
+
+    test_registers();
+    test_memory();
+    test_immediates();
+    test_implicit_operands();
+    test_frame();
+    test_relaxation();
+
+    sb_free(context);
+    release_arena(&arena);
+
+    if (failures) {
+        printf("%d encoding checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all encoding checks passed\n");
+    return 0;
+}